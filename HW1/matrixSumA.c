@@ -1,14 +1,40 @@
 /* matrix summation using pthreads
 
-   features: uses a barrier; the Worker[0] computes
-             the total sum from partial sums computed by Workers
-             and prints the total sum to the standard output
+   features: uses a barrier; the Workers merge their partial
+             sums and min/max pairwise, without a lock (see
+             ../common/reduceCombiner.h), and Worker[0] takes the
+             end time once all of them are done; the total sum is
+             printed to the standard output
 
    usage under Linux:
      gcc matrixSum.c -lpthread
-     a.out size numWorkers
+     a.out [-e] [-o text|csv|json] [-r trials] [-w warmup] [-a none|compact|scatter] [-d uniform|zipf|runs|few] [-f] [-g seed] [-I file] [-O file] [-S file] [-t type] [-T RxC|auto] size numWorkers
+
+   size is N for an N x N matrix or RxC for R rows and C columns
+   type is the element type: int8, int16, int32 (default), int64,
+   float or double
+   -r/-w repeat the summation (see ../common/benchHarness.h), the
+      times printed are then the median
+   -a pins the workers to CPUs (see ../common/threadPlacement.h) and
+      -f lets every worker first touch its strip of the matrix, so on
+      a NUMA machine the pages sit next to the worker that reads them
+   -d picks the distribution of the values (0..98) and -g the seed (see
+      ../common/inputGen.h), the matrix only depends on the two, not on
+      numWorkers; it is filled in parallel
+   -I maps the matrix from a binary file instead (size and type come
+      from the file, see ../common/binaryFile.h) and -O writes the
+      matrix to one, to run on the same data again
+   -S streams a matrix file that need not fit in memory through a few
+      row buffers, reading the next block while the workers reduce
+      the last (see ../common/streamReduce.h); the times include the I/O
+   -T walks the matrix in tiles of R rows and C columns (auto: sized
+      from the caches) and computes the stats of every row, column and
+      tile in the same pass (see ../common/tileStats.h)
 
 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  /* pthread_setaffinity_np, sched_getcpu */
+#endif
 #ifndef _REENTRANT 
 #define _REENTRANT 
 #endif 
@@ -17,30 +43,30 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <time.h>
-#include <sys/time.h>
-#define MAXSIZE 10000  /* maximum matrix size */
-#define MAXWORKERS 10   /* maximum number of workers */
+#include <unistd.h>
+#include "../common/benchHarness.h"
+#include "../common/binaryFile.h"
+#include "../common/inputGen.h"
+#include "../common/matrixKernel.h"
+#include "../common/matrixStorage.h"
+#include "../common/perfCounters.h"
+#include "../common/reduceCombiner.h"
+#include "../common/streamReduce.h"
+#include "../common/threadPlacement.h"
+#include "../common/tileStats.h"
+#define DEFAULTSIZE 10000  /* default matrix size */
+#define DEFAULTWORKERS 10   /* default number of workers */
 
 pthread_mutex_t barrier;  /* mutex lock for the barrier */
 pthread_cond_t go;        /* condition variable for leaving */
 int numWorkers;           /* number of workers */ 
 int numArrived = 0;       /* number who have arrived */
 
-// A structure to store the matrix statistics i.e the min/max values
-typedef struct {
-    int max_value;
-    int min_value;
-    int min_row;
-    int min_col;
-    int max_row;
-    int max_col;
-} MatrixStats;
-
 // variable to hold the final values of the matrix statistics
 MatrixStats globalStats;
 
-// mutex that protects the global value
-pthread_mutex_t statsMutex;
+// a slot of partial stats per worker, merged without a lock
+ReduceCombiner combiner;
 
 
 /* a reusable counter barrier */
@@ -55,33 +81,24 @@ void Barrier() {
   pthread_mutex_unlock(&barrier);
 }
 
-/* timer */
-double read_timer() {
-    static bool initialized = false;
-    static struct timeval start;
-    struct timeval end;
-    if( !initialized )
-    {
-        gettimeofday( &start, NULL );
-        initialized = true;
-    }
-    gettimeofday( &end, NULL );
-    return (end.tv_sec - start.tv_sec) + 1.0e-6 * (end.tv_usec - start.tv_usec);
-}
-
-double start_time, end_time; /* start and end times */
-int size, stripSize;  /* assume size is multiple of numWorkers */
-int sums[MAXWORKERS]; /* partial sums */
-int matrix[MAXSIZE][MAXSIZE]; /* matrix */
+BenchRun benchRun; /* times every summation */
+PerfCounters perf; /* -e: counters of every worker */
+PinPolicy pinPolicy = PIN_NONE; /* -a: where the workers run */
+int *workerCpus; /* the CPU every worker last ran on */
+int rows, cols, stripSize;  /* assume rows is multiple of numWorkers */
+Matrix matrix; /* matrix */
+int tiled = 0; /* -T: row, column and tile stats too */
+TileStats tiles;
 
 void *Worker(void *);
+void tileReport(void);
+int streamSum(const char *path, BenchConfig *bench);
 
 /* read command line, initialize, and create threads */
 int main(int argc, char *argv[]) {
-  int i, j;
   long l; /* use long in case of a 64-bit system */
   pthread_attr_t attr;
-  pthread_t workerid[MAXWORKERS];
+  pthread_t *workerid;
   
 
   /* set global thread attributes */
@@ -92,118 +109,235 @@ int main(int argc, char *argv[]) {
   pthread_mutex_init(&barrier, NULL);
   pthread_cond_init(&go, NULL);
 
-    // initialize the mutexlock
- pthread_mutex_init(&statsMutex, NULL);
-
-
   /* read command line args if any */
-  size = (argc > 1)? atoi(argv[1]) : MAXSIZE;
-  numWorkers = (argc > 2)? atoi(argv[2]) : MAXWORKERS;
-  if (size > MAXSIZE) size = MAXSIZE;
-  if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
-  stripSize = size/numWorkers;
-
-  /* initialize the matrix */
-  for (i = 0; i < size; i++) {
-	  for (j = 0; j < size; j++) {
-          matrix[i][j] = rand()%99;
-	  }
+  int opt, firstTouch = 0, badArgs = 0;
+  GenDist dist = DIST_UNIFORM;
+  unsigned long long seed = GEN_DEFAULT_SEED;
+  const char *inputFile = NULL, *outputFile = NULL, *streamFile = NULL;
+  MatrixType type = MT_INT32;
+  int tileRows = 0, tileCols = 0; /* 0: sized from the caches */
+  BenchConfig bench;
+  benchDefaults(&bench, 0, 1);
+  while ((opt = getopt(argc, argv, "a:d:efg:I:o:O:r:S:t:T:w:")) != -1) {
+    int harness = benchOption(&bench, opt, optarg);
+    if (harness < 0)
+      badArgs = 1;
+    else if (harness == 0 && opt == 'a' && parsePinPolicy(optarg) >= 0)
+      pinPolicy = (PinPolicy) parsePinPolicy(optarg);
+    else if (harness == 0 && opt == 'd' && parseGenDist(optarg) >= 0)
+      dist = (GenDist) parseGenDist(optarg);
+    else if (harness == 0 && opt == 'f')
+      firstTouch = 1;
+    else if (harness == 0 && opt == 'g')
+      seed = strtoull(optarg, NULL, 10);
+    else if (harness == 0 && opt == 'I')
+      inputFile = optarg;
+    else if (harness == 0 && opt == 'O')
+      outputFile = optarg;
+    else if (harness == 0 && opt == 'S')
+      streamFile = optarg;
+    else if (harness == 0 && opt == 't' && parseMatrixType(optarg) >= 0)
+      type = (MatrixType) parseMatrixType(optarg);
+    else if (harness == 0 && opt == 'T' && (strcmp(optarg, "auto") == 0 || parseDims(optarg, &tileRows, &tileCols) == 0))
+      tiled = 1;
+    else if (harness == 0)
+      badArgs = 1;
+  }
+  rows = cols = DEFAULTSIZE;
+  if (badArgs || (argc > optind && parseDims(argv[optind], &rows, &cols) != 0)) {
+    fprintf(stderr, "usage: %s " BENCH_USAGE " [-a none|compact|scatter] [-d uniform|zipf|runs|few] [-f] [-g seed] [-I file] [-O file] [-S file] [-t type] [-T RxC|auto] size|RxC numWorkers\n", argv[0]);
+    return 1;
+  }
+  numWorkers = (argc > optind + 1)? atoi(argv[optind + 1]) : DEFAULTWORKERS;
+  if (numWorkers < 1) numWorkers = 1;
+  if (streamFile)
+    return streamSum(streamFile, &bench);
+  workerid = malloc(sizeof(pthread_t) * numWorkers);
+  workerCpus = malloc(sizeof(int) * numWorkers);
+
+  /* allocate and initialize the matrix, or map it from the -I file */
+  if (inputFile) {
+    if (loadMatrix(&matrix, inputFile, BIN_POPULATE) != 0)
+      return 1;
+    rows = matrix.rows;
+    cols = matrix.cols;
+    type = matrix.type;
+  } else {
+    if (allocMatrix(&matrix, rows, cols, type) != 0) {
+      fprintf(stderr, "cannot allocate a %dx%d matrix\n", rows, cols);
+      return 1;
+    }
+    GenSpec gen;
+    GenMatrix fill = { &gen, &matrix };
+    if (genInit(&gen, dist, seed, 99) != 0) {
+      fprintf(stderr, "cannot allocate the input generator\n");
+      return 1;
+    }
+    if (firstTouch)
+      firstTouchStrips(&matrix, numWorkers, pinPolicy, genMatrixRows, &fill);
+    else
+      genFillMatrix(&fill, genDefaultThreads());
+    genFree(&gen);
+  }
+  if (outputFile && saveMatrix(&matrix, outputFile) != 0)
+    return 1;
+  stripSize = rows/numWorkers;
+  if (combinerInit(&combiner, numWorkers, sizeof(MatrixStats), combineStats) != 0) {
+    fprintf(stderr, "cannot allocate the worker stats\n");
+    return 1;
+  }
+  if (tiled && tileStatsInit(&tiles, &matrix, tileRows, tileCols, numWorkers) != 0) {
+    fprintf(stderr, "cannot allocate the tile stats\n");
+    return 1;
   }
 
   /* print the matrix */
 #ifdef DEBUG
-  for (i = 0; i < size; i++) {
+  int i, j;
+  for (i = 0; i < rows; i++) {
 	  printf("[ ");
-	  for (j = 0; j < size; j++) {
-	    printf(" %d", matrix[i][j]);
+	  for (j = 0; j < cols; j++) {
+	    char buf[32];
+	    printf(" %s", formatValue(buf, type, matrixGet(&matrix, i, j)));
 	  }
 	  printf(" ]\n");
   }
 #endif
 
-//global stat values are predefined
- globalStats.min_value = 99;
- globalStats.max_value = 0;
+  perfInit(&perf, &bench, numWorkers);
+  benchHeader(&bench);
+  perfBegin(&perf);
+  benchBegin(&benchRun, &bench);
+  while (benchNext(&benchRun)) {
+    //global stat values are predefined
+    initStats(&globalStats, type);
+
+    /* do the parallel work: create the workers, Worker[0] stops the clock */
+    benchStart(&benchRun);
+    for (l = 0; l < numWorkers; l++)
+      pthread_create(&workerid[l], &attr, Worker, (void *) l);
+    for (l = 0; l < numWorkers; l++)
+      pthread_join(workerid[l], NULL);
+  }
 
-  /* do the parallel work: create the workers */
-  start_time = read_timer();
-  for (l = 0; l < numWorkers; l++)
-    pthread_create(&workerid[l], &attr, Worker, (void *) l);
-  pthread_exit(NULL);
+  /* print results */
+  if (bench.format == BENCH_TEXT) {
+    char sum[32], min[32], max[32];
+    printf("The total is %s\n", formatValue(sum, type, globalStats.sum));
+    printf("The execution time is %g sec\n", benchRun.median);
+
+    // print the global stats
+    printf("Min Value: %s at (%d, %d)\n", formatValue(min, type, globalStats.min_value), globalStats.min_row, globalStats.min_col);
+    printf("Max Value: %s at (%d, %d)\n", formatValue(max, type, globalStats.max_value), globalStats.max_row, globalStats.max_col);
+    if (tiled)
+      tileReport();
+    if (pinPolicy != PIN_NONE || firstTouch)
+      placementReport(workerCpus, numWorkers);
+  }
+  perfReport(&perf, &benchRun, "matrixSumA", matrixTypeNames[type], (long long) rows * cols, numWorkers,
+             (double) rows * cols * matrix.elemSize);
+
+  perfDestroy(&perf);
+  free(workerCpus);
+  free(workerid);
+  combinerDestroy(&combiner);
+  if (tiled)
+    tileStatsFree(&tiles);
+  freeMatrix(&matrix);
+  return 0;
 }
 
 /* Each worker sums the values in one strip of the matrix.
-   After a barrier, worker(0) computes and prints the total */
+   After a barrier, worker(0) takes the end time */
 void *Worker(void *arg) {
-MatrixStats localStats;
   long myid = (long) arg;
-  int total, i, j, first, last;
+  MatrixStats *localStats = combinerSlot(&combiner, myid);
+  int first, last;
 
 #ifdef DEBUG
   printf("worker %d (pthread id %d) has started\n", myid, pthread_self());
 #endif
 
+  pinWorker(pinPolicy, myid);
+
   /* determine first and last rows of my strip */
   first = myid*stripSize;
-  last = (myid == numWorkers - 1) ? (size - 1) : (first + stripSize - 1);
-
-
-  // local stats for each worker
-  localStats.min_value = 99;
-  localStats.max_value = 0;
-  localStats.min_row   = 0;
-  localStats.min_col   = 0;
-  localStats.max_row   = 0;
-  localStats.max_col   = 0;
-
-  /* sum values in my strip */
-  total = 0;
-  for (i = first; i <= last; i++) {
-    for (j = 0; j < size; j++) {
-      total += matrix[i][j];
-      if(localStats.max_value < matrix[i][j]){
-        localStats.max_value = matrix[i][j];
-        localStats.max_row = i;
-        localStats.max_col = j;
-      }
-      if(localStats.min_value > matrix[i][j]){
-        localStats.min_value = matrix[i][j];
-        localStats.min_row = i;
-        localStats.min_col = j;
-      }
-    }
-  }
+  last = (myid == numWorkers - 1) ? (rows - 1) : (first + stripSize - 1);
+
+
+  /* sum values in my strip, local stats for each worker */
+  PerfThread counters;
+  perfThreadOpen(&perf, &counters, 0);
+  perfThreadStart(&counters);
+  if (tiled) {
+    /* my band of tiles, then my share of the columns of all bands */
+    tileStatsBand(&tiles, &matrix, myid, numWorkers);
+    Barrier();
+    tileStatsColumns(&tiles, myid, numWorkers);
+  } else {
+    initStats(localStats, matrix.type);
+    reduceRows(&matrix, first, last, localStats);
   
-  // updates the global stats, done safely via the mutex locks
-  pthread_mutex_lock(&statsMutex);
-  if (localStats.max_value > globalStats.max_value) {
-    globalStats.max_value = localStats.max_value;
-    globalStats.max_row = localStats.max_row;
-    globalStats.max_col = localStats.max_col;
+    // the last worker to finish ends up with everything
+    if (combinerArrive(&combiner, myid))
+      globalStats = *(MatrixStats *) combinerResult(&combiner);
   }
-  if (localStats.min_value < globalStats.min_value) {
-    globalStats.min_value = localStats.min_value;
-    globalStats.min_row = localStats.min_row;
-    globalStats.min_col = localStats.min_col;
-  }
-  pthread_mutex_unlock(&statsMutex);
+  perfThreadStop(&perf, &counters, myid, &benchRun);
+  perfThreadClose(&counters);
 
-  sums[myid] = total;
   Barrier();
 
   if (myid == 0) {
-    total = 0;
-    for (i = 0; i < numWorkers; i++)
-      total += sums[i];
+    if (tiled)
+      globalStats = tiles.global;
     /* get end time */
-    end_time = read_timer();
-    /* print results */
-    printf("The total is %d\n", total);
-    printf("The execution time is %g sec\n", end_time - start_time);
-
-    // print the global stats
-    printf("Min Value: %d at (%d, %d)\n", globalStats.min_value, globalStats.min_row, globalStats.min_col);
-    printf("Max Value: %d at (%d, %d)\n", globalStats.max_value, globalStats.max_row, globalStats.max_col);
+    benchStop(&benchRun);
   }  
 
+  workerCpus[myid] = sched_getcpu();
+  return NULL;
+}
+
+/* -S: reduce the matrix file at path while it is read, block by block */
+int streamSum(const char *path, BenchConfig *bench) {
+  StreamInfo info;
+
+  perfInit(&perf, bench, numWorkers);
+  benchHeader(bench);
+  perfBegin(&perf);
+  benchBegin(&benchRun, bench);
+  while (benchNext(&benchRun)) {
+    benchStart(&benchRun);
+    if (streamReduce(path, numWorkers, STREAM_BLOCK_BYTES, &globalStats, &info, &perf, &benchRun) != 0)
+      return 1;
+    benchStop(&benchRun);
+  }
+
+  MatrixType type = info.type;
+  if (bench->format == BENCH_TEXT) {
+    char sum[32], min[32], max[32];
+    printf("The total is %s\n", formatValue(sum, type, globalStats.sum));
+    printf("The execution time is %g sec\n", benchRun.median);
+    printf("Min Value: %s at (%d, %d)\n", formatValue(min, type, globalStats.min_value), globalStats.min_row, globalStats.min_col);
+    printf("Max Value: %s at (%d, %d)\n", formatValue(max, type, globalStats.max_value), globalStats.max_row, globalStats.max_col);
+    printf("Streamed %lld bytes in blocks of %d rows: %g GB/s, reader busy %g sec, workers waited up to %g sec\n",
+           info.bytes, info.blockRows, info.bytes / benchRun.median * 1e-9, info.readSeconds, info.waitSeconds);
+  }
+  perfReport(&perf, &benchRun, "matrixSumA", matrixTypeNames[type], (long long) info.rows * info.cols, numWorkers,
+             (double) info.bytes);
+  perfDestroy(&perf);
+  return 0;
+}
+
+/* -T: the tile size and the row, column and tile with the largest sums */
+void tileReport(void) {
+  char sum[32];
+  int row = tileLargestSum(tiles.rowStats, rows);
+  int col = tileLargestSum(tiles.colStats, cols);
+  int tile = tileLargestSum(tiles.tileStats, tiles.gridRows * tiles.gridCols);
+  printf("Tiles of %dx%d (%dx%d of them)\n", tiles.tileRows, tiles.tileCols, tiles.gridRows, tiles.gridCols);
+  printf("Largest row sum: %s in row %d\n", formatValue(sum, matrix.type, tiles.rowStats[row].sum), row);
+  printf("Largest column sum: %s in column %d\n", formatValue(sum, matrix.type, tiles.colStats[col].sum), col);
+  printf("Largest tile sum: %s in tile (%d, %d)\n", formatValue(sum, matrix.type, tiles.tileStats[tile].sum),
+         tile / tiles.gridCols, tile % tiles.gridCols);
 }
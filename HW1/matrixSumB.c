@@ -1,14 +1,33 @@
 /* matrix summation using pthreads
 
-   features: uses a barrier; the Worker[0] computes
-             the total sum from partial sums computed by Workers
-             and prints the total sum to the standard output
+   features: the Workers merge their partial sums and min/max
+             pairwise, without a lock (see ../common/reduceCombiner.h),
+             and the main thread prints the total sum to the
+             standard output
 
    usage under Linux:
      gcc matrixSum.c -lpthread
-     a.out size numWorkers
+     a.out [-e] [-o text|csv|json] [-r trials] [-w warmup] [-a none|compact|scatter] [-d uniform|zipf|runs|few] [-f] [-g seed] [-I file] [-O file] [-t type] size numWorkers
+
+   size is N for an N x N matrix or RxC for R rows and C columns
+   type is the element type: int8, int16, int32 (default), int64,
+   float or double
+   -r/-w repeat the summation (see ../common/benchHarness.h), the
+      times printed are then the median
+   -a pins the workers to CPUs (see ../common/threadPlacement.h) and
+      -f lets every worker first touch its strip of the matrix, so on
+      a NUMA machine the pages sit next to the worker that reads them
+   -d picks the distribution of the values (0..98) and -g the seed (see
+      ../common/inputGen.h), the matrix only depends on the two, not on
+      numWorkers; it is filled in parallel
+   -I maps the matrix from a binary file instead (size and type come
+      from the file, see ../common/binaryFile.h) and -O writes the
+      matrix to one, to run on the same data again
 
 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  /* pthread_setaffinity_np, sched_getcpu */
+#endif
 #ifndef _REENTRANT 
 #define _REENTRANT 
 #endif 
@@ -17,62 +36,44 @@
 #include <stdio.h>
 #include <stdbool.h> 
 #include <time.h>
-#include <sys/time.h>
-#define MAXSIZE 10000  /* maximum matrix size */
-#define MAXWORKERS 10   /* maximum number of workers */
+#include <unistd.h>
+#include "../common/benchHarness.h"
+#include "../common/binaryFile.h"
+#include "../common/inputGen.h"
+#include "../common/matrixKernel.h"
+#include "../common/matrixStorage.h"
+#include "../common/perfCounters.h"
+#include "../common/reduceCombiner.h"
+#include "../common/threadPlacement.h"
+#define DEFAULTSIZE 10000  /* default matrix size */
+#define DEFAULTWORKERS 10   /* default number of workers */
 
 /* pthread_mutex_t barrier; */  /* mutex lock for the barrier */
 pthread_cond_t go;        /* condition variable for leaving */
 int numWorkers;           /* number of workers */ 
 int numArrived = 0;       /* number who have arrived */
 
-// A structure to store the matrix statistics i.e the min/max values
-typedef struct {
-    int max_value;
-    int min_value;
-    int min_row;
-    int min_col;
-    int max_row;
-    int max_col;
-} MatrixStats;
-
 // variable to hold the final values of the matrix statistics
 MatrixStats globalStats;
 
-// mutex that protects the global value
-pthread_mutex_t statsMutex;
-
-//taskb - mutex that protects the global sum
-pthread_mutex_t sumMutex; 
-long globalSum = 0;
-
-/* timer */
-double read_timer() {
-    static bool initialized = false;
-    static struct timeval start;
-    struct timeval end;
-    if( !initialized )
-    {
-        gettimeofday( &start, NULL );
-        initialized = true;
-    }
-    gettimeofday( &end, NULL );
-    return (end.tv_sec - start.tv_sec) + 1.0e-6 * (end.tv_usec - start.tv_usec);
-}
+// a slot of partial stats per worker, merged without a lock
+ReduceCombiner combiner;
 
-double start_time, end_time; /* start and end times */
-int size, stripSize;  /* assume size is multiple of numWorkers */
-/* int sums[MAXWORKERS]; /* partial sums */
-int matrix[MAXSIZE][MAXSIZE]; /* matrix */
+//taskb - the global sum (globalStats.sum) is 64-bit, the last worker to finish sets it
+
+BenchRun benchRun; /* times every summation */
+PerfCounters perf; /* -e: counters of every worker */
+PinPolicy pinPolicy = PIN_NONE; /* -a: where the workers run */
+int *workerCpus; /* the CPU every worker last ran on */
+int rows, cols, stripSize;  /* assume rows is multiple of numWorkers */
+Matrix matrix; /* matrix */
 
 void *Worker(void *);
 
 /* read command line, initialize, and create threads */
 int main(int argc, char *argv[]) {
-  int i, j;
-  long l; /* use long in case of a 64-bit system */
   pthread_attr_t attr;
-  pthread_t workerid[MAXWORKERS];
+  pthread_t *workerid;
   
 
   /* set global thread attributes */
@@ -83,124 +84,168 @@ int main(int argc, char *argv[]) {
 /*   pthread_mutex_init(&barrier, NULL); */
   pthread_cond_init(&go, NULL);
 
-    // initialize the mutexlock
- pthread_mutex_init(&statsMutex, NULL);
 
 
   /* read command line args if any */
-  size = (argc > 1)? atoi(argv[1]) : MAXSIZE;
-  numWorkers = (argc > 2)? atoi(argv[2]) : MAXWORKERS;
-  if (size > MAXSIZE) size = MAXSIZE;
-  if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
-  stripSize = size/numWorkers;
-
-  /* initialize the matrix */
-  for (i = 0; i < size; i++) {
-	  for (j = 0; j < size; j++) {
-          matrix[i][j] = rand()%99;
-	  }
+  int opt, firstTouch = 0, badArgs = 0;
+  GenDist dist = DIST_UNIFORM;
+  unsigned long long seed = GEN_DEFAULT_SEED;
+  const char *inputFile = NULL, *outputFile = NULL;
+  MatrixType type = MT_INT32;
+  BenchConfig bench;
+  benchDefaults(&bench, 0, 1);
+  while ((opt = getopt(argc, argv, "a:d:efg:I:o:O:r:t:w:")) != -1) {
+    int harness = benchOption(&bench, opt, optarg);
+    if (harness < 0)
+      badArgs = 1;
+    else if (harness == 0 && opt == 'a' && parsePinPolicy(optarg) >= 0)
+      pinPolicy = (PinPolicy) parsePinPolicy(optarg);
+    else if (harness == 0 && opt == 'd' && parseGenDist(optarg) >= 0)
+      dist = (GenDist) parseGenDist(optarg);
+    else if (harness == 0 && opt == 'f')
+      firstTouch = 1;
+    else if (harness == 0 && opt == 'g')
+      seed = strtoull(optarg, NULL, 10);
+    else if (harness == 0 && opt == 'I')
+      inputFile = optarg;
+    else if (harness == 0 && opt == 'O')
+      outputFile = optarg;
+    else if (harness == 0 && opt == 't' && parseMatrixType(optarg) >= 0)
+      type = (MatrixType) parseMatrixType(optarg);
+    else if (harness == 0)
+      badArgs = 1;
+  }
+  rows = cols = DEFAULTSIZE;
+  if (badArgs || (argc > optind && parseDims(argv[optind], &rows, &cols) != 0)) {
+    fprintf(stderr, "usage: %s " BENCH_USAGE " [-a none|compact|scatter] [-d uniform|zipf|runs|few] [-f] [-g seed] [-I file] [-O file] [-t type] size|RxC numWorkers\n", argv[0]);
+    return 1;
+  }
+  numWorkers = (argc > optind + 1)? atoi(argv[optind + 1]) : DEFAULTWORKERS;
+  if (numWorkers < 1) numWorkers = 1;
+  workerid = malloc(sizeof(pthread_t) * numWorkers);
+  workerCpus = malloc(sizeof(int) * numWorkers);
+
+  /* allocate and initialize the matrix, or map it from the -I file */
+  if (inputFile) {
+    if (loadMatrix(&matrix, inputFile, BIN_POPULATE) != 0)
+      return 1;
+    rows = matrix.rows;
+    cols = matrix.cols;
+    type = matrix.type;
+  } else {
+    if (allocMatrix(&matrix, rows, cols, type) != 0) {
+      fprintf(stderr, "cannot allocate a %dx%d matrix\n", rows, cols);
+      return 1;
+    }
+    GenSpec gen;
+    GenMatrix fill = { &gen, &matrix };
+    if (genInit(&gen, dist, seed, 99) != 0) {
+      fprintf(stderr, "cannot allocate the input generator\n");
+      return 1;
+    }
+    if (firstTouch)
+      firstTouchStrips(&matrix, numWorkers, pinPolicy, genMatrixRows, &fill);
+    else
+      genFillMatrix(&fill, genDefaultThreads());
+    genFree(&gen);
+  }
+  if (outputFile && saveMatrix(&matrix, outputFile) != 0)
+    return 1;
+  stripSize = rows/numWorkers;
+  if (combinerInit(&combiner, numWorkers, sizeof(MatrixStats), combineStats) != 0) {
+    fprintf(stderr, "cannot allocate the worker stats\n");
+    return 1;
   }
 
   /* print the matrix */
 #ifdef DEBUG
-  for (i = 0; i < size; i++) {
+  int i, j;
+  for (i = 0; i < rows; i++) {
 	  printf("[ ");
-	  for (j = 0; j < size; j++) {
-	    printf(" %d", matrix[i][j]);
+	  for (j = 0; j < cols; j++) {
+	    char buf[32];
+	    printf(" %s", formatValue(buf, type, matrixGet(&matrix, i, j)));
 	  }
 	  printf(" ]\n");
   }
 #endif
 
-//global stat values are predefined
- globalStats.min_value = 99;
- globalStats.max_value = 0;
+  perfInit(&perf, &bench, numWorkers);
+  benchHeader(&bench);
+  perfBegin(&perf);
+  benchBegin(&benchRun, &bench);
+  while (benchNext(&benchRun)) {
+    //global stat values are predefined
+    initStats(&globalStats, type);
 
-  /* do the parallel work: create the workers */
-  start_time = read_timer();
+    /* do the parallel work: create the workers */
+    benchStart(&benchRun);
 
-  // Taskb - create thread workers
-  for (long l = 0; l < numWorkers; l++) {
-    pthread_create(&workerid[l], &attr, Worker, (void *)l);
-  }
+    // Taskb - create thread workers
+    for (long l = 0; l < numWorkers; l++) {
+      pthread_create(&workerid[l], &attr, Worker, (void *)l);
+    }
 
-  //Taskb - waits for threads to finish, then main therad prints the results
-  for (long l = 0; l < numWorkers; l++) {
-    pthread_join(workerid[l], NULL);
+    //Taskb - waits for threads to finish, then main therad prints the results
+    for (long l = 0; l < numWorkers; l++) {
+      pthread_join(workerid[l], NULL);
+    }
+    benchStop(&benchRun);
   }
 
   // TaskB - main thread prints everything once
-  end_time = read_timer();
-  printf("The total is %ld\n", globalSum);
-  printf("The execution time is %g sec\n", end_time - start_time);
-  printf("Min Value: %d at (%d, %d)\n", globalStats.min_value, globalStats.min_row, globalStats.min_col);
-  printf("Max Value: %d at (%d, %d)\n", globalStats.max_value, globalStats.max_row, globalStats.max_col);
-
+  if (bench.format == BENCH_TEXT) {
+    char sum[32], min[32], max[32];
+    printf("The total is %s\n", formatValue(sum, type, globalStats.sum));
+    printf("The execution time is %g sec\n", benchRun.median);
+    printf("Min Value: %s at (%d, %d)\n", formatValue(min, type, globalStats.min_value), globalStats.min_row, globalStats.min_col);
+    printf("Max Value: %s at (%d, %d)\n", formatValue(max, type, globalStats.max_value), globalStats.max_row, globalStats.max_col);
+    if (pinPolicy != PIN_NONE || firstTouch)
+      placementReport(workerCpus, numWorkers);
+  }
+  perfReport(&perf, &benchRun, "matrixSumB", matrixTypeNames[type], (long long) rows * cols, numWorkers,
+             (double) rows * cols * matrix.elemSize);
+
+  perfDestroy(&perf);
+  free(workerCpus);
+  free(workerid);
+  combinerDestroy(&combiner);
+  freeMatrix(&matrix);
   return 0;
 }
 
 /* Each worker sums the values in one strip of the matrix.
    After a barrier, worker(0) computes and prints the total */
 void *Worker(void *arg) {
-  MatrixStats localStats;
   long myid = (long) arg;
-  int total, i, j, first, last;
+  MatrixStats *localStats = combinerSlot(&combiner, myid);
+  int first, last;
 
 #ifdef DEBUG
   printf("worker %d (pthread id %d) has started\n", myid, pthread_self());
 #endif
 
+  pinWorker(pinPolicy, myid);
+
   /* determine first and last rows of my strip */
   first = myid*stripSize;
-  last = (myid == numWorkers - 1) ? (size - 1) : (first + stripSize - 1);
+  last = (myid == numWorkers - 1) ? (rows - 1) : (first + stripSize - 1);
 
   //Taskb - each thread gets a local sum
 
-  // local stats for each worker  
-  localStats.min_value = 99;
-  localStats.max_value = 0;
-  localStats.min_row   = 0;
-  localStats.min_col   = 0;
-  localStats.max_row   = 0;
-  localStats.max_col   = 0;
-
-  /* sum values in my strip */
-  total = 0;
-  for (i = first; i <= last; i++) {
-    for (j = 0; j < size; j++) {
-      total += matrix[i][j];
-      if(localStats.max_value < matrix[i][j]){
-        localStats.max_value = matrix[i][j];
-        localStats.max_row = i;
-        localStats.max_col = j;
-      }
-      if(localStats.min_value > matrix[i][j]){
-        localStats.min_value = matrix[i][j];
-        localStats.min_row = i;
-        localStats.min_col = j;
-      }
-    }
-  }
-  
-  //Taskb - update the global sum safely
-  pthread_mutex_lock(&sumMutex);
-  globalSum += total;
-  pthread_mutex_unlock(&sumMutex);
-
-
-  // updates the global stats, done safely via the mutex locks
-  pthread_mutex_lock(&statsMutex);
-  if (localStats.max_value > globalStats.max_value) {
-    globalStats.max_value = localStats.max_value;
-    globalStats.max_row = localStats.max_row;
-    globalStats.max_col = localStats.max_col;
-  }
-  if (localStats.min_value < globalStats.min_value) {
-    globalStats.min_value = localStats.min_value;
-    globalStats.min_row = localStats.min_row;
-    globalStats.min_col = localStats.min_col;
-  }
-  pthread_mutex_unlock(&statsMutex);
+  /* sum values in my strip, local stats for each worker */
+  PerfThread counters;
+  perfThreadOpen(&perf, &counters, 0);
+  perfThreadStart(&counters);
+  initStats(localStats, matrix.type);
+  reduceRows(&matrix, first, last, localStats);
+
+  //Taskb - merge into the global sum and stats, the last worker to finish ends up with everything
+  if (combinerArrive(&combiner, myid))
+    globalStats = *(MatrixStats *) combinerResult(&combiner);
+  perfThreadStop(&perf, &counters, myid, &benchRun);
+  perfThreadClose(&counters);
 
+  workerCpus[myid] = sched_getcpu();
   return NULL;
 }
@@ -2,22 +2,31 @@
 #define _REENTRANT
 #endif
 
+#include <limits.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <time.h>
-#include <sys/time.h>
-
-#define MAXSIZE 10000  /* maximum matrix size */
-#define MAXWORKERS 10   /* maximum number of workers */
+#include <unistd.h>
+#include "../common/benchHarness.h"
+#include "../common/binaryFile.h"
+#include "../common/externalSort.h"
+#include "../common/perfCounters.h"
+#include "../common/radixSort.h"
+#include "../common/sampleSort.h"
+#include "../common/sortKernel.h"
+#include "../common/taskPool.h"
+
+#define MAXSIZE 100000000  /* maximum size of a generated array (malloc'ed, three copies), files (-I) may be larger */
 #define PARALLEL_THRESHOLD 5000  /* If the sub–array size is less than this value, the serial (non-threaded) sort is used.  */
-
-// Global timing variables
-double start_time, end_time; 
+#define PARTITION_CUTOFF 100000  /* Sub-arrays larger than this are partitioned by all workers together (-c). */
 
 // Array 
-int matrix[MAXSIZE];
+int *matrix;
+int *scratch;   /* second buffer for radix sort */
+int *unsorted;  /* the input, copied into matrix before every run */
 int size, numWorkers;
 
 pthread_mutex_t barrier;  /* mutex lock for the barrier */
@@ -36,158 +45,272 @@ void Barrier() {
   pthread_mutex_unlock(&barrier);
 }
 
-double read_timer()
-{
-    static bool initialized = false;
-    static struct timeval start;
-    struct timeval end;
-    if (!initialized) {
-        gettimeofday(&start, NULL);
-        initialized = true;
-    }
-    gettimeofday(&end, NULL);
-    return (end.tv_sec - start.tv_sec) + 1.0e-6 * (end.tv_usec - start.tv_usec);
-}
+// The pool of numWorkers threads that runs the partitions in parallel
+TaskPool pool;
 
-// Structure to pass quicksort arguments
-typedef struct {
-    int  low;
-    int  high;
-    int* array;
-} QuickSortArray;
+// -e: counters of every pool worker, opened once for their thread ids
+PerfCounters perf;
+PerfThread *counters;
 
-// Forward declaration for the quickSort thread function.
-void *quickSort(void *arg);
+// Partition scheme used by both the parallel and the serial part (-p)
+PartitionMode partMode = PART_THREEWAY;
+int partitionCutoff = PARTITION_CUTOFF;
 
+// Radix sort, quicksort or whichever suits the keys (-a)
+SortAlgo sortAlgo = SORT_AUTO;
 
-// Swap helper function, further use in pivoting and partitioning
-static void swap(int *a, int *b) {
-    int tmp = *a;
-    *a = *b;
-    *b = tmp;
-}
+// Argument of the quickSort tasks: the array and the partitioning levels
+// still allowed before the introsort leaf takes over (levels[d].depthLeft == d)
+typedef struct {
+    int *arr;
+    int depthLeft;
+} SortLevel;
 
-// Median-of–three pivot selection, improves pivot selection for quicksort
-static int medianOfThree(int low, int high, int *array) {
-    int mid = low + (high - low) / 2; // not always the left most or right most element
-    if (array[low] > array[mid])
-        swap(&array[low], &array[mid]);
-    if (array[low] > array[high])
-        swap(&array[low], &array[high]);
-    if (array[mid] > array[high])
-        swap(&array[mid], &array[high]);
-    return mid;
-}
+SortLevel levels[64];  // 2*log2(n) < 64 for any int n
 
-// Partition function to divide the array into two parts
-static int partition(int *arr, int low, int high) {
-    int pivotIndex = medianOfThree(low, high, arr);
-    swap(&arr[pivotIndex], &arr[high]);  // move pivot to end
-    int pivot = arr[high];
-    int i = low - 1;
-    for (int j = low; j < high; j++) {
-        if (arr[j] < pivot) {
-            i++;
-            swap(&arr[i], &arr[j]);
-        }
-    }
-    swap(&arr[i+1], &arr[high]);
-    return i + 1;
+// Forward declaration for the quickSort task function.
+void quickSort(void *arg, int low, int high);
+
+
+// Task argument for runAllParts: one part of a PartFn
+typedef struct {
+    PartFn fn;
+    void *ctx;
+} PartJob;
+
+// Task function for runAllParts: parts low..high
+static void partTask(void *arg, int low, int high) {
+    PartJob *job = arg;
+    for (int part = low; part <= high; part++)
+        job->fn(job->ctx, part);
 }
 
-// Serial quicksort if array less than threshold, this will be called recursively
-static void serialQuickSort(int low, int high, int *arr) {
-    if (low < high) {
-        int pivotIndex = partition(arr, low, high);
-        serialQuickSort(low, pivotIndex - 1, arr);
-        serialQuickSort(pivotIndex + 1, high, arr);
-    }
+// Run fn for every part on the pool, part 0 on this thread.
+static void runAllParts(PartFn fn, void *ctx, int parts) {
+    PartJob job = { fn, ctx };
+    Task *tasks[RUNNER_MAX_PARTS];
+    for (int part = 1; part < parts; part++)
+        tasks[part] = poolSpawn(partTask, &job, part, part);
+    fn(ctx, 0);
+    for (int part = parts - 1; part > 0; part--)
+        poolWait(tasks[part]);
 }
 
 // The recursive parallel routine that decides whether to spawn a thread or sort serially
-static void parallelQuickSort(int low, int high, int *arr) {
+static void parallelQuickSort(int low, int high, int *arr, int depthLeft) {
     if (low < high) {
         int n = high - low + 1;
-        if (n < PARALLEL_THRESHOLD) {
-            // For smaller arrays, serially sorted.
-            serialQuickSort(low, high, arr);
+        if (n < PARALLEL_THRESHOLD || depthLeft == 0) {
+            // For smaller arrays, or when the pivots keep being bad, the introsort leaf takes over.
+            introSortLoop(partMode, arr, low, high, depthLeft);
         } else {
-            // For larger arrays, partition function is called and then the left partition is sorted in a new thread.
-            int pivotIndex = partition(arr, low, high);
-            
-            // This will memory allocate a quicksort structure for the left partition,
-            QuickSortArray *leftArgs = malloc(sizeof(QuickSortArray));
-            leftArgs->low = low;
-            leftArgs->high = pivotIndex - 1;
-            leftArgs->array = arr;
-            
-            pthread_t leftThread;
-
-            // Create a new thread to sort the left partition in parallel.
-            pthread_create(&leftThread, NULL, quickSort, (void *) leftArgs);
+            // For larger arrays, partition function is called and then the left partition is handed to the pool.
+            // Keys equal to the pivot end up in arr[lt..gt] and are already in place.
+            // Near the top the ranges are large enough for all workers to partition them together.
+            int lt, gt;
+            if (n > partitionCutoff && numWorkers > 1)
+                blockPartitionRange(partMode, arr, low, high, numWorkers, runAllParts, &lt, &gt);
+            else
+                partitionRange(partMode, arr, low, high, &lt, &gt);
+
+            // Queue the left partition, an idle worker will steal it.
+            Task *left = poolSpawn(quickSort, &levels[depthLeft - 1], low, lt - 1);
             
             // Sort the right partition in the current thread.
-            parallelQuickSort(pivotIndex + 1, high, arr);
+            parallelQuickSort(gt + 1, high, arr, depthLeft - 1);
             
-            // Wait for the left partition thread to finish before proceeding.
-            pthread_join(leftThread, NULL);
+            // Wait for the left partition, running other partitions meanwhile.
+            poolWait(left);
         }
     }
 }
 
-// Thread function for parallel quicksort.
-void *quickSort(void *arg) {
-    // Void pointer to the argument structure to access parameters.
-    QuickSortArray *qsArgs = (QuickSortArray *) arg;
-
-    // Call the parallel quicksort
-    parallelQuickSort(qsArgs->low, qsArgs->high, qsArgs->array);
+// Task function for parallel quicksort, arg is a SortLevel.
+void quickSort(void *arg, int low, int high) {
+    SortLevel *level = arg;
+    parallelQuickSort(low, high, level->arr, level->depthLeft);
+}
 
-    // Free the allocated memory for the argument structure.
-    free(qsArgs);
-    pthread_exit(NULL);
+// Task function for the whole array, arg is a SortLevel like for quickSort.
+void sortAll(void *arg, int low, int high) {
+    SortLevel *level = arg;
+    if (sortAlgo == SORT_SAMPLE) {
+        sampleSort(level->arr + low, scratch, high - low + 1, numWorkers, partMode, runAllParts);
+        return;
+    }
+    if (sortAlgo != SORT_QUICK) {
+        RadixSort rs;
+        int n = high - low + 1;
+        int passes = radixPrepare(&rs, level->arr + low, scratch, n, numWorkers, runAllParts);
+        if (sortAlgo == SORT_RADIX || radixWorthIt(n, passes, numWorkers)) {
+            radixSortRun(&rs);
+            return;
+        }
+    }
+    quickSort(arg, low, high);
 }
 
+int externalSortFile(const char *inPath, const char *outPath, size_t budget, BenchConfig *benchCfg);
+
 int main(int argc, char *argv[]) {
-    pthread_attr_t attr; // Thread attributes variable.
-    
     // Initialize the mutex and condition variable for the barrier.
     pthread_mutex_init(&barrier, NULL);
     pthread_cond_init(&go, NULL);
 
 
-    size       = (argc > 1) ? atoi(argv[1]) : 100;
-    numWorkers = (argc > 2) ? atoi(argv[2]) : 2;
+    int opt, input = IN_RANDOM, bench = 0, badArgs = 0;
+    unsigned long long seed = GEN_DEFAULT_SEED;
+    const char *inputFile = NULL, *outputFile = NULL;
+    long budgetMB = 0;
+    BenchConfig benchCfg;
+    benchDefaults(&benchCfg, 0, 1);
+    while ((opt = getopt(argc, argv, "a:bc:d:eg:I:o:O:p:r:w:x:")) != -1) {
+        int harness = benchOption(&benchCfg, opt, optarg);
+        if (harness != 0)
+            badArgs |= harness < 0;
+        else if (opt == 'a' && parseSortAlgo(optarg) >= 0)
+            sortAlgo = parseSortAlgo(optarg);
+        else if (opt == 'b')
+            bench = 1;
+        else if (opt == 'c')
+            partitionCutoff = atoi(optarg);
+        else if (opt == 'd' && parseSortInput(optarg) >= 0)
+            input = parseSortInput(optarg);
+        else if (opt == 'g')
+            seed = strtoull(optarg, NULL, 10);
+        else if (opt == 'I')
+            inputFile = optarg;
+        else if (opt == 'O')
+            outputFile = optarg;
+        else if (opt == 'p' && parsePartitionMode(optarg) >= 0)
+            partMode = parsePartitionMode(optarg);
+        else if (opt == 'x' && atol(optarg) > 0)
+            budgetMB = atol(optarg);
+        else
+            badArgs = 1;
+    }
+    if (badArgs || (bench && (inputFile || outputFile)) || (budgetMB && (!inputFile || !outputFile))) {
+        fprintf(stderr, "usage: %s [-a quick|radix|sample|auto] [-b] [-c cutoff] " SORT_INPUT_USAGE " " BENCH_USAGE " [-g seed] [-I file] [-O file] [-p lomuto|3way] [-x budgetMB] size numWorkers\n", argv[0]);
+        return 1;
+    }
+
+    size       = (argc > optind) ? atoi(argv[optind]) : 100;
+    numWorkers = (argc > optind + 1) ? atoi(argv[optind + 1]) : 2;
 
     if (size > MAXSIZE) {
         size = MAXSIZE;
     }
-    if (numWorkers > MAXWORKERS) {
-        numWorkers = MAXWORKERS;
+    if (numWorkers < 1) {
+        numWorkers = 1;
     }
 
-    // Initialize the array with random values.
-    srand(time(NULL));
-    for (int i = 0; i < size; i++) {
-        matrix[i] = rand() % 1000;  
+    // -x: sort a file that need not fit in memory, runs of it at a time
+    if (budgetMB)
+        return externalSortFile(inputFile, outputFile, (size_t)budgetMB << 20, &benchCfg);
+
+    // -I: sort the keys of a file, mapped in place of the generated input
+    Matrix inputKeys;
+    if (inputFile) {
+        long long n;
+        if (loadIntArray(&inputKeys, inputFile, BIN_POPULATE, &n) != 0)
+            return 1;
+        if (n > INT_MAX) {
+            fprintf(stderr, "%s: more than %d keys\n", inputFile, INT_MAX);
+            return 1;
+        }
+        size = (int)n;
+        unsorted = inputKeys.data;
+    } else {
+        unsorted = malloc(sizeof(int) * size);
+    }
+    matrix = malloc(sizeof(int) * size);
+    scratch = malloc(sizeof(int) * size);
+    if (!unsorted || !matrix || !scratch) {
+        fprintf(stderr, "not enough memory for %d keys\n", size);
+        return 1;
     }
 
-    start_time = read_timer();
-
-    pthread_attr_init(&attr);
-    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    // The workers are created once, before the timer starts.
+    poolInit(&pool, numWorkers);
+    perfInit(&perf, &benchCfg, numWorkers);
+    counters = malloc(sizeof(PerfThread) * numWorkers);
+    for (int w = 0; w < numWorkers; w++)
+        perfThreadOpen(&perf, &counters[w], perf.enabled ? poolThreadId(&pool, w) : 0);
+    for (int d = 0; d < 64; d++) {
+        levels[d].arr = matrix;
+        levels[d].depthLeft = d;
+    }
 
-    // Allocate memory for the quicksort argument structure and initialize the parameters.
-    QuickSortArray *qsArgs = malloc(sizeof(QuickSortArray));
-    qsArgs->low   = 0;
-    qsArgs->high  = size - 1;
-    qsArgs->array = matrix;
+    // -b: time every input with every sortMethods row, all on the same data
+    int firstInput = bench ? 0 : input, lastInput = bench ? IN_COUNT - 1 : input;
+    int lastMethod = bench ? SORT_METHODS - 1 : 0;
+    BenchRun benchRun;
+    char benchCase[32];
+    if (bench && benchCfg.format == BENCH_TEXT)
+        printf("%-8s %-7s %s\n", "input", "scheme", "seconds");
+    benchHeader(&benchCfg);
+    for (int in = firstInput; in <= lastInput; in++) {
+        // The keys only depend on the seed, so every numWorkers sorts the same ones.
+        if (!inputFile && fillSortInput(unsorted, size, in, seed, numWorkers) != 0) {
+            fprintf(stderr, "cannot allocate the input generator\n");
+            return 1;
+        }
+        for (int method = 0; method <= lastMethod; method++) {
+            if (bench) {
+                sortAlgo = sortMethods[method].algo;
+                partMode = sortMethods[method].mode;
+            }
+            perfBegin(&perf);
+            benchBegin(&benchRun, &benchCfg);
+            while (benchNext(&benchRun)) {
+                // Start every run from the same input.
+                memcpy(matrix, unsorted, sizeof(int) * size);
+
+                benchStart(&benchRun);
+                for (int w = 0; w < numWorkers; w++)
+                    perfThreadStart(&counters[w]);
+                poolRun(&pool, sortAll, &levels[introDepthLimit(size)], 0, size - 1);
+                for (int w = 0; w < numWorkers; w++)
+                    perfThreadStop(&perf, &counters[w], w, &benchRun);
+                benchStop(&benchRun);
+            }
+
+            for (int i = 1; i < size; i++) {
+                if (matrix[i - 1] > matrix[i]) {
+                    printf("unsorted\n");
+                    break;
+                }
+            }
+            if (benchCfg.format == BENCH_TEXT) {
+                if (bench)
+                    printf("%-8s %-7s %g\n", sortInputNames[in], sortMethods[method].name, benchRun.median);
+                else
+                    printf("The execution time is %g sec\n", benchRun.median);
+            }
+            snprintf(benchCase, sizeof(benchCase), "%s/%s", inputFile ? "file" : sortInputNames[in],
+                     bench ? sortMethods[method].name : sortAlgoNames[sortAlgo]);
+            perfReport(&perf, &benchRun, "quicksort", benchCase, size, numWorkers, (double)size * sizeof(int));
+        }
+    }
 
-    pthread_t topThread;
-    pthread_create(&topThread, &attr, quickSort, (void *) qsArgs);
-    pthread_join(topThread, NULL);
+    // -O: the sorted keys of the last run
+    if (outputFile) {
+        Matrix sorted = arrayMatrix(matrix, size);
+        if (saveMatrix(&sorted, outputFile) != 0)
+            return 1;
+    }
 
-    end_time = read_timer();
+    for (int w = 0; w < numWorkers; w++)
+        perfThreadClose(&counters[w]);
+    free(counters);
+    perfDestroy(&perf);
+    poolDestroy(&pool);
+    if (inputFile)
+        freeMatrix(&inputKeys);
+    else
+        free(unsorted);
+    free(matrix);
+    free(scratch);
 
     /*
     printf("Sorted array:\n");
@@ -197,7 +320,48 @@ int main(int argc, char *argv[]) {
     printf("\n\n");
     */
 
-    printf("The execution time is %g sec\n", end_time - start_time);
+    return 0;
+}
 
+// RunSortFn of -x: one run sorted by the pool, like the whole array otherwise
+void sortRun(void *ctx, int *keys, int *runScratch, int n) {
+    (void)ctx;
+    for (int d = 0; d < 64; d++)
+        levels[d].arr = keys;
+    scratch = runScratch;
+    poolRun(&pool, sortAll, &levels[introDepthLimit(n)], 0, n - 1);
+}
+
+/* -x: sort the keys of the file inPath into outPath within budget bytes,
+   in sorted runs merged from temporary files (see ../common/externalSort.h) */
+int externalSortFile(const char *inPath, const char *outPath, size_t budget, BenchConfig *benchCfg) {
+    ExtSortInfo info;
+    BenchRun benchRun;
+
+    poolInit(&pool, numWorkers);
+    for (int d = 0; d < 64; d++)
+        levels[d].depthLeft = d;
+    if (benchCfg->format != BENCH_TEXT)
+        extSortMetrics(benchCfg);  // the text report below has them
+    benchHeader(benchCfg);
+    benchBegin(&benchRun, benchCfg);
+    while (benchNext(&benchRun)) {
+        benchStart(&benchRun);
+        if (externalSort(inPath, outPath, budget, sortRun, NULL, &info) != 0)
+            return 1;
+        benchStop(&benchRun);
+    }
+
+    if (benchCfg->format == BENCH_TEXT) {
+        printf("The execution time is %g sec\n", benchRun.median);
+        printf("Sorted %lld keys in %zu MB: %lld runs, %d merge passes of up to %d runs\n",
+               info.n, info.budget >> 20, info.runs, info.passes, info.fanIn);
+        printf("runs:  %g sec, read %lld bytes, wrote %lld bytes\n", info.runSeconds, info.runRead, info.runWritten);
+        printf("merge: %g sec, read %lld bytes, wrote %lld bytes\n", info.mergeSeconds, info.mergeRead,
+               info.mergeWritten);
+    }
+    extSortFinish(&info, &benchRun);
+    benchReport(&benchRun, "quicksort", "external", info.n, numWorkers);
+    poolDestroy(&pool);
     return 0;
 }
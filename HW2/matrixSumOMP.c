@@ -1,189 +1,328 @@
 /* matrix summation using OpenMP
 usage with gcc (version 4.2 or higher required):
 gcc -O -fopenmp -o matrixSum-openmp matrixSum-openmp.c
-./matrixSum-openmp size numWorkers
+./matrixSum-openmp [-e] [-o text|csv|json] [-r trials] [-w warmup] [-a none|compact|scatter] [-d uniform|zipf|runs|few] [-f] [-g seed] [-I file] [-O file] [-s] [-S file] [-t type] size numWorkers
+
+size is N for an N x N matrix or RxC for R rows and C columns
+type is the element type: int8, int16, int32 (default), int64,
+float or double
+-r/-w set the timed and untimed runs (see ../common/benchHarness.h),
+5 timed runs by default
+numWorkers defaults to the number of online CPUs
+-s sweeps 1..numWorkers threads, with size rows for strong scaling and
+size*threads rows for weak scaling (see ../common/scalingSweep.h); size
+can be a list, 1000,4000x1000,..., for a sweep of each, on one matrix
+as large as the largest weak run
+-a pins thread k like worker k of the pthread programs (see
+../common/threadPlacement.h), OMP_PROC_BIND=close|spread with
+OMP_PLACES=cores does much the same through the runtime; -f lets every
+thread first touch the rows its static share of the loop will read
+-d picks the distribution of the values (0..98) and -g the seed (see
+../common/inputGen.h), the matrix only depends on the two, not on
+numWorkers; it is filled in parallel
+-I maps the matrix from a binary file instead (size and type come from
+the file, see ../common/binaryFile.h, not with -s) and -O writes the
+matrix to one, to run on the same data again
+-S streams a matrix file that need not fit in memory through a few row
+buffers, reading the next block while the threads reduce the last (see
+../common/streamReduce.h, plain threads instead of OpenMP ones, not
+with -s); the times include the I/O
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  /* pthread_setaffinity_np, sched_getcpu */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>  // for INT_MAX and INT_MIN                 
 #include <omp.h>
+#include <unistd.h>
+#include "../common/benchHarness.h"
+#include "../common/binaryFile.h"
+#include "../common/inputGen.h"
+#include "../common/matrixKernel.h"
+#include "../common/matrixStorage.h"
+#include "../common/perfCounters.h"
+#include "../common/reduceCombiner.h"
+#include "../common/scalingSweep.h"
+#include "../common/streamReduce.h"
+#include "../common/threadPlacement.h"
 
-#define MAXSIZE 10000    /* maximum matrix size */
-#define MAXWORKERS 8     /* maximum number of workers */
-#define MEDIAN_CALC 5   /* number of timing trials to calculate median */
+#define DEFAULTSIZE 10000    /* default matrix size */
+#define MEDIAN_CALC 5   /* default number of timing trials to calculate median */
+
+int numWorkers;
+int rows, cols;
+Matrix matrix;
+PerfCounters perf;  // -e: counters of every thread
+PinPolicy pinPolicy = PIN_NONE;  // -a: where the threads run
+int *workerCpus;    // the CPU every thread last ran on
 
-// Sort an array for median calculation
-void sort_array(double arr[], int n) {
-    int i, j;
-    for (i = 0; i < n - 1; i++) {
-        for (j = i + 1; j < n; j++) {
-            if (arr[i] > arr[j]) {
-                double temp = arr[i];
-                arr[i] = arr[j];
-                arr[j] = temp;
+// Time the reduction of the first nrows rows of the matrix on threads threads into stats
+void time_sum(int nrows, int threads, const BenchConfig *bench, BenchRun *run, MatrixStats *globalStats) {
+    // a slot of partial stats per thread, merged without a lock or omp critical
+    ReduceCombiner combiner;
+    if (combinerInit(&combiner, threads, sizeof(MatrixStats), combineStats) != 0) {
+        fprintf(stderr, "cannot allocate the thread stats\n");
+        exit(1);
+    }
+    perfBegin(&perf);
+    benchBegin(run, bench);
+    while (benchNext(run)) {
+        // Reset results.
+        initStats(globalStats, matrix.type);
+        
+        omp_set_num_threads(threads);
+        
+        benchStart(run);
+        #pragma omp parallel
+        {
+            pinWorker(pinPolicy, omp_get_thread_num());
+            PerfThread counters;
+            perfThreadOpen(&perf, &counters, 0);
+            perfThreadStart(&counters);
+            MatrixStats *localStats = combinerSlot(&combiner, omp_get_thread_num());
+            initStats(localStats, matrix.type);
+            
+            // the rows schedule(static) would give this thread, as one block: the kernel's
+            // setup and merge once per thread instead of once per row, and the same rows
+            // as the -f first touch; whoever is done merges as soon as its neighbour in the tree is
+            int id = omp_get_thread_num(), team = omp_get_num_threads();
+            int share = nrows / team, extra = nrows % team;
+            int first = id * share + (id < extra ? id : extra);
+            int last = first + share + (id < extra) - 1;
+            if (first <= last) {
+                reduceRows(&matrix, first, last, localStats);
             }
-        }
+            if (combinerArrive(&combiner, omp_get_thread_num())) {
+                *globalStats = *(MatrixStats *) combinerResult(&combiner);
+            }
+            perfThreadStop(&perf, &counters, omp_get_thread_num(), run);
+            perfThreadClose(&counters);
+            workerCpus[omp_get_thread_num()] = sched_getcpu();
+        } 
+        benchStop(run);
     }
+    combinerDestroy(&combiner);
 }
 
-// Compute the median of an array
-double median(double arr[], int n) {
-    sort_array(arr, n);
-    return arr[n / 2];
+// Time streaming the matrix file at path through threads threads into stats (-S)
+int time_stream(const char *path, int threads, const BenchConfig *bench, BenchRun *run,
+                MatrixStats *globalStats, StreamInfo *info) {
+    perfBegin(&perf);
+    benchBegin(run, bench);
+    while (benchNext(run)) {
+        benchStart(run);
+        if (streamReduce(path, threads, STREAM_BLOCK_BYTES, globalStats, info, &perf, run) != 0) {
+            return -1;
+        }
+        benchStop(run);
+    }
+    return 0;
 }
 
-int numWorkers;
-int size;
-int matrix[MAXSIZE][MAXSIZE];
+// -S: the sequential and parallel streamed reductions of the file at path
+int stream_sums(const char *path, BenchConfig *bench) {
+    BenchRun seq_run, par_run;
+    MatrixStats globalStats;
+    StreamInfo info;
+    char benchCase[32];
+
+    perfInit(&perf, bench, numWorkers);
+    benchHeader(bench);
+    if (time_stream(path, 1, bench, &seq_run, &globalStats, &info) != 0) {
+        return 1;
+    }
+    perfFinish(&perf, &seq_run, (double) info.bytes);
+    if (time_stream(path, numWorkers, bench, &par_run, &globalStats, &info) != 0) {
+        return 1;
+    }
+    MatrixType type = info.type;
+    if (bench->format == BENCH_TEXT) {
+        char sum[32], min[32], max[32];
+        printf("Total Sum: %s\n", formatValue(sum, type, globalStats.sum));
+        printf("Minimum element: %s at position [%d][%d]\n", formatValue(min, type, globalStats.min_value), globalStats.min_row, globalStats.min_col);
+        printf("Maximum element: %s at position [%d][%d]\n", formatValue(max, type, globalStats.max_value), globalStats.max_row, globalStats.max_col);
+        printf("\nMedian Sequential Time: %g seconds\n", seq_run.median);
+        printf("Median Parallel Time: %g seconds\n", par_run.median);
+        printf("Speedup (Sequential / Parallel): %g\n", seq_run.median / par_run.median);
+        printf("Streamed %lld bytes in blocks of %d rows: %g GB/s, reader busy %g sec, threads waited up to %g sec\n",
+               info.bytes, info.blockRows, info.bytes / par_run.median * 1e-9, info.readSeconds, info.waitSeconds);
+    }
+    long long n = (long long) info.rows * info.cols;
+    snprintf(benchCase, sizeof(benchCase), "%s/stream/sequential", matrixTypeNames[type]);
+    benchReport(&seq_run, "matrixSumOMP", benchCase, n, 1);
+    snprintf(benchCase, sizeof(benchCase), "%s/stream/parallel", matrixTypeNames[type]);
+    perfReport(&perf, &par_run, "matrixSumOMP", benchCase, n, numWorkers, (double) info.bytes);
+    perfDestroy(&perf);
+    return 0;
+}
 
 /* read command line, initialize, and create threads */
 int main(int argc, char *argv[]) {
-    int i, j;
-    double start_time, end_time;
-    double seq_times[MEDIAN_CALC], par_times[MEDIAN_CALC];
+    BenchRun seq_run, par_run;
     
     /* read command line args if any */
-    size = (argc > 1) ? atoi(argv[1]) : MAXSIZE;
-    numWorkers = (argc > 2) ? atoi(argv[2]) : MAXWORKERS;
-    if (size > MAXSIZE) size = MAXSIZE;
-    if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
-    
-    /* initialize the matrix */
-    for (i = 0; i < size; i++) {
-        for (j = 0; j < size; j++) {
-            matrix[i][j] = rand() % 99;
-        }
+    int opt, sweep = 0, firstTouch = 0, badArgs = 0;
+    GenDist dist = DIST_UNIFORM;
+    unsigned long long seed = GEN_DEFAULT_SEED;
+    const char *inputFile = NULL, *outputFile = NULL, *streamFile = NULL;
+    MatrixType type = MT_INT32;
+    BenchConfig bench;
+    benchDefaults(&bench, 0, MEDIAN_CALC);
+    while ((opt = getopt(argc, argv, "a:d:efg:I:o:O:r:sS:t:w:")) != -1) {
+        int harness = benchOption(&bench, opt, optarg);
+        if (harness < 0)
+            badArgs = 1;
+        else if (harness == 0 && opt == 'a' && parsePinPolicy(optarg) >= 0)
+            pinPolicy = (PinPolicy) parsePinPolicy(optarg);
+        else if (harness == 0 && opt == 'd' && parseGenDist(optarg) >= 0)
+            dist = (GenDist) parseGenDist(optarg);
+        else if (harness == 0 && opt == 'f')
+            firstTouch = 1;
+        else if (harness == 0 && opt == 'g')
+            seed = strtoull(optarg, NULL, 10);
+        else if (harness == 0 && opt == 'I')
+            inputFile = optarg;
+        else if (harness == 0 && opt == 'O')
+            outputFile = optarg;
+        else if (harness == 0 && opt == 's')
+            sweep = 1;
+        else if (harness == 0 && opt == 'S')
+            streamFile = optarg;
+        else if (harness == 0 && opt == 't' && parseMatrixType(optarg) >= 0)
+            type = (MatrixType) parseMatrixType(optarg);
+        else if (harness == 0)
+            badArgs = 1;
     }
+    // the size, or with -s a list of them; the matrix has the most rows and columns of any
+    char *sizes[SWEEP_MAX_SIZES];
+    int numSizes = 1, sizeRows[SWEEP_MAX_SIZES] = { DEFAULTSIZE }, sizeCols[SWEEP_MAX_SIZES] = { DEFAULTSIZE };
+    if (argc > optind) {
+        numSizes = sweepSizeList(argv[optind], sizes);
+        for (int s = 0; s < numSizes; s++)
+            badArgs |= parseDims(sizes[s], &sizeRows[s], &sizeCols[s]) != 0;
+    }
+    rows = cols = 0;
+    for (int s = 0; s < numSizes; s++) {
+        rows = sizeRows[s] > rows ? sizeRows[s] : rows;
+        cols = sizeCols[s] > cols ? sizeCols[s] : cols;
+    }
+    if (badArgs || numSizes < 1 || (numSizes > 1 && !sweep) || (sweep && (inputFile || streamFile))) {
+        fprintf(stderr, "usage: %s " BENCH_USAGE " [-a none|compact|scatter] [-d uniform|zipf|runs|few] [-f] [-g seed] [-I file] [-O file] [-s] [-S file] [-t type] size|RxC[,size|RxC...] numWorkers\n", argv[0]);
+        return 1;
+    }
+    numWorkers = (argc > optind + 1) ? atoi(argv[optind + 1]) : sweepDefaultWorkers();
+    if (numWorkers < 1) numWorkers = 1;
+    if (streamFile)
+        return stream_sums(streamFile, &bench);
+    workerCpus = malloc(sizeof(int) * numWorkers);
     
-    // Variables to store results after computing the matrix.
-    int total, global_min, global_max;
-    int global_min_i, global_min_j, global_max_i, global_max_j;
-    
-    for (int trial = 0; trial < MEDIAN_CALC; trial++) {
-        // Reset results.
-        total = 0;
-        global_min = INT_MAX;
-        global_max = INT_MIN;
-        global_min_i = global_min_j = -1;
-        global_max_i = global_max_j = -1;
-        
-        // for sequential, forced 1 thread
-        omp_set_num_threads(1); 
-        
-        start_time = omp_get_wtime();
-        #pragma omp parallel
-        {
-            int local_sum = 0;
-            int local_min = INT_MAX, local_max = INT_MIN;
-            int local_min_i = -1, local_min_j = -1;
-            int local_max_i = -1, local_max_j = -1;
-            
-            #pragma omp for private(j)
-            for (i = 0; i < size; i++) {
-                for (j = 0; j < size; j++) {
-                    int value = matrix[i][j];
-                    local_sum += value;
-                    if (value < local_min) {
-                        local_min = value;
-                        local_min_i = i;
-                        local_min_j = j;
-                    }
-                    if (value > local_max) {
-                        local_max = value;
-                        local_max_i = i;
-                        local_max_j = j;
-                    }
-                }
-            }
-            #pragma omp critical
+    /* allocate and initialize the matrix, the largest weak scaling run has numWorkers times the rows,
+       or map it from the -I file */
+    if (inputFile) {
+        if (loadMatrix(&matrix, inputFile, BIN_POPULATE) != 0)
+            return 1;
+        rows = matrix.rows;
+        cols = matrix.cols;
+        type = matrix.type;
+    } else {
+        int allocRows = sweep ? rows * numWorkers : rows;
+        if ((long long) rows * numWorkers > INT_MAX || allocMatrix(&matrix, allocRows, cols, type) != 0) {
+            fprintf(stderr, "cannot allocate a %dx%d matrix\n", allocRows, cols);
+            return 1;
+        }
+        GenSpec gen;
+        GenMatrix fill = { &gen, &matrix };
+        if (genInit(&gen, dist, seed, 99) != 0) {
+            fprintf(stderr, "cannot allocate the input generator\n");
+            return 1;
+        }
+        if (firstTouch) {
+            // the same static schedule as the sums, so every thread owns the pages it reads
+            omp_set_num_threads(numWorkers);
+            #pragma omp parallel
             {
-                total += local_sum;
-                if (local_min < global_min) {
-                    global_min = local_min;
-                    global_min_i = local_min_i;
-                    global_min_j = local_min_j;
-                }
-                if (local_max > global_max) {
-                    global_max = local_max;
-                    global_max_i = local_max_i;
-                    global_max_j = local_max_j;
+                pinWorker(pinPolicy, omp_get_thread_num());
+                #pragma omp for schedule(static)
+                for (int r = 0; r < allocRows; r++) {
+                    genFillRows(&gen, &matrix, r, r);
                 }
             }
-        } 
-        end_time = omp_get_wtime();
-        
-        seq_times[trial] = end_time - start_time;
+        } else {
+            genFillMatrix(&fill, genDefaultThreads());
+        }
+        genFree(&gen);
     }
+    if (outputFile && saveMatrix(&matrix, outputFile) != 0)
+        return 1;
     
-    double seq_median = median(seq_times, MEDIAN_CALC);
+    perfInit(&perf, &bench, numWorkers);
     
-    for (int trial = 0; trial < MEDIAN_CALC; trial++) {
-        // Reset results.
-        total = 0;
-        global_min = INT_MAX;
-        global_max = INT_MIN;
-        global_min_i = global_min_j = -1;
-        global_max_i = global_max_j = -1;
-        
-        // specified number of threads
-        omp_set_num_threads(numWorkers);  
-        
-        start_time = omp_get_wtime();
-        #pragma omp parallel
-        {
-            int local_sum = 0;
-            int local_min = INT_MAX, local_max = INT_MIN;
-            int local_min_i = -1, local_min_j = -1;
-            int local_max_i = -1, local_max_j = -1;
-            
-            #pragma omp for private(j)
-            for (i = 0; i < size; i++) {
-                for (j = 0; j < size; j++) {
-                    int value = matrix[i][j];
-                    local_sum += value;
-                    if (value < local_min) {
-                        local_min = value;
-                        local_min_i = i;
-                        local_min_j = j;
-                    }
-                    if (value > local_max) {
-                        local_max = value;
-                        local_max_i = i;
-                        local_max_j = j;
-                    }
-                }
+    // Variables to store results after computing the matrix.
+    MatrixStats globalStats;
+    char benchCase[32];
+    
+    if (sweep) {
+        sweepHeader(&bench);
+        for (int s = 0; s < numSizes; s++) {
+            // a narrower size reads the left columns of every row
+            ScalingSweep scaling;
+            matrix.cols = sizeCols[s];
+            if (sweepBegin(&scaling, numWorkers, (long long) sizeRows[s] * sizeCols[s]) != 0) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
             }
-            #pragma omp critical
-            {
-                total += local_sum;
-                if (local_min < global_min) {
-                    global_min = local_min;
-                    global_min_i = local_min_i;
-                    global_min_j = local_min_j;
-                }
-                if (local_max > global_max) {
-                    global_max = local_max;
-                    global_max_i = local_max_i;
-                    global_max_j = local_max_j;
-                }
+            for (int p = 1; p <= numWorkers; p++) {
+                time_sum(sizeRows[s], p, &bench, &par_run, &globalStats);
+                scaling.strong[p] = par_run.median;
+                free(par_run.times);
+                time_sum(sizeRows[s] * p, p, &bench, &par_run, &globalStats);
+                scaling.weak[p] = par_run.median;
+                free(par_run.times);
             }
-        } 
-        end_time = omp_get_wtime();
-        
-        par_times[trial] = end_time - start_time;
+            snprintf(benchCase, sizeof(benchCase), "%s/%dx%d", matrixTypeNames[type], sizeRows[s], sizeCols[s]);
+            sweepReport(&scaling, &bench, "matrixSumOMP", benchCase);
+            sweepEnd(&scaling);
+        }
+        matrix.cols = cols;
+        perfDestroy(&perf);
+        freeMatrix(&matrix);
+        return 0;
     }
     
-    double par_median = median(par_times, MEDIAN_CALC);
+    benchHeader(&bench);
+    // for sequential, forced 1 thread
+    time_sum(rows, 1, &bench, &seq_run, &globalStats);
+    perfFinish(&perf, &seq_run, (double) rows * cols * matrix.elemSize);
+    double seq_median = seq_run.median;
+    
+    // specified number of threads
+    time_sum(rows, numWorkers, &bench, &par_run, &globalStats);
+    double par_median = par_run.median;
     double speedup = seq_median / par_median;
     
     // Print results
-    printf("Total Sum: %d\n", total);
-    printf("Minimum element: %d at position [%d][%d]\n", global_min, global_min_i, global_min_j);
-    printf("Maximum element: %d at position [%d][%d]\n", global_max, global_max_i, global_max_j);
-    printf("\nMedian Sequential Time: %g seconds\n", seq_median);
-    printf("Median Parallel Time: %g seconds\n", par_median);
-    printf("Speedup (Sequential / Parallel): %g\n", speedup);
+    if (bench.format == BENCH_TEXT) {
+        char sum[32], min[32], max[32];
+        printf("Total Sum: %s\n", formatValue(sum, type, globalStats.sum));
+        printf("Minimum element: %s at position [%d][%d]\n", formatValue(min, type, globalStats.min_value), globalStats.min_row, globalStats.min_col);
+        printf("Maximum element: %s at position [%d][%d]\n", formatValue(max, type, globalStats.max_value), globalStats.max_row, globalStats.max_col);
+        printf("\nMedian Sequential Time: %g seconds\n", seq_median);
+        printf("Median Parallel Time: %g seconds\n", par_median);
+        printf("Speedup (Sequential / Parallel): %g\n", speedup);
+        if (pinPolicy != PIN_NONE || firstTouch)
+            placementReport(workerCpus, numWorkers);
+    }
+    snprintf(benchCase, sizeof(benchCase), "%s/sequential", matrixTypeNames[type]);
+    benchReport(&seq_run, "matrixSumOMP", benchCase, (long long) rows * cols, 1);
+    snprintf(benchCase, sizeof(benchCase), "%s/parallel", matrixTypeNames[type]);
+    perfReport(&perf, &par_run, "matrixSumOMP", benchCase, (long long) rows * cols, numWorkers,
+               (double) rows * cols * matrix.elemSize);
     
+    perfDestroy(&perf);
+    free(workerCpus);
+    freeMatrix(&matrix);
     return 0;
 }
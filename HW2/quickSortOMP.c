@@ -2,164 +2,406 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <omp.h>
 #include <time.h>
+#include <unistd.h>
+#include "../common/benchHarness.h"
+#include "../common/binaryFile.h"
+#include "../common/externalSort.h"
+#include "../common/perfCounters.h"
+#include "../common/radixSort.h"
+#include "../common/sampleSort.h"
+#include "../common/scalingSweep.h"
+#include "../common/sortKernel.h"
 
-#define MAXSIZE 1000000 /* maximum array size */
-#define MAXWORKERS 8 /* maximum number of workers */
+#define DEFAULTSIZE 1000000 /* array size if none is given */
 #define PARALLEL_THRESHOLD 1000 /* If the sub–array size is less than this value, the serial (non-threaded) sort is used.  */
-#define MEDIAN_CALC 5  /* number of timing trials to calculate median */
+#define PARTITION_CUTOFF 100000 /* Sub-arrays larger than this are partitioned by all threads together (-c). */
+#define MEDIAN_CALC 5  /* default number of timing trials to calculate median (-r) */
+#define FILL_BLOCK 65536  /* elements per block of the parallel input fill */
 
-// Swap helper function, further use in pivoting and partitioning
-static inline void swap(int *a, int *b) {
-    int temp = *a;
-    *a = *b;
-    *b = temp;
-}
+// Partition scheme used by both the parallel and the serial sort (-p)
+PartitionMode partMode = PART_THREEWAY;
+int partitionCutoff = PARTITION_CUTOFF;
 
-// Median-of–three pivot selection, improves pivot selection for quicksort
-int median_of_three(int *arr, int low, int high) {
-    int mid = low + (high - low) / 2;
-    if (arr[low] > arr[mid])
-        swap(&arr[low], &arr[mid]);
-    if (arr[low] > arr[high])
-        swap(&arr[low], &arr[high]);
-    if (arr[mid] > arr[high])
-        swap(&arr[mid], &arr[high]);
-    return mid;
-}
+// Radix sort, quicksort or whichever suits the keys (-a)
+SortAlgo sortAlgo = SORT_AUTO;
 
-// Partition function to divide the array into two parts
-int partition(int *arr, int low, int high) {
-    int pivotIndex = median_of_three(arr, low, high);
-    swap(&arr[pivotIndex], &arr[high]);  // Move pivot to end
-    int pivot = arr[high];
-    int i = low - 1;
-    for (int j = low; j < high; j++) {
-        if (arr[j] < pivot) {
-            i++;
-            swap(&arr[i], &arr[j]);
-        }
-    }
-    swap(&arr[i + 1], &arr[high]);
-    return i + 1;
-}
+// -e: counters of every thread
+PerfCounters perf;
 
-// Serial quicksort if array less than threshold, this will be called recursively
-void serial_quicksort(int *arr, int low, int high) {
-    if (low < high) {
-        int pivot = partition(arr, low, high);
-        serial_quicksort(arr, low, pivot - 1);
-        serial_quicksort(arr, pivot + 1, high);
+// Run fn for every part as tasks, returns when all are done
+void run_all_parts(PartFn fn, void *ctx, int parts) {
+    #pragma omp taskloop grainsize(1)
+    for (int part = 0; part < parts; part++) {
+        fn(ctx, part);
     }
 }
 
-// The recursive parallel routine that decides whether to spawn a thread or sort serially
-void parallel_quicksort(int *arr, int low, int high) {
+// The recursive parallel routine that decides whether to spawn a thread or sort serially,
+// depthLeft is the number of partitioning levels allowed before the introsort leaf takes over
+void parallel_quicksort(int *arr, int low, int high, int depthLeft) {
     if (low < high) {
-        if (high - low < PARALLEL_THRESHOLD) {
-            // For smaller arrays, serially sorted.
-            serial_quicksort(arr, low, high);
+        if (high - low < PARALLEL_THRESHOLD || depthLeft == 0) {
+            // For smaller arrays, or when the pivots keep being bad, serially sorted.
+            introSortLoop(partMode, arr, low, high, depthLeft);
         } else {
             // For larger arrays, partition function is called and then the left partition is sorted in a new thread.
-            int pivot = partition(arr, low, high);
-            #pragma omp task shared(arr) firstprivate(low, pivot)
+            // Keys equal to the pivot end up in arr[lt..gt] and are already in place.
+            // Near the top the ranges are large enough for all threads to partition them together.
+            int lt, gt;
+            int numThreads = omp_get_num_threads();
+            if (high - low + 1 > partitionCutoff && numThreads > 1)
+                blockPartitionRange(partMode, arr, low, high, numThreads, run_all_parts, &lt, &gt);
+            else
+                partitionRange(partMode, arr, low, high, &lt, &gt);
+            #pragma omp task shared(arr) firstprivate(low, lt, depthLeft)
             {
-                parallel_quicksort(arr, low, pivot - 1);
+                parallel_quicksort(arr, low, lt - 1, depthLeft - 1);
             }
-            #pragma omp task shared(arr) firstprivate(high, pivot)
+            #pragma omp task shared(arr) firstprivate(high, gt, depthLeft)
             {
-                parallel_quicksort(arr, pivot + 1, high);
+                parallel_quicksort(arr, gt + 1, high, depthLeft - 1);
             }
             #pragma omp taskwait
         }
     }
 }
 
-// Sort an array for median calculation
-void sort_array(double arr[], int n) {
-    for (int i = 0; i < n - 1; i++) {
-        for (int j = i + 1; j < n; j++) {
-            if (arr[i] > arr[j]) {
-                double tmp = arr[i];
-                arr[i] = arr[j];
-                arr[j] = tmp;
+// Sort arr with the algorithm -a asks for, scratch is the second buffer of radix sort.
+// Parallel when called from a single thread of a parallel region, serial otherwise.
+void sort_all(int *arr, int *scratch, int n) {
+    int numThreads = omp_get_num_threads();
+    if (sortAlgo == SORT_SAMPLE) {
+        sampleSort(arr, scratch, n, numThreads, partMode, numThreads > 1 ? run_all_parts : runPartsSerially);
+        return;
+    }
+    if (sortAlgo != SORT_QUICK) {
+        RadixSort rs;
+        int passes = radixPrepare(&rs, arr, scratch, n, numThreads,
+                                  numThreads > 1 ? run_all_parts : runPartsSerially);
+        if (sortAlgo == SORT_RADIX || radixWorthIt(n, passes, numThreads)) {
+            radixSortRun(&rs);
+            return;
+        }
+    }
+    if (numThreads > 1)
+        parallel_quicksort(arr, 0, n - 1, introDepthLimit(n));
+    else
+        serialQuickSort(partMode, arr, 0, n - 1);
+}
+
+// Timings of sorting orig[0..n-1] with numWorkers threads as bench says, arr is the working copy
+void time_parallel_sort(int *arr, int *scratch, const int *orig, int n, int numWorkers,
+                        const BenchConfig *bench, BenchRun *par_run) {
+    perfBegin(&perf);
+    benchBegin(par_run, bench);
+    while (benchNext(par_run)) {
+        // Copy the unsorted data into the working array.
+        memcpy(arr, orig, n * sizeof(int));
+
+        benchStart(par_run);
+        #pragma omp parallel num_threads(numWorkers)
+        {
+            // the others run the tasks at the barrier after single, so they stop counting after it
+            PerfThread counters;
+            perfThreadOpen(&perf, &counters, 0);
+            perfThreadStart(&counters);
+            #pragma omp single
+            {
+                sort_all(arr, scratch, n);
             }
+            perfThreadStop(&perf, &counters, omp_get_thread_num(), par_run);
+            perfThreadClose(&counters);
         }
+        benchStop(par_run);
     }
 }
 
-// Compute the median of an array
-double median_val(double arr[], int n) {
-    sort_array(arr, n);
-    return arr[n / 2];
+// Sequential and parallel timings of sorting orig as bench says, arr is the working copy
+void time_sorts(int *arr, int *scratch, const int *orig, int n, int numWorkers,
+                const BenchConfig *bench, BenchRun *seq_run, BenchRun *par_run) {
+    //Sequential sorting 
+    perfBegin(&perf);
+    benchBegin(seq_run, bench);
+    while (benchNext(seq_run)) {
+        memcpy(arr, orig, n * sizeof(int));
+
+        PerfThread counters;
+        perfThreadOpen(&perf, &counters, 0);
+        benchStart(seq_run);
+        perfThreadStart(&counters);
+        sort_all(arr, scratch, n);
+        perfThreadStop(&perf, &counters, 0, seq_run);
+        benchStop(seq_run);
+        perfThreadClose(&counters);
+    }
+    perfFinish(&perf, seq_run, (double)n * sizeof(int));
+
+    //Parallel sorting
+    time_parallel_sort(arr, scratch, orig, n, numWorkers, bench, par_run);
+
+    for(int i = 0; i<n-1; i++){
+        if(arr[i]> arr[i+1]){
+            printf("unsorted");
+            break;
+        }
+    }
 }
 
-int main(int argc, char *argv[]) {
-    /* read command line args if any */
-    int n = (argc > 1) ? atoi(argv[1]) : MAXSIZE;
-    int numWorkers = (argc > 2) ? atoi(argv[2]) : MAXWORKERS;
-    if (numWorkers > MAXWORKERS) {
-        numWorkers = MAXWORKERS;
+// Fill orig[0..n-1] with input kind from seed, in blocks over all threads.
+// Returns 0, or -1 if the generator could not be allocated.
+int fill_input(int *orig, int n, SortInput kind, unsigned long long seed) {
+    SortInputGen in;
+    if (sortInputInit(&in, kind, n, seed) != 0) {
+        return -1;
     }
+    #pragma omp parallel for schedule(static)
+    for (long long begin = 0; begin < n; begin += FILL_BLOCK) {
+        sortInputFill(&in, orig, begin, begin + FILL_BLOCK < n ? begin + FILL_BLOCK : n);
+    }
+    sortInputFree(&in);
+    return 0;
+}
 
-    // Allocate memory for original data array and working copy.
-    int *orig = (int *)malloc(n * sizeof(int));
-    int *arr  = (int *)malloc(n * sizeof(int));
-    
-    // Initialize the array with random values.
-    srand(time(NULL));
-    for (int i = 0; i < n; i++) {
-        orig[i] = rand() % 1000;  
+// RunSortFn of -x, ctx is the number of threads: one run sorted like the whole array otherwise
+void sort_run(void *ctx, int *keys, int *scratch, int n) {
+    int numWorkers = *(int *)ctx;
+    #pragma omp parallel num_threads(numWorkers)
+    {
+        #pragma omp single
+        sort_all(keys, scratch, n);
+    }
+}
+
+// -x: sort the keys of the file inPath into outPath within budget bytes,
+// in sorted runs merged from temporary files (see ../common/externalSort.h)
+int external_sort_file(const char *inPath, const char *outPath, size_t budget, int numWorkers,
+                       BenchConfig *benchCfg) {
+    ExtSortInfo info;
+    BenchRun run;
+    if (benchCfg->format != BENCH_TEXT) {
+        extSortMetrics(benchCfg);  // the text report below has them
+    }
+    benchHeader(benchCfg);
+    benchBegin(&run, benchCfg);
+    while (benchNext(&run)) {
+        benchStart(&run);
+        if (externalSort(inPath, outPath, budget, sort_run, &numWorkers, &info) != 0) {
+            return 1;
+        }
+        benchStop(&run);
     }
 
-    double seq_times[MEDIAN_CALC], par_times[MEDIAN_CALC];
+    if (benchCfg->format == BENCH_TEXT) {
+        printf("Median External Sort Time: %g seconds\n", run.median);
+        printf("Sorted %lld keys in %zu MB: %lld runs, %d merge passes of up to %d runs\n",
+               info.n, info.budget >> 20, info.runs, info.passes, info.fanIn);
+        printf("Runs:  %g seconds, read %lld bytes, wrote %lld bytes\n", info.runSeconds, info.runRead,
+               info.runWritten);
+        printf("Merge: %g seconds, read %lld bytes, wrote %lld bytes\n", info.mergeSeconds, info.mergeRead,
+               info.mergeWritten);
+    }
+    extSortFinish(&info, &run);
+    benchReport(&run, "quickSortOMP", "external", info.n, numWorkers);
+    return 0;
+}
 
-    //Sequential sorting 
-    for (int trial = 0; trial < MEDIAN_CALC; trial++) {
-        memcpy(arr, orig, n * sizeof(int));
+int main(int argc, char *argv[]) {
+    /* read command line args if any */
+    int opt, input = IN_RANDOM, bench = 0, sweep = 0, badArgs = 0;
+    unsigned long long seed = GEN_DEFAULT_SEED;
+    const char *inputFile = NULL, *outputFile = NULL;
+    long budgetMB = 0;
+    BenchConfig benchCfg;
+    benchDefaults(&benchCfg, 0, MEDIAN_CALC);
+    while ((opt = getopt(argc, argv, "a:bc:d:eg:I:o:O:p:r:sw:x:")) != -1) {
+        int harness = benchOption(&benchCfg, opt, optarg);
+        if (harness != 0)
+            badArgs |= harness < 0;
+        else if (opt == 'a' && parseSortAlgo(optarg) >= 0)
+            sortAlgo = parseSortAlgo(optarg);
+        else if (opt == 'b')
+            bench = 1;
+        else if (opt == 'c')
+            partitionCutoff = atoi(optarg);
+        else if (opt == 'd' && parseSortInput(optarg) >= 0)
+            input = parseSortInput(optarg);
+        else if (opt == 'g')
+            seed = strtoull(optarg, NULL, 10);
+        else if (opt == 'I')
+            inputFile = optarg;
+        else if (opt == 'O')
+            outputFile = optarg;
+        else if (opt == 'p' && parsePartitionMode(optarg) >= 0)
+            partMode = parsePartitionMode(optarg);
+        else if (opt == 's')
+            sweep = 1;
+        else if (opt == 'x' && atol(optarg) > 0)
+            budgetMB = atol(optarg);
+        else
+            badArgs = 1;
+    }
+    // the size, or with -s a list of them (a sweep of each)
+    char *sizes[SWEEP_MAX_SIZES];
+    int numSizes = 1, sweepSizes[SWEEP_MAX_SIZES] = { DEFAULTSIZE };
+    if (argc > optind) {
+        numSizes = sweepSizeList(argv[optind], sizes);
+        for (int s = 0; s < numSizes; s++)
+            sweepSizes[s] = atoi(sizes[s]);
+    }
+    if (badArgs || numSizes < 1 || (numSizes > 1 && !sweep) || ((bench || sweep) && (inputFile || outputFile)) ||
+        (budgetMB && (!inputFile || !outputFile))) {
+        fprintf(stderr, "usage: %s [-a quick|radix|sample|auto] [-b] [-c cutoff] " SORT_INPUT_USAGE " " BENCH_USAGE " [-g seed] [-I file] [-O file] [-p lomuto|3way] [-s] [-x budgetMB] size[,size...] numWorkers\n", argv[0]);
+        return 1;
+    }
+    int n = 0;
+    for (int s = 0; s < numSizes; s++)
+        n = sweepSizes[s] > n ? sweepSizes[s] : n;
+    int numWorkers = (argc > optind + 1) ? atoi(argv[optind + 1]) : sweepDefaultWorkers();
+    if (numWorkers < 1) {
+        numWorkers = 1;
+    }
 
-        double start = omp_get_wtime();
-        serial_quicksort(arr, 0, n - 1);
-        double end = omp_get_wtime();
+    // -x: sort a file that need not fit in memory, runs of it at a time
+    if (budgetMB) {
+        return external_sort_file(inputFile, outputFile, (size_t)budgetMB << 20, numWorkers, &benchCfg);
+    }
 
-        seq_times[trial] = end - start;
+    // Allocate memory for original data array and working copy.
+    // -s: the largest weak scaling run sorts numWorkers times the largest n elements.
+    long long allocSize = sweep ? (long long)n * numWorkers : n;
+    // -I: sort the keys of a file, mapped in place of the generated input
+    Matrix inputKeys;
+    if (inputFile) {
+        long long keys;
+        if (loadIntArray(&inputKeys, inputFile, BIN_POPULATE, &keys) != 0) {
+            return 1;
+        }
+        if (keys > INT_MAX) {
+            fprintf(stderr, "%s: more than %d keys\n", inputFile, INT_MAX);
+            return 1;
+        }
+        n = allocSize = (int)keys;
+    }
+    int *orig = inputFile ? (int *)inputKeys.data
+              : allocSize <= INT_MAX ? (int *)malloc(allocSize * sizeof(int)) : NULL;
+    int *arr  = allocSize <= INT_MAX ? (int *)malloc(allocSize * sizeof(int)) : NULL;
+    int *scratch = allocSize <= INT_MAX ? (int *)malloc(allocSize * sizeof(int)) : NULL;
+    if (!orig || !arr || !scratch) {
+        fprintf(stderr, "not enough memory for %lld elements\n", allocSize);
+        return 1;
     }
+    BenchRun seq_run, par_run;
+    char benchCase[48];
+    perfInit(&perf, &benchCfg, numWorkers);
+    if (!sweep)
+        benchHeader(&benchCfg);
 
-    //Parallel sorting
-    for (int trial = 0; trial < MEDIAN_CALC; trial++) {
-        // Copy the unsorted data into the working array.
-        memcpy(arr, orig, n * sizeof(int));
+    // -b: every input with every sortMethods row, on the same data.
+    if (bench) {
+        if (benchCfg.format == BENCH_TEXT)
+            printf("%-8s %-7s %12s %12s %8s\n", "input", "scheme", "sequential", "parallel", "speedup");
+        for (int in = 0; in < IN_COUNT; in++) {
+            if (fill_input(orig, n, in, seed) != 0) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+            for (int method = 0; method < SORT_METHODS; method++) {
+                sortAlgo = sortMethods[method].algo;
+                partMode = sortMethods[method].mode;
+                time_sorts(arr, scratch, orig, n, numWorkers, &benchCfg, &seq_run, &par_run);
+                if (benchCfg.format == BENCH_TEXT)
+                    printf("%-8s %-7s %12g %12g %8.2f\n", sortInputNames[in], sortMethods[method].name,
+                           seq_run.median, par_run.median, seq_run.median / par_run.median);
+                // the text table already has the medians, so only csv, json and -e report here
+                if (benchCfg.format != BENCH_TEXT || perf.enabled) {
+                    snprintf(benchCase, sizeof(benchCase), "%s/%s/sequential", sortInputNames[in], sortMethods[method].name);
+                    benchReport(&seq_run, "quickSortOMP", benchCase, n, 1);
+                    snprintf(benchCase, sizeof(benchCase), "%s/%s/parallel", sortInputNames[in], sortMethods[method].name);
+                    perfReport(&perf, &par_run, "quickSortOMP", benchCase, n, numWorkers, (double)n * sizeof(int));
+                } else {
+                    free(seq_run.times);
+                    free(par_run.times);
+                }
+            }
+        }
+        free(orig);
+        free(arr);
+        perfDestroy(&perf);
+        free(scratch);
+        return 0;
+    }
 
-        double start = omp_get_wtime();
-        #pragma omp parallel num_threads(numWorkers)
-        {
-            #pragma omp single nowait
-            {
-                parallel_quicksort(arr, 0, n - 1);
+    // -s: 1..numWorkers threads on n elements (strong) and on n per thread (weak), for every n.
+    // The input is regenerated at every size, so sorted or organ inputs keep their shape.
+    if (sweep) {
+        sweepHeader(&benchCfg);
+        for (int s = 0; s < numSizes; s++) {
+            int base = sweepSizes[s];
+            ScalingSweep scaling;
+            if (sweepBegin(&scaling, numWorkers, base) != 0) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
             }
+            for (int p = 1; p <= numWorkers; p++) {
+                fill_input(orig, base, input, seed);
+                time_parallel_sort(arr, scratch, orig, base, p, &benchCfg, &par_run);
+                scaling.strong[p] = par_run.median;
+                free(par_run.times);
+                fill_input(orig, base * p, input, seed);
+                time_parallel_sort(arr, scratch, orig, base * p, p, &benchCfg, &par_run);
+                scaling.weak[p] = par_run.median;
+                free(par_run.times);
+            }
+            snprintf(benchCase, sizeof(benchCase), "%s/%s/%d", sortInputNames[input], sortAlgoNames[sortAlgo], base);
+            sweepReport(&scaling, &benchCfg, "quickSortOMP", benchCase);
+            sweepEnd(&scaling);
         }
-        double end = omp_get_wtime();
+        free(orig);
+        free(arr);
+        perfDestroy(&perf);
+        free(scratch);
+        return 0;
+    }
 
-        par_times[trial] = end - start;
+    // Initialize the array with values from the chosen generator, the same for any numWorkers.
+    if (!inputFile && fill_input(orig, n, input, seed) != 0) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
     }
 
     // Compute median execution times and the speedup.
-    double seq_median = median_val(seq_times, MEDIAN_CALC);
-    double par_median = median_val(par_times, MEDIAN_CALC);
-    double speedup = seq_median / par_median;
-    for(int i = 0; i<n-1; i++){
-        if(arr[i]> arr[i+1]){
-            printf("unsorted");
-            break;
+    time_sorts(arr, scratch, orig, n, numWorkers, &benchCfg, &seq_run, &par_run);
+    double speedup = seq_run.median / par_run.median;
+    if (benchCfg.format == BENCH_TEXT) {
+        printf("Median Sequential Time: %g seconds\n", seq_run.median);
+        printf("Median Parallel Time: %g seconds\n", par_run.median);
+        printf("Speedup (Sequential / Parallel): %g\n", speedup);
+    }
+    const char *inputName = inputFile ? "file" : sortInputNames[input];
+    snprintf(benchCase, sizeof(benchCase), "%s/%s/sequential", inputName, sortAlgoNames[sortAlgo]);
+    benchReport(&seq_run, "quickSortOMP", benchCase, n, 1);
+    snprintf(benchCase, sizeof(benchCase), "%s/%s/parallel", inputName, sortAlgoNames[sortAlgo]);
+    perfReport(&perf, &par_run, "quickSortOMP", benchCase, n, numWorkers, (double)n * sizeof(int));
+
+    // -O: the keys as the last parallel run sorted them
+    if (outputFile) {
+        Matrix sorted = arrayMatrix(arr, n);
+        if (saveMatrix(&sorted, outputFile) != 0) {
+            return 1;
         }
     }
-    printf("Median Sequential Time: %g seconds\n", seq_median);
-    printf("Median Parallel Time: %g seconds\n", par_median);
-    printf("Speedup (Sequential / Parallel): %g\n", speedup);
 
-    free(orig);
+    if (inputFile) {
+        freeMatrix(&inputKeys);
+    } else {
+        free(orig);
+    }
     free(arr);
+    perfDestroy(&perf);
+    free(scratch);
     return 0;
 }
\ No newline at end of file
@@ -1,5 +1,36 @@
 /******************************************************************************
- Unisex Bathroom Simulation 
+ Unisex Bathroom Simulation
+
+ usage under Linux:
+   gcc HW3.c -lpthread
+   a.out [-b] [-o text|csv|json] [-r trials] [-w warmup] [-n admissions] [-k usec[,usec]] [-u usec] [-p policy] [-q quantum] [-t trace.json] [numMen numWomen]
+
+ numMen and numWomen default to 25 each, at most 65535 (the counts of the group mutex)
+ without -b the threads sleep and print every step for 30 seconds
+ -b benchmarks the protocol instead: no sleeps and no printing, every
+    trial (-r/-w, see ../common/benchHarness.h, but no -e: the wait
+    metrics fill the report) runs until there were
+    -n admissions (default 1000000); the work outside and inside the
+    bathroom is a calibrated busy loop of up to -k and -u microseconds
+    (default 10 and 2, -k 10,40 lets the women come four times less
+    often than the men), reported are the admissions per second, how
+    evenly the visits were spread over the threads, how long a thread
+    took to get in (mean, median, 99th, 99.9th percentile and max, also
+    per class) and how many later arrivals got in before it, at most
+ both modes time every visit from arrival to admission into a histogram
+ per thread (see ../common/latencyTrace.h) and print the wait times of
+ each class at the end; -t also writes the first visits of every thread
+ to a Chrome trace (chrome://tracing, ui.perfetto.dev), of the last trial
+ with -b, to see who waits at a turn change
+ the printing goes through a ring per thread to a thread that writes it
+ (see ../common/asyncLog.h), nobody waits on the console inside the
+ bathroom; gcc -DASYNC_LOG_OFF HW3.c -lpthread leaves it out entirely
+ the protocol is a group mutex on a futex (see ../common/groupMutex.h),
+ a waiting class is let in all at once when the turn changes; -p picks
+ who gets in while the other class waits: turn (the default, the class
+ whose turn it is as long as any of it is inside), alternate, batch
+ (-q per turn, default 8), slice (-q microseconds per turn, default 100)
+ or fifo
  ******************************************************************************/
 
  #include <stdio.h>
@@ -8,171 +39,474 @@
  #include <time.h>
  #include <pthread.h>
  #include <semaphore.h>
- 
+ #include "../common/asyncLog.h"
+ #include "../common/benchHarness.h"
+ #include "../common/groupMutex.h"
+ #include "../common/latencyTrace.h"
+
  #define NUM_MEN    25
  #define NUM_WOMEN  25
- 
+ #define DEFAULT_ADMISSIONS 1000000  /* -b: admissions per trial */
+ #define DEFAULT_WORK_USEC 10        /* -b: busy work outside, at most */
+ #define DEFAULT_USE_USEC 2          /* -b: busy work inside, at most */
+ #define DEFAULT_BATCH 8             /* -p batch: admissions per turn */
+ #define DEFAULT_SLICE_USEC 100      /* -p slice: length of a turn */
+ #define TRACE_VISITS 2000           /* -t: visits per thread in the trace */
+ #define LOG_RECORDS 1024            /* printed lines per thread not yet written, at most */
+
  // Global flag: while true, threads continue; when false, they finish up.
  static volatile int keepRunning = 1;
- 
- // Turn indicator: 0 = no one, 1 = men, 2 = women.
- int turn = 0;
- int menInside = 0, womenInside = 0;
- int menWaiting = 0, womenWaiting = 0;
- 
+
+ // The bathroom: who is inside, who waits and whose turn it is.
+ enum { MEN, WOMEN };
+ GroupMutex room;
+ GroupPolicy policy = GROUP_TURN;  // -p
+ int quantum = 0;                  // -q, 0 for the policy's default
+ int numMen = NUM_MEN, numWomen = NUM_WOMEN;
+
  // Fairness counters: Thread counter increments, when a thread enters the bathroom
- int manCounter[NUM_MEN] = {0};
- int womanCounter[NUM_WOMEN] = {0};
- 
- // Semaphores
- sem_t lock;
- sem_t menQueue;
- sem_t womenQueue;
- 
+ int *manCounter;
+ int *womanCounter;
+
+ // -b: benchmark mode, the trial ends after targetAdmissions
+ int benchMode = 0;
+ long long targetAdmissions = DEFAULT_ADMISSIONS;
+ int workUsec[2] = { DEFAULT_WORK_USEC, DEFAULT_WORK_USEC }, useUsec = DEFAULT_USE_USEC;
+ double spinsPerUsec;       // of spin(), from calibrateSpin()
+ const char *traceFile;     // -t
+ AsyncLog eventLog;         // the printing, not with -b
+ sem_t done;                // posted at the last admission
+ pthread_barrier_t start;   // all threads and main, before the clock starts
+
+ // One thread, on its own cache line: its busy work and how long it waited to get in
+ typedef struct {
+     _Alignas(64) int id;
+     int cls;           // MEN or WOMEN
+     unsigned seed;
+     long long arrived;    // ns, when it wanted in
+     long long entered;    // ns, when it got in
+     GroupOrder order;     // its place among arrivals and admissions, from the lock
+     long long bypassMax;  // later arrivals that got in first, at most
+     LatencyHistogram wait;  // ns from arrived to entered, every visit
+     TraceBuffer trace;      // -t: the first visits
+     LogRing *log;           // its printing, NULL with -b
+ } Visitor;
+
+ // printf through the thread's log ring, only outside benchmark mode
+ #define say(v, ...) do { if ((v)->log) asyncLog((v)->log, __VA_ARGS__); } while (0)
+
+ // Burn about n loop iterations.
+ void spin(long n) {
+     for (long i = 0; i < n; i++)
+         __asm__ __volatile__("" ::: "memory");
+ }
+
+ // How many iterations of spin() take a microsecond.
+ void calibrateSpin(void) {
+     long n = 1000000;
+     double t;
+     do {
+         n *= 2;
+         t = benchNow();
+         spin(n);
+         t = benchNow() - t;
+     } while (t < 0.05);
+     spinsPerUsec = n / (t * 1e6);
+ }
+
+ void arriving(Visitor *v) {
+     v->arrived = latNow();
+ }
+
+ // Called by every thread that enters.
+ void admitted(Visitor *v) {
+     v->entered = latNow();
+     latRecord(&v->wait, v->entered - v->arrived);
+     // if everybody who came earlier is in already, this many who came later got in first
+     long long bypass = v->order.admission - v->order.arrival;
+     v->bypassMax = bypass > v->bypassMax ? bypass : v->bypassMax;
+     if (benchMode && v->order.admission + 1 == targetAdmissions)
+         sem_post(&done);
+ }
+
+ // Called by every thread that left.
+ void leaving(Visitor *v) {
+     if (traceFile)
+         traceAdd(&v->trace, v->arrived, v->entered, latNow());
+ }
+
  // Simulate "working" outside the bathroom by sleeping for a random time.
- void do_work(const char *who, int id) {
-     usleep(rand() % 4000000);  // change value here to increase/decrease time outside the bathroom, up to 4sec
+ void do_work(Visitor *v) {
+     if (benchMode)
+         spin((long)((rand_r(&v->seed) % (workUsec[v->cls] + 1)) * spinsPerUsec));
+     else
+         usleep(rand() % 4000000);  // change value here to increase/decrease time outside the bathroom, up to 4sec
  }
- 
+
  // Simulate using the bathroom by sleeping for a shorter random time.
- void use_bathroom(const char *who, int id) {
-     usleep(rand() % 500000);  //up to 0.5 seconds
+ void use_bathroom(Visitor *v) {
+     if (benchMode)
+         spin((long)((rand_r(&v->seed) % (useUsec + 1)) * spinsPerUsec));
+     else
+         usleep(rand() % 500000);  //up to 0.5 seconds
  }
- 
+
 //Man thread
  void *man(void *arg) {
-     int id = *(int *)arg;
+     Visitor *v = arg;
+     int id = v->id;
+     if (benchMode)
+         pthread_barrier_wait(&start);
      while (keepRunning) {
-         do_work("Man", id);
- 
-         sem_wait(&lock);
-         if (womenInside > 0 || (turn == 2 && womenWaiting > 0)) {
-             menWaiting++;
-             printf("Man %d is waiting.\n", id);
-             sem_post(&lock);
- 
-             sem_wait(&menQueue);  // Block until signaled.
-             sem_wait(&lock);
-             menWaiting--;
+         do_work(v);
+
+         arriving(v);
+         int menInside = groupTryLock(&room, MEN, &v->order);
+         if (menInside == 0) {
+             say(v, "Man %d is waiting.\n", id);
+             menInside = groupLock(&room, MEN, &v->order);  // Block until the men's turn.
          }
-         menInside++;
-         turn = 1;  // Set turn to men.
          manCounter[id]++;  // Count this bathroom visit.
-         printf("Man %d enters (menInside=%d).\n", id, menInside);
-         sem_post(&lock);
- 
-         use_bathroom("Man", id);
- 
-         sem_wait(&lock);
-         menInside--;
-         printf("Man %d leaves (menInside=%d).\n", id, menInside);
-         if (menInside == 0 && womenWaiting > 0) {
-             turn = 2;
-             sem_post(&womenQueue);
-         }
-         sem_post(&lock);
+         admitted(v);
+         say(v, "Man %d enters (menInside=%d).\n", id, menInside);
+
+         use_bathroom(v);
+
+         menInside = groupUnlock(&room, MEN);  // The last one hands the turn to waiting women.
+         leaving(v);
+         say(v, "Man %d leaves (menInside=%d).\n", id, menInside);
      }
      return NULL;
  }
- 
+
 //Woman thread
  void *woman(void *arg) {
-     int id = *(int *)arg;
+     Visitor *v = arg;
+     int id = v->id;
+     if (benchMode)
+         pthread_barrier_wait(&start);
      while (keepRunning) {
-         do_work("Woman", id);
-        
-         sem_wait(&lock);
-         if (menInside > 0 || (turn == 1 && menWaiting > 0)) {
-             womenWaiting++;
-             printf("Woman %d is waiting.\n", id);
-             sem_post(&lock);
- 
-             sem_wait(&womenQueue);
-             sem_wait(&lock);
-             womenWaiting--;
+         do_work(v);
+
+         arriving(v);
+         int womenInside = groupTryLock(&room, WOMEN, &v->order);
+         if (womenInside == 0) {
+             say(v, "Woman %d is waiting.\n", id);
+             womenInside = groupLock(&room, WOMEN, &v->order);
          }
-         womenInside++;
-         turn = 2;  // Set turn to women.
          womanCounter[id]++;  // Count this bathroom visit.
-         printf("Woman %d enters (womenInside=%d).\n", id, womenInside);
-         sem_post(&lock);
- 
-         use_bathroom("Woman", id);
- 
-         sem_wait(&lock);
-         womenInside--;
-         printf("Woman %d leaves (womenInside=%d).\n", id, womenInside);
-         if (womenInside == 0 && menWaiting > 0) {
-             turn = 1;
-             sem_post(&menQueue);
-         }
-         sem_post(&lock);
+         admitted(v);
+         say(v, "Woman %d enters (womenInside=%d).\n", id, womenInside);
+
+         use_bathroom(v);
+
+         womenInside = groupUnlock(&room, WOMEN);
+         leaving(v);
+         say(v, "Woman %d leaves (womenInside=%d).\n", id, womenInside);
      }
      return NULL;
  }
- 
- 
- int main() {
-     srand(time(NULL));
- 
-     // Initialize semaphores.
-     sem_init(&lock, 0, 1);
-     sem_init(&menQueue, 0, 0);
-     sem_init(&womenQueue, 0, 0);
- 
-     pthread_t menThreads[NUM_MEN];
-     pthread_t womenThreads[NUM_WOMEN];
-     int menIDs[NUM_MEN];
-     int womenIDs[NUM_WOMEN];
- 
-     // Create man threads
-     for (int i = 0; i < NUM_MEN; i++) {
-         menIDs[i] = i;
-         pthread_create(&menThreads[i], NULL, man, &menIDs[i]);
-     }
-     // Create woman threads
-     for (int i = 0; i < NUM_WOMEN; i++) {
-         womenIDs[i] = i;
-         pthread_create(&womenThreads[i], NULL, woman, &womenIDs[i]);
-     }
 
-     //simulation timer
-     sleep(30);
- 
-     // Signal threads to stop
-     keepRunning = 0;
- 
-     // Unblock any threads waiting on the semaphores.
-     for (int i = 0; i < NUM_MEN; i++) {
-         sem_post(&menQueue);
+ // A visitor with no visits yet; keeps its trace buffer.
+ void resetVisitor(Visitor *v, int id, int cls) {
+     TraceBuffer trace = v->trace;
+     *v = (Visitor){ .id = id, .cls = cls, .seed = 2 * id + 1 + cls };
+     v->trace = (TraceBuffer){ trace.visits, 0, trace.capacity, 0 };
+ }
+
+ // Fresh protocol state and counters, then start all the threads.
+ void startThreads(pthread_t *menThreads, pthread_t *womenThreads, Visitor *men, Visitor *women) {
+     keepRunning = 1;
+     groupInit(&room, policy, quantum);
+     for (int i = 0; i < numMen; i++) {
+         manCounter[i] = 0;
+         resetVisitor(&men[i], i, MEN);
+         men[i].log = benchMode ? NULL : asyncLogRing(&eventLog, i);
+         pthread_create(&menThreads[i], NULL, man, &men[i]);
      }
-     for (int i = 0; i < NUM_WOMEN; i++) {
-         sem_post(&womenQueue);
+     for (int i = 0; i < numWomen; i++) {
+         womanCounter[i] = 0;
+         resetVisitor(&women[i], i, WOMEN);
+         women[i].log = benchMode ? NULL : asyncLogRing(&eventLog, numMen + i);
+         pthread_create(&womenThreads[i], NULL, woman, &women[i]);
      }
- 
+ }
+
+ // Signal the threads to stop and join them all; the waiting ones get
+ // their turn as the others finish their last visit.
+ void stopThreads(pthread_t *menThreads, pthread_t *womenThreads) {
+     keepRunning = 0;
+
      // Join all threads.
-     for (int i = 0; i < NUM_MEN; i++) {
+     for (int i = 0; i < numMen; i++) {
          pthread_join(menThreads[i], NULL);
      }
-     for (int i = 0; i < NUM_WOMEN; i++) {
+     for (int i = 0; i < numWomen; i++) {
          pthread_join(womenThreads[i], NULL);
      }
- 
+ }
+
+ // Fewest, mean and most visits of one class.
+ void visitSpread(const int *counter, int n, int *fewest, double *mean, int *most) {
+     long long total = 0;
+     *fewest = *most = counter[0];
+     for (int i = 0; i < n; i++) {
+         total += counter[i];
+         *fewest = counter[i] < *fewest ? counter[i] : *fewest;
+         *most = counter[i] > *most ? counter[i] : *most;
+     }
+     *mean = (double) total / n;
+ }
+
+ // Jain's fairness index of the visits of all threads: 1 if all are equal, 1/n if one got everything.
+ double jainIndex(void) {
+     double sum = 0, squares = 0;
+     for (int i = 0; i < numMen; i++) {
+         sum += manCounter[i];
+         squares += (double) manCounter[i] * manCounter[i];
+     }
+     for (int i = 0; i < numWomen; i++) {
+         sum += womanCounter[i];
+         squares += (double) womanCounter[i] * womanCounter[i];
+     }
+     return squares > 0 ? sum * sum / ((numMen + numWomen) * squares) : 1;
+ }
+
+ // The wait times of n threads in one histogram.
+ void mergeWaits(LatencyHistogram *h, const Visitor *v, int n) {
+     latInit(h);
+     for (int i = 0; i < n; i++)
+         latMerge(h, &v[i].wait);
+ }
+
+ // Median, p99 and p99.9 wait of each class.
+ void printWaits(Visitor *men, Visitor *women) {
+     const char *names[2] = { "Men", "Women" };
+     static LatencyHistogram waits[2];
+     mergeWaits(&waits[MEN], men, numMen);
+     mergeWaits(&waits[WOMEN], women, numWomen);
+     for (int c = MEN; c <= WOMEN; c++)
+         printf("%s waited %lld times, median up to %lld ns, p99 up to %lld ns, p99.9 up to %lld ns, at most %lld ns\n",
+                names[c], waits[c].count, latPercentile(&waits[c], 50), latPercentile(&waits[c], 99),
+                latPercentile(&waits[c], 99.9), waits[c].max);
+ }
+
+ // -t: the traced visits of all threads, men and women in two groups.
+ int writeTrace(Visitor *men, Visitor *women) {
+     TraceFile tf;
+     long long origin = 0, dropped = 0;
+     for (int i = 0; i < numMen + numWomen; i++) {
+         const TraceBuffer *t = i < numMen ? &men[i].trace : &women[i - numMen].trace;
+         if (t->count > 0 && (origin == 0 || t->visits[0].arrived < origin))
+             origin = t->visits[0].arrived;
+         dropped += t->dropped;
+     }
+     if (traceBegin(&tf, traceFile) != 0)
+         return -1;
+     traceGroup(&tf, 1, "men");
+     for (int i = 0; i < numMen; i++)
+         traceWrite(&tf, &men[i].trace, 1, i, origin);
+     traceGroup(&tf, 2, "women");
+     for (int i = 0; i < numWomen; i++)
+         traceWrite(&tf, &women[i].trace, 2, i, origin);
+     if (traceEnd(&tf) != 0) {
+         perror(traceFile);
+         return -1;
+     }
+     if (dropped > 0)
+         fprintf(stderr, "%s: the first %d visits of every thread, %lld later ones left out\n", traceFile, TRACE_VISITS, dropped);
+     return 0;
+ }
+
+ void freeTraces(Visitor *men, Visitor *women) {
+     for (int i = 0; i < numMen; i++)
+         traceFree(&men[i].trace);
+     for (int i = 0; i < numWomen; i++)
+         traceFree(&women[i].trace);
+ }
+
+ // -b: the timed trials of the protocol on busy work.
+ int benchmark(BenchConfig *bench, pthread_t *menThreads, pthread_t *womenThreads, Visitor *men, Visitor *women) {
+     enum { M_RATE, M_FAIRNESS, M_WAIT, M_WAIT_P50, M_WAIT_P99, M_WAIT_P999, M_WAIT_MAX, M_BYPASS,
+            M_MEN_P99, M_WOMEN_P99, M_COUNT };
+     double sums[M_COUNT] = { 0 };
+     static LatencyHistogram waits, womenWaits;
+     BenchRun run;
+     char benchCase[48];
+
+     calibrateSpin();
+     bench->metricNames[bench->numMetrics++] = "admissions_per_sec";
+     bench->metricNames[bench->numMetrics++] = "fairness";
+     bench->metricNames[bench->numMetrics++] = "wait_ns";
+     bench->metricNames[bench->numMetrics++] = "wait_p50_ns";
+     bench->metricNames[bench->numMetrics++] = "wait_p99_ns";
+     bench->metricNames[bench->numMetrics++] = "wait_p999_ns";
+     bench->metricNames[bench->numMetrics++] = "wait_max_ns";
+     bench->metricNames[bench->numMetrics++] = "bypass_max";
+     bench->metricNames[bench->numMetrics++] = "men_wait_p99_ns";
+     bench->metricNames[bench->numMetrics++] = "women_wait_p99_ns";
+     benchHeader(bench);
+     sem_init(&done, 0, 0);
+     pthread_barrier_init(&start, NULL, numMen + numWomen + 1);
+     benchBegin(&run, bench);
+     while (benchNext(&run)) {
+         startThreads(menThreads, womenThreads, men, women);
+         pthread_barrier_wait(&start);
+         benchStart(&run);
+         sem_wait(&done);
+         benchStop(&run);
+         stopThreads(menThreads, womenThreads);
+         if (!benchIsTrial(&run))
+             continue;
+
+         long long bypassMax = 0;
+         for (int i = 0; i < numMen + numWomen; i++) {
+             Visitor *v = i < numMen ? &men[i] : &women[i - numMen];
+             bypassMax = v->bypassMax > bypassMax ? v->bypassMax : bypassMax;
+         }
+         mergeWaits(&waits, men, numMen);
+         sums[M_MEN_P99] += latPercentile(&waits, 99);
+         mergeWaits(&womenWaits, women, numWomen);
+         sums[M_WOMEN_P99] += latPercentile(&womenWaits, 99);
+         latMerge(&waits, &womenWaits);
+         sums[M_RATE] += targetAdmissions / run.times[run.iteration - run.cfg.warmup];
+         sums[M_FAIRNESS] += jainIndex();
+         sums[M_WAIT] += latMean(&waits);
+         sums[M_WAIT_P50] += latPercentile(&waits, 50);
+         sums[M_WAIT_P99] += latPercentile(&waits, 99);
+         sums[M_WAIT_P999] += latPercentile(&waits, 99.9);
+         sums[M_WAIT_MAX] += waits.max;
+         sums[M_BYPASS] += bypassMax;
+     }
+     for (int m = 0; m < M_COUNT; m++)
+         run.metrics[m] = sums[m] / bench->trials;
+
+     if (bench->format == BENCH_TEXT) {
+         int fewest, most;
+         double mean;
+         printf("%lld admissions in %g sec, %g per sec\n", targetAdmissions, run.median, run.metrics[M_RATE]);
+         visitSpread(manCounter, numMen, &fewest, &mean, &most);
+         printf("Men: %d threads, %d to %d visits (mean %g)\n", numMen, fewest, most, mean);
+         visitSpread(womanCounter, numWomen, &fewest, &mean, &most);
+         printf("Women: %d threads, %d to %d visits (mean %g)\n", numWomen, fewest, most, mean);
+         printf("Fairness (Jain's index, 1 is even): %g\n", run.metrics[M_FAIRNESS]);
+         printf("Waited %g ns on average to get in, median up to %g ns, p99 up to %g ns, p99.9 up to %g ns, at most %g ns\n",
+                run.metrics[M_WAIT], run.metrics[M_WAIT_P50], run.metrics[M_WAIT_P99], run.metrics[M_WAIT_P999],
+                run.metrics[M_WAIT_MAX]);
+         printf("At most %g later arrivals got in first (%s policy)\n", run.metrics[M_BYPASS], groupPolicyNames[policy]);
+         printf("Last trial:\n");
+         printWaits(men, women);
+     }
+     snprintf(benchCase, sizeof(benchCase), "%dm%dw/%d:%dus/%dus/%s", numMen, numWomen, workUsec[MEN], workUsec[WOMEN],
+              useUsec, groupPolicyNames[policy]);
+     benchReport(&run, "HW3", benchCase, targetAdmissions, numMen + numWomen);
+     pthread_barrier_destroy(&start);
+     sem_destroy(&done);
+     return traceFile && writeTrace(men, women) != 0;
+ }
+
+
+ int main(int argc, char *argv[]) {
+     srand(time(NULL));
+
+     /* read command line args if any */
+     int opt, badArgs = 0;
+     BenchConfig bench;
+     benchDefaults(&bench, 0, 1);
+     while ((opt = getopt(argc, argv, "bk:n:o:p:q:r:t:u:w:")) != -1) {
+         int harness = benchOption(&bench, opt, optarg);
+         if (harness < 0)
+             badArgs = 1;
+         else if (harness == 0 && opt == 'b')
+             benchMode = 1;
+         else if (harness == 0 && opt == 'k')
+             badArgs |= sscanf(optarg, "%d,%d", &workUsec[MEN], &workUsec[WOMEN]) < 1;
+         else if (harness == 0 && opt == 'n')
+             targetAdmissions = atoll(optarg);
+         else if (harness == 0 && opt == 'p' && parseGroupPolicy(optarg) >= 0)
+             policy = (GroupPolicy) parseGroupPolicy(optarg);
+         else if (harness == 0 && opt == 'q')
+             quantum = atoi(optarg);
+         else if (harness == 0 && opt == 't')
+             traceFile = optarg;
+         else if (harness == 0 && opt == 'u')
+             useUsec = atoi(optarg);
+         else if (harness == 0)
+             badArgs = 1;
+     }
+     if (argc > optind)
+         numMen = atoi(argv[optind]);
+     if (argc > optind + 1)
+         numWomen = atoi(argv[optind + 1]);
+     if (badArgs || numMen < 1 || numWomen < 1 || numMen > GROUP_MAX_THREADS || numWomen > GROUP_MAX_THREADS ||
+         workUsec[MEN] < 0 || workUsec[WOMEN] < 0 || useUsec < 0 || targetAdmissions < 1 || quantum < 0) {
+         fprintf(stderr, "usage: %s [-b] [-o text|csv|json] [-r trials] [-w warmup] [-n admissions] [-k usec[,usec]] [-u usec] [-p turn|alternate|batch|slice|fifo] [-q quantum] [-t trace.json] [numMen numWomen]\n", argv[0]);
+         return 1;
+     }
+     if (quantum == 0)
+         quantum = policy == GROUP_SLICE ? DEFAULT_SLICE_USEC : DEFAULT_BATCH;
+
+     pthread_t *menThreads = malloc(sizeof(pthread_t) * numMen);
+     pthread_t *womenThreads = malloc(sizeof(pthread_t) * numWomen);
+     Visitor *men = aligned_alloc(64, sizeof(Visitor) * numMen);
+     Visitor *women = aligned_alloc(64, sizeof(Visitor) * numWomen);
+     manCounter = calloc(numMen, sizeof(int));
+     womanCounter = calloc(numWomen, sizeof(int));
+     for (int i = 0; i < numMen + numWomen; i++) {
+         Visitor *v = i < numMen ? &men[i] : &women[i - numMen];
+         v->trace = (TraceBuffer){ 0 };
+         if (traceFile && traceInit(&v->trace, TRACE_VISITS) != 0) {
+             fprintf(stderr, "out of memory for the trace\n");
+             return 1;
+         }
+     }
+
+     if (benchMode) {
+         int result = benchmark(&bench, menThreads, womenThreads, men, women);
+         freeTraces(men, women);
+         free(menThreads);
+         free(womenThreads);
+         free(men);
+         free(women);
+         free(manCounter);
+         free(womanCounter);
+         return result;
+     }
+
+     if (asyncLogStart(&eventLog, stdout, numMen + numWomen, LOG_RECORDS) != 0) {
+         fprintf(stderr, "cannot start the log\n");
+         return 1;
+     }
+
+     // Create the man and woman threads
+     startThreads(menThreads, womenThreads, men, women);
+
+     //simulation timer
+     sleep(30);
+
+     // Signal threads to stop and wait for them
+     stopThreads(menThreads, womenThreads);
+     asyncLogStop(&eventLog);
+
      printf("\nSimulation complete.\n");
 
      // Final counters printed.
-     for (int i = 0; i < NUM_MEN; i++) {
+     for (int i = 0; i < numMen; i++) {
          printf("Man %d entered the bathroom %d times.\n", i, manCounter[i]);
      }
-     for (int i = 0; i < NUM_WOMEN; i++) {
+     for (int i = 0; i < numWomen; i++) {
          printf("Woman %d entered the bathroom %d times.\n", i, womanCounter[i]);
      }
- 
-     // Clean up semaphores.
-     sem_destroy(&lock);
-     sem_destroy(&menQueue);
-     sem_destroy(&womenQueue);
- 
-     return 0;
+     printWaits(men, women);
+     int result = traceFile && writeTrace(men, women) != 0;
+
+     freeTraces(men, women);
+     free(menThreads);
+     free(womenThreads);
+     free(men);
+     free(women);
+     free(manCounter);
+     free(womanCounter);
+     return result;
  }
- 
+
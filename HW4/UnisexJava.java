@@ -1,9 +1,169 @@
+import java.io.FileWriter;
+import java.io.IOException;
+import java.io.PrintWriter;
 import java.time.LocalTime;
+import java.util.concurrent.atomic.AtomicLong;
 
 /******************
  * * Monitor solution to unisex bathroom problem in java
+ * * every visit is timed from arrival to admission into a histogram per
+ * * thread; the wait times of each class are printed at exit (also on
+ * * Ctrl-C), java UnisexJavaTest trace.json also writes the first visits
+ * * of every thread to a Chrome trace (chrome://tracing, ui.perfetto.dev)
+ * * the monitor does not print, it logs to AsyncLog, which prints on its own
+ * * thread; java -Dbathroom.log=off UnisexJavaTest turns the log off
  ******************/
 
+// Asynchronous log like ../common/asyncLog.h: every thread stores fixed-size
+// records (time, event, count) into its own single-producer ring, a daemon
+// thread formats and prints them in batches, in the order they happened, so
+// nothing is printed while holding the monitor. A full ring makes its thread
+// yield. ENABLED is a constant, the JIT drops the calls when it is false.
+class AsyncLog {
+    static final boolean ENABLED = !"off".equals(System.getProperty("bathroom.log"));
+    static final int RING = 1024; // records per thread, a power of two
+    static final int WAITING = 0, WANTS = 1, ENTERS = 2, LEAVES = 3;
+
+    // One thread's records; head is written by that thread only, tail by the drain thread only.
+    static final class Ring {
+        final long[] times = new long[RING];
+        final int[] events = new int[RING];
+        final int[] counts = new int[RING];
+        final AtomicLong head = new AtomicLong();
+        final AtomicLong tail = new AtomicLong();
+        long tailSeen; // tail when its thread last looked
+    }
+
+    private final int numMen;
+    private final Ring[] rings;
+    // System.nanoTime() to wall clock for the timestamps
+    private final LocalTime wallStart = LocalTime.now();
+    private final long nanoStart = System.nanoTime();
+    private final Thread drainer = new Thread(this::drainLoop);
+    private volatile boolean stopping;
+
+    AsyncLog(int numMen, int numWomen) {
+        this.numMen = numMen;
+        rings = new Ring[numMen + numWomen];
+        for (int t = 0; t < rings.length; t++) {
+            rings[t] = new Ring();
+        }
+        drainer.setDaemon(true);
+    }
+
+    void start() {
+        if (ENABLED) {
+            drainer.start();
+        }
+    }
+
+    // Called by man id only.
+    void man(int id, int event, int count) {
+        add(rings[id], event, count);
+    }
+
+    // Called by woman id only.
+    void woman(int id, int event, int count) {
+        add(rings[numMen + id], event, count);
+    }
+
+    private void add(Ring r, int event, int count) {
+        if (!ENABLED) {
+            return;
+        }
+        long head = r.head.get();
+        while (head - r.tailSeen >= RING) {
+            r.tailSeen = r.tail.get();
+            if (head - r.tailSeen >= RING) {
+                Thread.yield();
+            }
+        }
+        int i = (int) head & (RING - 1);
+        r.times[i] = System.nanoTime();
+        r.events[i] = event;
+        r.counts[i] = count;
+        r.head.lazySet(head + 1); // publishes the record
+    }
+
+    // Prints what the rings hold, merged by time; returns how many records.
+    private synchronized int drain() {
+        long[] next = new long[rings.length];
+        long[] heads = new long[rings.length];
+        for (int t = 0; t < rings.length; t++) {
+            next[t] = rings[t].tail.get();
+            heads[t] = rings[t].head.get();
+        }
+        StringBuilder out = new StringBuilder();
+        int n = 0;
+        while (true) {
+            int first = -1;
+            for (int t = 0; t < rings.length; t++) {
+                if (next[t] != heads[t] && (first < 0
+                        || rings[t].times[(int) next[t] & (RING - 1)] < rings[first].times[(int) next[first] & (RING - 1)])) {
+                    first = t;
+                }
+            }
+            if (first < 0) {
+                break;
+            }
+            format(out, first, (int) next[first]++ & (RING - 1));
+            n++;
+        }
+        for (int t = 0; t < rings.length; t++) {
+            rings[t].tail.lazySet(next[t]); // the records are free again
+        }
+        if (n > 0) {
+            System.out.print(out);
+            System.out.flush();
+        }
+        return n;
+    }
+
+    private void format(StringBuilder out, int t, int i) {
+        Ring r = rings[t];
+        boolean woman = t >= numMen;
+        out.append("Timestamp ").append(wallStart.plusNanos(r.times[i] - nanoStart))
+                .append(woman ? " - Woman " : " - Man ").append(woman ? t - numMen : t);
+        switch (r.events[i]) {
+            case WAITING:
+                out.append(" waiting");
+                break;
+            case WANTS:
+                out.append(" wants to enter");
+                break;
+            case ENTERS:
+                out.append(" enters (").append(woman ? "womenInside" : "menInside").append(" = ").append(r.counts[i]).append(").");
+                break;
+            default:
+                out.append(" leaves (").append(woman ? "womenInside" : "menInside").append(" = ").append(r.counts[i]).append(").");
+        }
+        out.append(System.lineSeparator());
+    }
+
+    private void drainLoop() {
+        try {
+            while (!stopping) {
+                if (drain() == 0) {
+                    Thread.sleep(1);
+                }
+            }
+        } catch (InterruptedException e) {
+            Thread.currentThread().interrupt();
+        }
+    }
+
+    // Ends the drain thread and prints the rest.
+    void stop() {
+        stopping = true;
+        try {
+            drainer.join();
+        } catch (InterruptedException e) {
+            Thread.currentThread().interrupt();
+        }
+        drain();
+    }
+}
+
 class UnisexJava {
     // turn: 0 = noone turn, 1 = men turn, 2 = women turn.
     private int turn = 0;
@@ -11,16 +171,16 @@ class UnisexJava {
     private int womanInBathroom = 0;
     private int manWaiting = 0;
     private int womanWaiting = 0;
+    private final AsyncLog log;
 
-    // java.time.LocalTime is for timestamp printing.
-    private String timestamp() {
-        return LocalTime.now().toString();
+    UnisexJava(AsyncLog log) {
+        this.log = log;
     }
 
     public synchronized void manEnter(int id) throws InterruptedException {
         // "waiting" for when blocking is necessary.
         if (womanInBathroom > 0 || (turn == 2 && womanWaiting > 0)) {
-            System.out.println("Timestamp " + timestamp() + " - Man " + id + " waiting");
+            log.man(id, AsyncLog.WAITING, 0);
             manWaiting++;
             try {
                 while (womanInBathroom > 0 || (turn == 2 && womanWaiting > 0)) {
@@ -30,18 +190,18 @@ class UnisexJava {
                 manWaiting--;
             }
         } else {
-            System.out.println("Timestamp " + timestamp() + " - Man " + id + " wants to enter");
+            log.man(id, AsyncLog.WANTS, 0);
         }
         // Now enter the bathroom.
         manInBathroom++;
         turn = 1; // Set to mens turn
-        System.out.println("Timestamp " + timestamp() + " - Man " + id + " enters (menInside = " + manInBathroom + ").");
+        log.man(id, AsyncLog.ENTERS, manInBathroom);
     }
 
     // called by a man thread to exit the bathroom.
     public synchronized void manExit(int id) {
         manInBathroom--;
-        System.out.println("Timestamp " + timestamp() + " - Man " + id + " leaves (menInside = " + manInBathroom + ").");
+        log.man(id, AsyncLog.LEAVES, manInBathroom);
         // Pass baton
         if (manInBathroom == 0 && womanWaiting > 0) {
             turn = 2;
@@ -51,7 +211,7 @@ class UnisexJava {
 
     public synchronized void womanEnter(int id) throws InterruptedException {
         if (manInBathroom > 0 || (turn == 1 && manWaiting > 0)) {
-            System.out.println("Timestamp " + timestamp() + " - Woman " + id + " waiting");
+            log.woman(id, AsyncLog.WAITING, 0);
             womanWaiting++;
             try {
                 while (manInBathroom > 0 || (turn == 1 && manWaiting > 0)) {
@@ -61,18 +221,18 @@ class UnisexJava {
                 womanWaiting--;
             }
         } else {
-            System.out.println("Timestamp " + timestamp() + " - Woman " + id + " wants to enter");
+            log.woman(id, AsyncLog.WANTS, 0);
         }
         // Now enter the bathroom
         womanInBathroom++;
         turn = 2; // Set to womens turn
-        System.out.println("Timestamp " + timestamp() + " - Woman " + id + " enters (womenInside = " + womanInBathroom + ").");
+        log.woman(id, AsyncLog.ENTERS, womanInBathroom);
     }
 
     // Called by woman thread to exit the bathroom
     public synchronized void womanExit(int id) {
         womanInBathroom--;
-        System.out.println("Timestamp " + timestamp() + " - Woman " + id + " leaves (womenInside = " + womanInBathroom + ").");
+        log.woman(id, AsyncLog.LEAVES, womanInBathroom);
         // Pass baton if man is waiting and bathroom is empty
         if (womanInBathroom == 0 && manWaiting > 0) {
             turn = 1;
@@ -81,16 +241,116 @@ class UnisexJava {
     }
 }
 
+// Wait times in ns, HDR style like ../common/latencyTrace.h: below 16 ns a
+// bucket each, above that 16 buckets per power of two, so a percentile is
+// within about 6%. Written by its own thread only.
+class LatencyHistogram {
+    static final int SUB_BITS = 4;
+    static final int SUB = 1 << SUB_BITS;
+    static final int BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+    long count, sum, max;
+    final long[] counts = new long[BUCKETS];
+
+    static int bucket(long v) {
+        if (v < SUB) {
+            return v < 0 ? 0 : (int) v;
+        }
+        int e = 63 - Long.numberOfLeadingZeros(v);
+        int sub = (int) ((v >> (e - SUB_BITS)) & (SUB - 1));
+        return ((e - SUB_BITS + 1) << SUB_BITS) + sub;
+    }
+
+    // The largest value that lands in bucket b.
+    static long bucketTop(int b) {
+        if (b < SUB) {
+            return b;
+        }
+        int e = (b >> SUB_BITS) + SUB_BITS - 1;
+        long low = (long) (SUB + (b & (SUB - 1))) << (e - SUB_BITS);
+        return low + (1L << (e - SUB_BITS)) - 1;
+    }
+
+    void record(long ns) {
+        count++;
+        sum += ns;
+        max = Math.max(max, ns);
+        counts[bucket(ns)]++;
+    }
+
+    void merge(LatencyHistogram other) {
+        count += other.count;
+        sum += other.sum;
+        max = Math.max(max, other.max);
+        for (int b = 0; b < BUCKETS; b++) {
+            counts[b] += other.counts[b];
+        }
+    }
+
+    // The p-th percentile in ns, at most the largest value recorded.
+    long percentile(double p) {
+        long rank = Math.max(1, (long) Math.ceil(p / 100 * count)), seen = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            seen += counts[b];
+            if (seen >= rank) {
+                return Math.min(bucketTop(b), max);
+            }
+        }
+        return 0;
+    }
+}
+
+// The first visits of one thread: arrival, admission and exit in ns.
+class VisitTrace {
+    static final int CAPACITY = 2000;
+
+    final long[] arrived = new long[CAPACITY];
+    final long[] entered = new long[CAPACITY];
+    final long[] left = new long[CAPACITY];
+    int count;
+    long dropped;
+
+    void add(long arrivedAt, long enteredAt, long leftAt) {
+        if (count == CAPACITY) {
+            dropped++;
+            return;
+        }
+        arrived[count] = arrivedAt;
+        entered[count] = enteredAt;
+        left[count] = leftAt;
+        count++;
+    }
+}
+
+// What a man or woman thread records of its visits.
+class Visits {
+    final LatencyHistogram waits = new LatencyHistogram();
+    final VisitTrace trace;
+
+    Visits(boolean traced) {
+        trace = traced ? new VisitTrace() : null;
+    }
+
+    void record(long arrived, long entered, long left) {
+        waits.record(entered - arrived);
+        if (trace != null) {
+            trace.add(arrived, entered, left);
+        }
+    }
+}
+
 // Man thread
 class Man implements Runnable {
     private UnisexJava bathroom;
     private int id;
     private int iterations;
+    final Visits visits;
 
-    public Man(UnisexJava bathroom, int id, int iterations) {
+    public Man(UnisexJava bathroom, int id, int iterations, boolean traced) {
         this.bathroom = bathroom;
         this.id = id;
         this.iterations = iterations;
+        this.visits = new Visits(traced);
     }
 
     public void run() {
@@ -98,10 +358,13 @@ class Man implements Runnable {
             for (int i = 0; i < iterations; i++) {
                 // Simulate work outside bathroom
                 Thread.sleep((int) (Math.random() * 20000));
+                long arrived = System.nanoTime();
                 bathroom.manEnter(id);
+                long entered = System.nanoTime();
                 // Simulate using the bathroom
                 Thread.sleep((int) (Math.random() * 5000));
                 bathroom.manExit(id);
+                visits.record(arrived, entered, System.nanoTime());
             }
         } catch (InterruptedException e) {
             Thread.currentThread().interrupt();
@@ -114,11 +377,13 @@ class Woman implements Runnable {
     private UnisexJava bathroom;
     private int id;
     private int iterations;
+    final Visits visits;
 
-    public Woman(UnisexJava bathroom, int id, int iterations) {
+    public Woman(UnisexJava bathroom, int id, int iterations, boolean traced) {
         this.bathroom = bathroom;
         this.id = id;
         this.iterations = iterations;
+        this.visits = new Visits(traced);
     }
 
     public void run() {
@@ -126,10 +391,13 @@ class Woman implements Runnable {
             for (int i = 0; i < iterations; i++) {
                 // Simulate working
                 Thread.sleep((int) (Math.random() * 20000));
+                long arrived = System.nanoTime();
                 bathroom.womanEnter(id);
+                long entered = System.nanoTime();
                 // Simulate using the bathroom
                 Thread.sleep((int) (Math.random() * 5000));
                 bathroom.womanExit(id);
+                visits.record(arrived, entered, System.nanoTime());
             }
         } catch (InterruptedException e) {
             Thread.currentThread().interrupt();
@@ -139,27 +407,93 @@ class Woman implements Runnable {
 
 // Main method
 public class UnisexJavaTest {
+    // Median, p99 and p99.9 wait of one class. The threads may still be
+    // running at Ctrl-C, so the counts are a few visits off at most.
+    static void printWaits(String name, Visits[] visits) {
+        LatencyHistogram all = new LatencyHistogram();
+        for (Visits v : visits) {
+            all.merge(v.waits);
+        }
+        System.out.println(name + " waited " + all.count + " times, median up to " + all.percentile(50)
+                + " ns, p99 up to " + all.percentile(99) + " ns, p99.9 up to " + all.percentile(99.9)
+                + " ns, at most " + all.max + " ns");
+    }
+
+    // The traced visits as Chrome trace events, one track per thread, a group per class.
+    static void writeTrace(String path, Visits[] men, Visits[] women) {
+        long origin = Long.MAX_VALUE;
+        for (Visits[] group : new Visits[][] { men, women }) {
+            for (Visits v : group) {
+                if (v.trace.count > 0) {
+                    origin = Math.min(origin, v.trace.arrived[0]);
+                }
+            }
+        }
+        try (PrintWriter out = new PrintWriter(new FileWriter(path))) {
+            out.print("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+            String[] names = { "men", "women" };
+            Visits[][] groups = { men, women };
+            String separator = "";
+            for (int pid = 1; pid <= 2; pid++) {
+                out.print(separator + "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " + pid
+                        + ", \"args\": {\"name\": \"" + names[pid - 1] + "\"}}");
+                separator = ",\n";
+                for (int tid = 0; tid < groups[pid - 1].length; tid++) {
+                    VisitTrace t = groups[pid - 1][tid].trace;
+                    for (int i = 0; i < t.count; i++) {
+                        out.printf(",\n{\"name\": \"wait\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                                pid, tid, (t.arrived[i] - origin) / 1e3, (t.entered[i] - t.arrived[i]) / 1e3);
+                        out.printf(",\n{\"name\": \"inside\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                                pid, tid, (t.entered[i] - origin) / 1e3, (t.left[i] - t.entered[i]) / 1e3);
+                    }
+                }
+            }
+            out.print("\n]}\n");
+        } catch (IOException e) {
+            System.err.println(path + ": " + e.getMessage());
+        }
+    }
+
     public static void main(String[] args) {
         final int numMen = 50;
         final int numWomen = 50;
         final int iterations = 1000000000; // Number of iteration for each thread
+        final String traceFile = args.length > 0 ? args[0] : null;
 
-        UnisexJava bathroom = new UnisexJava();
+        AsyncLog log = new AsyncLog(numMen, numWomen);
+        log.start();
+        UnisexJava bathroom = new UnisexJava(log);
 
         Thread[] menThreads = new Thread[numMen];
         Thread[] womenThreads = new Thread[numWomen];
+        Visits[] menVisits = new Visits[numMen];
+        Visits[] womenVisits = new Visits[numWomen];
 
         // Create and start man threads
         for (int i = 0; i < numMen; i++) {
-            menThreads[i] = new Thread(new Man(bathroom, i, iterations));
+            Man man = new Man(bathroom, i, iterations, traceFile != null);
+            menVisits[i] = man.visits;
+            menThreads[i] = new Thread(man);
             menThreads[i].start();
         }
         // Create and start woman threads
         for (int i = 0; i < numWomen; i++) {
-            womenThreads[i] = new Thread(new Woman(bathroom, i, iterations));
+            Woman woman = new Woman(bathroom, i, iterations, traceFile != null);
+            womenVisits[i] = woman.visits;
+            womenThreads[i] = new Thread(woman);
             womenThreads[i].start();
         }
 
+        // The wait times (and the trace) at exit, also when stopped with Ctrl-C.
+        Runtime.getRuntime().addShutdownHook(new Thread(() -> {
+            log.stop();
+            printWaits("Men", menVisits);
+            printWaits("Women", womenVisits);
+            if (traceFile != null) {
+                writeTrace(traceFile, menVisits, womenVisits);
+            }
+        }));
+
         // Join men threads
         for (int i = 0; i < numMen; i++) {
             try {
@@ -176,6 +510,7 @@ public class UnisexJavaTest {
             }
         }
 
+        log.stop();
         System.out.println("Simulation complete");
     }
 }
\ No newline at end of file
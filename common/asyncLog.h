@@ -0,0 +1,195 @@
+/* asynchronous logging through per-thread lock-free rings
+
+   features: a thread that logs an event only stamps it (a vDSO clock
+             read) and stores one fixed-size binary record, the format
+             string and up to LOG_ARGS int arguments, into its own
+             single-producer single-consumer ring, then publishes it with
+             one release store. No lock, no system call, no formatting,
+             so logging inside a critical section no longer holds every
+             other thread up behind the console. A background thread
+             drains all rings every LOG_DRAIN_USEC, orders the batch by
+             time, formats it and writes it with one fflush. A full ring
+             makes its producer yield until the drain thread catches up,
+             nothing is lost. The ring's indices sit on their own cache
+             lines, and the producer keeps its own copy of the consumer
+             index, so the two only share a line when the ring looks full.
+             Off costs nothing: compiled with -DASYNC_LOG_OFF asyncLog()
+             expands to nothing, and a NULL ring (logging not started)
+             is one predictable branch in the caller.
+
+   usage:
+     #include "../common/asyncLog.h"
+     AsyncLog log;
+     if (asyncLogStart(&log, stdout, numThreads, 4096) != 0) ...  // records per ring, a power of two
+     LogRing *ring = asyncLogRing(&log, t);                        // thread t only
+     asyncLog(ring, "Man %d enters (menInside=%d).\n", id, inside);  // 1 to LOG_ARGS ints
+     asyncLogStop(&log);  // writes what is left, ends the drain thread
+*/
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "latencyTrace.h"
+
+#define LOG_LINE 64          /* cache line */
+#define LOG_ARGS 4           /* int arguments per record, at most */
+#define LOG_DRAIN_USEC 1000  /* drain thread sleeps this long when all rings are empty */
+
+typedef struct {
+    long long ns;     // latNow() when logged
+    const char *fmt;  // a string literal, formatted by the drain thread
+    int args[LOG_ARGS];
+} LogRecord;
+
+typedef struct {
+    // read only
+    _Alignas(LOG_LINE) LogRecord *records;
+    unsigned mask;
+    // the producer
+    _Alignas(LOG_LINE) atomic_uint head;  // next record written
+    unsigned tailSeen;                    // tail when last looked at
+    long long stalls;                     // times it found the ring full
+    // the drain thread
+    _Alignas(LOG_LINE) atomic_uint tail;  // next record read
+} LogRing;
+
+typedef struct {
+    FILE *out;
+    int numRings;
+    LogRing *rings;
+    LogRecord *batch;  // room for every ring full
+    atomic_int stopping;
+    pthread_t drainer;
+} AsyncLog;
+
+// one record into ring, waits (yields) while the ring is full
+static inline void logEvent(LogRing *ring, const char *fmt, const int *args, int numArgs) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->tailSeen > ring->mask) {
+        ring->tailSeen = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        while (head - ring->tailSeen > ring->mask) {
+            ring->stalls++;
+            sched_yield();
+            ring->tailSeen = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        }
+    }
+    LogRecord *r = &ring->records[head & ring->mask];
+    r->ns = latNow();
+    r->fmt = fmt;
+    memcpy(r->args, args, sizeof(int) * numArgs);
+    // the drain thread passes all LOG_ARGS to fprintf, the unused ones too
+    memset(r->args + numArgs, 0, sizeof(int) * (LOG_ARGS - numArgs));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#ifdef ASYNC_LOG_OFF
+#define asyncLog(ring, fmt, ...) do { } while (0)
+#else
+#define asyncLog(ring, fmt, ...) \
+    logEvent((ring), (fmt), (const int[]){ __VA_ARGS__ }, sizeof((int[]){ __VA_ARGS__ }) / sizeof(int))
+#endif
+
+static inline int logRecordLess(const void *a, const void *b) {
+    long long x = ((const LogRecord *)a)->ns, y = ((const LogRecord *)b)->ns;
+    return (x > y) - (x < y);
+}
+
+/* Writes what all rings hold, in the order it was logged. Returns the
+   number of records. */
+static inline int asyncLogDrain(AsyncLog *log) {
+    int n = 0;
+    for (int t = 0; t < log->numRings; t++) {
+        LogRing *ring = &log->rings[t];
+        unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++)
+            log->batch[n++] = ring->records[tail & ring->mask];
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    // sorted by time: the threads' rings interleave as they happened (within a batch)
+    qsort(log->batch, n, sizeof(LogRecord), logRecordLess);
+    for (int i = 0; i < n; i++) {
+        const int *a = log->batch[i].args;
+        fprintf(log->out, log->batch[i].fmt, a[0], a[1], a[2], a[3]);
+    }
+    if (n > 0)
+        fflush(log->out);
+    return n;
+}
+
+static inline void *asyncLogDrainer(void *arg) {
+    AsyncLog *log = arg;
+    struct timespec pause = { 0, LOG_DRAIN_USEC * 1000L };
+    while (!atomic_load(&log->stopping))
+        if (asyncLogDrain(log) == 0)
+            nanosleep(&pause, NULL);
+    return NULL;
+}
+
+/* numRings rings of ringRecords records (a power of two) written to out
+   by a new drain thread. Returns 0, or -1 if out of memory or the thread
+   could not start. */
+static inline int asyncLogStart(AsyncLog *log, FILE *out, int numRings, unsigned ringRecords) {
+    log->out = out;
+    log->numRings = numRings;
+    log->rings = aligned_alloc(LOG_LINE, sizeof(LogRing) * numRings);
+    log->batch = malloc(sizeof(LogRecord) * ringRecords * numRings);
+    if (!log->rings || !log->batch) {
+        free(log->rings);
+        free(log->batch);
+        return -1;
+    }
+    for (int t = 0; t < numRings; t++) {
+        LogRing *ring = &log->rings[t];
+        ring->records = aligned_alloc(LOG_LINE, sizeof(LogRecord) * ringRecords);
+        ring->mask = ringRecords - 1;
+        atomic_init(&ring->head, 0);
+        ring->tailSeen = 0;
+        ring->stalls = 0;
+        atomic_init(&ring->tail, 0);
+        if (!ring->records) {
+            while (t-- > 0)
+                free(log->rings[t].records);
+            free(log->rings);
+            free(log->batch);
+            return -1;
+        }
+    }
+    atomic_init(&log->stopping, 0);
+    if (pthread_create(&log->drainer, NULL, asyncLogDrainer, log) != 0) {
+        for (int t = 0; t < numRings; t++)
+            free(log->rings[t].records);
+        free(log->rings);
+        free(log->batch);
+        return -1;
+    }
+    return 0;
+}
+
+static inline LogRing *asyncLogRing(AsyncLog *log, int t) {
+    return &log->rings[t];
+}
+
+/* Ends the drain thread and writes the rest; the producers must be done.
+   Returns how often a producer found its ring full. */
+static inline long long asyncLogStop(AsyncLog *log) {
+    long long stalls = 0;
+    atomic_store(&log->stopping, 1);
+    pthread_join(log->drainer, NULL);
+    asyncLogDrain(log);
+    for (int t = 0; t < log->numRings; t++) {
+        stalls += log->rings[t].stalls;
+        free(log->rings[t].records);
+    }
+    free(log->rings);
+    free(log->batch);
+    return stalls;
+}
+
+#endif /* ASYNC_LOG_H */
@@ -0,0 +1,246 @@
+/* benchmark harness shared by the matrix and sort programs
+
+   features: runs the timed part -w times untimed (warmup) and then -r
+             times timed, on CLOCK_MONOTONIC, and reports min, median,
+             p90, p99, mean and standard deviation of the timed runs.
+             -o picks the output: text (the program's usual lines plus
+             one summary line when there was more than one run), csv
+             (one header line, then one row per case) or json (one
+             object per line, so the output of several runs and
+             machines can simply be concatenated and compared).
+             -e asks for hardware counters (see perfCounters.h), which
+             add their per run averages to the report as metrics.
+
+   usage:
+     #include "../common/benchHarness.h"
+     BenchConfig cfg;
+     benchDefaults(&cfg, 0, 1);
+     while ((opt = getopt(argc, argv, "o:r:w:...")) != -1)
+         if (benchOption(&cfg, opt, optarg) == 0) ... the program's own options
+     BenchRun run;
+     benchBegin(&run, &cfg);
+     while (benchNext(&run)) {
+         ... untimed setup
+         benchStart(&run);
+         ... the work
+         benchStop(&run);
+     }
+     benchReport(&run, "quicksort", "random/3way", n, numWorkers);
+     ... run.median, run.min etc. are now set
+*/
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef enum { BENCH_TEXT, BENCH_CSV, BENCH_JSON, BENCH_FORMATS } BenchFormat;
+
+static const char *const benchFormatNames[BENCH_FORMATS] = { "text", "csv", "json" };
+
+#define BENCH_MAX_METRICS 12  /* extra values a report can carry */
+
+typedef struct {
+    int warmup;          // untimed runs first
+    int trials;          // timed runs
+    BenchFormat format;
+    int counters;        // -e: hardware counters wanted
+    int numMetrics;      // extra report columns, registered before benchHeader
+    const char *metricNames[BENCH_MAX_METRICS];
+} BenchConfig;
+
+typedef struct {
+    BenchConfig cfg;
+    int iteration;       // warmups count from 0, then the trials
+    double started;
+    double *times;       // seconds of every trial
+    double min, median, p90, p99, mean, stddev;
+    double metrics[BENCH_MAX_METRICS];  // set before benchReport, < 0 if not available
+} BenchRun;
+
+// seconds on the monotonic clock
+static inline double benchNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+static inline void benchDefaults(BenchConfig *cfg, int warmup, int trials) {
+    cfg->warmup = warmup;
+    cfg->trials = trials;
+    cfg->format = BENCH_TEXT;
+    cfg->counters = 0;
+    cfg->numMetrics = 0;
+}
+
+/* Handle the harness options -e, -o, -r and -w inside a getopt loop.
+   Returns 1 if opt was one of them, -1 if its value was bad and 0 if
+   opt belongs to the program. */
+static inline int benchOption(BenchConfig *cfg, int opt, const char *arg) {
+    switch (opt) {
+    case 'e':
+        cfg->counters = 1;
+        return 1;
+    case 'o':
+        for (int f = 0; f < BENCH_FORMATS; f++) {
+            if (strcmp(arg, benchFormatNames[f]) == 0) {
+                cfg->format = f;
+                return 1;
+            }
+        }
+        return -1;
+    case 'r':
+        cfg->trials = atoi(arg);
+        return cfg->trials > 0 ? 1 : -1;
+    case 'w':
+        cfg->warmup = atoi(arg);
+        return cfg->warmup >= 0 ? 1 : -1;
+    default:
+        return 0;
+    }
+}
+
+// the usage text of the harness options
+#define BENCH_USAGE "[-e] [-o text|csv|json] [-r trials] [-w warmup]"
+
+// print the CSV header, once before the first benchReport
+static inline void benchHeader(const BenchConfig *cfg) {
+    if (cfg->format != BENCH_CSV)
+        return;
+    printf("program,case,n,workers,trials,min,median,p90,p99,mean,stddev");
+    for (int m = 0; m < cfg->numMetrics; m++)
+        printf(",%s", cfg->metricNames[m]);
+    printf("\n");
+}
+
+static inline void benchBegin(BenchRun *run, const BenchConfig *cfg) {
+    run->cfg = *cfg;
+    run->iteration = -1;
+    run->times = malloc(sizeof(double) * cfg->trials);
+    run->min = run->median = run->p90 = run->p99 = run->mean = run->stddev = 0;
+    for (int m = 0; m < BENCH_MAX_METRICS; m++)
+        run->metrics[m] = -1;
+}
+
+// whether the current iteration is timed, not a warmup
+static inline int benchIsTrial(const BenchRun *run) {
+    return run->iteration >= run->cfg.warmup;
+}
+
+static inline void benchStart(BenchRun *run) {
+    run->started = benchNow();
+}
+
+// may be called from another thread than benchStart, if the two are ordered
+static inline void benchStop(BenchRun *run) {
+    double elapsed = benchNow() - run->started;
+    if (benchIsTrial(run))
+        run->times[run->iteration - run->cfg.warmup] = elapsed;
+}
+
+static inline int benchCompareTimes(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank percentile of the sorted times
+static inline double benchPercentile(const double *sorted, int n, int p) {
+    int rank = (int)(((long long)p * n + 99) / 100);
+    return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+// square root by Newton's method, so the programs need no -lm
+static inline double benchSqrt(double x) {
+    if (x <= 0)
+        return 0;
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 100; i++) {
+        double next = 0.5 * (r + x / r);
+        if (next >= r)
+            break;
+        r = next;
+    }
+    return r;
+}
+
+static inline void benchSummarize(BenchRun *run) {
+    int n = run->cfg.trials;
+    double *t = run->times;
+    qsort(t, n, sizeof(double), benchCompareTimes);
+    double sum = 0, squares = 0;
+    for (int i = 0; i < n; i++)
+        sum += t[i];
+    run->mean = sum / n;
+    for (int i = 0; i < n; i++)
+        squares += (t[i] - run->mean) * (t[i] - run->mean);
+    run->stddev = n > 1 ? benchSqrt(squares / (n - 1)) : 0;
+    run->min = t[0];
+    run->median = (n % 2) ? t[n / 2] : (t[n / 2 - 1] + t[n / 2]) / 2;
+    run->p90 = benchPercentile(t, n, 90);
+    run->p99 = benchPercentile(t, n, 99);
+}
+
+/* Move on to the next run, 0 once the warmups and trials are done.
+   The statistics are computed then. */
+static inline int benchNext(BenchRun *run) {
+    run->iteration++;
+    if (run->iteration < run->cfg.warmup + run->cfg.trials)
+        return 1;
+    benchSummarize(run);
+    return 0;
+}
+
+/* Print the statistics of a finished run in the configured format and
+   release it. In text mode nothing is printed for a single trial, the
+   program's own output already says it all, except for the metrics. */
+static inline void benchReport(BenchRun *run, const char *program, const char *benchCase,
+                               long long n, int workers) {
+    const BenchConfig *cfg = &run->cfg;
+    switch (cfg->format) {
+    case BENCH_TEXT:
+        if (cfg->trials > 1)
+            printf("%s: min %g median %g p90 %g p99 %g stddev %g sec over %d runs\n",
+                   benchCase, run->min, run->median, run->p90, run->p99, run->stddev, cfg->trials);
+        if (cfg->numMetrics > 0) {
+            printf("%s:", benchCase);
+            for (int m = 0; m < cfg->numMetrics; m++) {
+                if (run->metrics[m] >= 0)
+                    printf(" %s %.4g", cfg->metricNames[m], run->metrics[m]);
+                else
+                    printf(" %s n/a", cfg->metricNames[m]);
+            }
+            printf("\n");
+        }
+        break;
+    case BENCH_CSV:
+        printf("%s,%s,%lld,%d,%d,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g", program, benchCase, n, workers,
+               cfg->trials, run->min, run->median, run->p90, run->p99, run->mean, run->stddev);
+        for (int m = 0; m < cfg->numMetrics; m++) {
+            if (run->metrics[m] >= 0)
+                printf(",%.9g", run->metrics[m]);
+            else
+                printf(",");
+        }
+        printf("\n");
+        break;
+    default:
+        printf("{\"program\": \"%s\", \"case\": \"%s\", \"n\": %lld, \"workers\": %d, \"trials\": %d, "
+               "\"min\": %.9g, \"median\": %.9g, \"p90\": %.9g, \"p99\": %.9g, \"mean\": %.9g, \"stddev\": %.9g",
+               program, benchCase, n, workers, cfg->trials,
+               run->min, run->median, run->p90, run->p99, run->mean, run->stddev);
+        for (int m = 0; m < cfg->numMetrics; m++) {
+            if (run->metrics[m] >= 0)
+                printf(", \"%s\": %.9g", cfg->metricNames[m], run->metrics[m]);
+            else
+                printf(", \"%s\": null", cfg->metricNames[m]);
+        }
+        printf("}\n");
+        break;
+    }
+    free(run->times);
+    run->times = NULL;
+}
+
+#endif /* BENCH_HARNESS_H */
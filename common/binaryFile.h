@@ -0,0 +1,238 @@
+/* matrices and arrays in binary files, mapped instead of parsed
+
+   features: a file is a 64-byte header followed by the raw elements,
+             row by row:
+               magic     8 bytes "MATBIN01"
+               byteOrder uint32 0x01020304 in the writer's byte order
+               type      uint32 MatrixType (int8 .. double)
+               rows      uint64
+               cols      uint64 (1 for an array)
+               reserved  zeros up to 64 bytes
+             loadMatrix maps the whole file and points the matrix at the
+             elements, so nothing is copied or parsed; the data is cache
+             line aligned because the header is. MAP_POPULATE reads the
+             file in while mapping, so the timed runs take no page
+             faults, otherwise the kernel is told to read ahead
+             (MADV_WILLNEED). The mapping is private: the program may
+             write the matrix (sort it in place, swap the byte order of
+             a file from the other endianness) without changing the file.
+             saveMatrix writes a matrix in the same format, in the
+             native byte order; an int array is a matrix of n x 1.
+
+   usage:
+     #include "../common/binaryFile.h"
+     Matrix m;
+     if (loadMatrix(&m, "in.bin", BIN_POPULATE) != 0) ...  // message printed
+     ... m.rows, m.cols, m.type from the file
+     freeMatrix(&m);
+     if (loadIntArray(&m, "keys.bin", BIN_POPULATE, &n) != 0) ...  // int32, n = rows*cols
+     int *keys = m.data;
+     Matrix out = arrayMatrix(sorted, n);
+     if (saveMatrix(&out, "out.bin") != 0) ...
+*/
+#ifndef BINARY_FILE_H
+#define BINARY_FILE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "matrixStorage.h"
+
+#define BIN_MAGIC "MATBIN01"
+#define BIN_BYTE_ORDER 0x01020304u
+#define BIN_HEADER_BYTES 64
+#define BIN_POPULATE 1  /* loadMatrix: read the whole file in while mapping */
+
+typedef struct {
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t type;
+    uint64_t rows;
+    uint64_t cols;
+    uint8_t reserved[BIN_HEADER_BYTES - 32];
+} BinHeader;
+
+static inline uint32_t binSwap32(uint32_t x) {
+    return __builtin_bswap32(x);
+}
+
+static inline uint64_t binSwap64(uint64_t x) {
+    return __builtin_bswap64(x);
+}
+
+// reverse the bytes of each of the n elements of size bytes at data
+static inline void binSwapElements(void *data, size_t n, size_t size) {
+    switch (size) {
+    case 2: {
+        uint16_t *p = data;
+        for (size_t i = 0; i < n; i++)
+            p[i] = __builtin_bswap16(p[i]);
+        break;
+    }
+    case 4: {
+        uint32_t *p = data;
+        for (size_t i = 0; i < n; i++)
+            p[i] = binSwap32(p[i]);
+        break;
+    }
+    case 8: {
+        uint64_t *p = data;
+        for (size_t i = 0; i < n; i++)
+            p[i] = binSwap64(p[i]);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static inline int binError(const char *path, const char *what) {
+    fprintf(stderr, "%s: %s\n", path, what);
+    return -1;
+}
+
+/* Read and check the header of the open file fd (named path), in the
+   native byte order; *swapped tells if the elements are in the other
+   one. Returns 0, or -1 after printing why the file cannot be used. */
+static inline int binReadHeader(int fd, const char *path, BinHeader *h, int *swapped) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || pread(fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h))
+        return binError(path, "not a matrix file (too short)");
+    *swapped = h->byteOrder != BIN_BYTE_ORDER;
+    if (*swapped) {
+        h->byteOrder = binSwap32(h->byteOrder);
+        h->type = binSwap32(h->type);
+        h->rows = binSwap64(h->rows);
+        h->cols = binSwap64(h->cols);
+    }
+    if (memcmp(h->magic, BIN_MAGIC, 8) != 0 || h->byteOrder != BIN_BYTE_ORDER)
+        return binError(path, "not a matrix file (bad magic)");
+    if (h->type >= MT_COUNT || h->rows == 0 || h->cols == 0 || h->rows > 0x7fffffff || h->cols > 0x7fffffff ||
+        h->rows * h->cols > ((uint64_t)1 << 56))
+        return binError(path, "unsupported element type or size");
+    if ((uint64_t)st.st_size < BIN_HEADER_BYTES + h->rows * h->cols * matrixTypeSizes[h->type])
+        return binError(path, "file shorter than its header says");
+    return 0;
+}
+
+/* Map the file at path as matrix m; flags is 0 or BIN_POPULATE.
+   Returns 0, or -1 after printing why the file cannot be used. */
+static inline int loadMatrix(Matrix *m, const char *path, int flags) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return binError(path, strerror(errno));
+    BinHeader h;
+    int swapped;
+    if (binReadHeader(fd, path, &h, &swapped) != 0) {
+        close(fd);
+        return -1;
+    }
+    size_t dataBytes = (size_t)h.rows * h.cols * matrixTypeSizes[h.type];
+    size_t bytes = BIN_HEADER_BYTES + dataBytes;
+    int mapFlags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (flags & BIN_POPULATE)
+        mapFlags |= MAP_POPULATE;
+#endif
+    void *base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, mapFlags, fd, 0);
+    close(fd);  // the mapping keeps the file
+    if (base == MAP_FAILED)
+        return binError(path, strerror(errno));
+    if (!(flags & BIN_POPULATE))
+        madvise(base, bytes, MADV_WILLNEED);  // only a hint
+
+    m->rows = (int)h.rows;
+    m->cols = (int)h.cols;
+    m->stride = m->cols;
+    m->type = (MatrixType)h.type;
+    m->elemSize = matrixTypeSizes[h.type];
+    m->data = (char *)base + BIN_HEADER_BYTES;
+    m->bytes = bytes;
+    m->mapped = 1;
+    m->mapOffset = BIN_HEADER_BYTES;
+    if (swapped)
+        binSwapElements(m->data, (size_t)h.rows * h.cols, m->elemSize);
+    return 0;
+}
+
+/* loadMatrix for the keys of the sort programs: an int32 file, taken as
+   one array of rows*cols keys, stored in *n. */
+static inline int loadIntArray(Matrix *m, const char *path, int flags, long long *n) {
+    if (loadMatrix(m, path, flags) != 0)
+        return -1;
+    if (m->type != MT_INT32) {
+        freeMatrix(m);
+        return binError(path, "not an int32 file");
+    }
+    *n = (long long)m->rows * m->cols;
+    return 0;
+}
+
+// an n x 1 int32 matrix over arr, to save an array (not to be freed)
+static inline Matrix arrayMatrix(int *arr, long long n) {
+    Matrix m = { (int)n, 1, 1, MT_INT32, sizeof(int), arr, (size_t)n * sizeof(int), 0, 0 };
+    return m;
+}
+
+// read exactly bytes at offset, 0 on success
+static inline int binReadAt(int fd, void *data, size_t bytes, off_t offset) {
+    char *p = data;
+    while (bytes > 0) {
+        ssize_t got = pread(fd, p, bytes, offset);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        p += got;
+        bytes -= (size_t)got;
+        offset += got;
+    }
+    return 0;
+}
+
+static inline int binWriteAll(int fd, const void *data, size_t bytes) {
+    const char *p = data;
+    while (bytes > 0) {
+        ssize_t written = write(fd, p, bytes);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        p += written;
+        bytes -= (size_t)written;
+    }
+    return 0;
+}
+
+/* Write m to path in the native byte order.
+   Returns 0, or -1 after printing what went wrong. */
+static inline int saveMatrix(const Matrix *m, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return binError(path, strerror(errno));
+    BinHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BIN_MAGIC, 8);
+    h.byteOrder = BIN_BYTE_ORDER;
+    h.type = m->type;
+    h.rows = m->rows;
+    h.cols = m->cols;
+    size_t rowBytes = (size_t)m->cols * m->elemSize;
+    int failed = binWriteAll(fd, &h, sizeof(h));
+    if (!failed && m->stride == m->cols) {
+        failed = binWriteAll(fd, m->data, rowBytes * m->rows);
+    } else {
+        for (int i = 0; i < m->rows && !failed; i++)
+            failed = binWriteAll(fd, matrixRow(m, i), rowBytes);
+    }
+    if (close(fd) != 0)
+        failed = -1;
+    return failed ? binError(path, strerror(errno)) : 0;
+}
+
+#endif /* BINARY_FILE_H */
@@ -0,0 +1,336 @@
+/* external merge sort for key files larger than memory
+
+   features: sorts an int32 file of the binaryFile.h format into another
+             one within a memory budget (-x), in two phases:
+               runs  - the input is read in chunks of budget/8 keys
+                       (the keys and the scratch buffer of radix and
+                       sample sort fill the budget), every chunk is
+                       sorted in memory by the program's own parallel
+                       sort and written to a temporary file as a run
+               merge - k-way merges with a loser tree: every merge
+                       step costs log2(k) comparisons against the
+                       losers on the path to the root, instead of the
+                       2 log2(k) of a binary heap. Half the budget is
+                       split into one read buffer per run, the other
+                       half buffers the output, so all I/O is large and
+                       sequential. When there are more runs than
+                       buffers of EXT_MIN_BUFFER_KEYS fit, runs are
+                       merged into longer ones first (more passes).
+             An input that fits in one run is sorted and written
+             straight away. The temporary files are unlinked as soon
+             as they are created, in $TMPDIR (or /tmp). ExtSortInfo
+             counts the bytes read and written and the time of each
+             phase, and the budget actually used: one below
+             EXT_MIN_BUDGET (2MB, four-way merges) is raised to it.
+             The output has the input's header (rows, cols) and the
+             native byte order.
+
+   usage:
+     #include "../common/externalSort.h"
+     void sortRun(void *ctx, int *keys, int *scratch, int n) { ... sort keys[0..n-1] }
+     ExtSortInfo info;
+     extSortMetrics(&benchCfg);  // before benchHeader
+     if (externalSort("in.bin", "out.bin", budgetBytes, sortRun, ctx, &info) != 0) ...  // message printed
+     extSortFinish(&info, &run);  // then benchReport
+*/
+#ifndef EXTERNAL_SORT_H
+#define EXTERNAL_SORT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "benchHarness.h"
+#include "binaryFile.h"
+
+#define EXT_MIN_BUFFER_KEYS (64 * 1024)  /* smallest read buffer of a run, 256KB */
+#define EXT_MIN_BUDGET ((size_t)4 * EXT_MIN_BUFFER_KEYS * sizeof(int) * 2)  /* four-way merges at least */
+
+// sorts keys[0..n-1], scratch has room for n keys too
+typedef void (*RunSortFn)(void *ctx, int *keys, int *scratch, int n);
+
+typedef struct {
+    long long n;            // keys sorted
+    size_t budget;          // bytes of memory it was allowed, at least EXT_MIN_BUDGET
+    long long runs;         // runs the first phase wrote
+    int passes;             // merge passes, 0 if the input fit in one run
+    int fanIn;              // most runs merged at once
+    long long runRead, runWritten;      // bytes of the run phase
+    long long mergeRead, mergeWritten;  // bytes of all merge passes
+    double runSeconds, mergeSeconds;
+} ExtSortInfo;
+
+// the metrics extSortFinish adds to a BenchRun, in this order
+typedef enum {
+    EXT_M_RUN_SECONDS, EXT_M_MERGE_SECONDS, EXT_M_RUN_READ, EXT_M_RUN_WRITTEN, EXT_M_MERGE_READ,
+    EXT_M_MERGE_WRITTEN, EXT_M_RUNS, EXT_M_PASSES, EXT_METRICS
+} ExtMetric;
+
+static const char *const extMetricNames[EXT_METRICS] = {
+    "run_s", "merge_s", "run_read_bytes", "run_written_bytes", "merge_read_bytes", "merge_written_bytes",
+    "runs", "passes"
+};
+
+// report the phases of the sort as metrics, before benchHeader
+static inline void extSortMetrics(BenchConfig *cfg) {
+    cfg->numMetrics = 0;
+    for (int m = 0; m < EXT_METRICS && m < BENCH_MAX_METRICS; m++)
+        cfg->metricNames[cfg->numMetrics++] = extMetricNames[m];
+}
+
+// the metrics of the last sort, for a later benchReport
+static inline void extSortFinish(const ExtSortInfo *info, BenchRun *run) {
+    double values[EXT_METRICS] = {
+        info->runSeconds, info->mergeSeconds, (double)info->runRead, (double)info->runWritten,
+        (double)info->mergeRead, (double)info->mergeWritten, (double)info->runs, (double)info->passes
+    };
+    for (int m = 0; m < EXT_METRICS && m < BENCH_MAX_METRICS; m++)
+        run->metrics[m] = values[m];
+}
+
+// one input of a merge: a run in a file, read through its buffer
+typedef struct {
+    off_t next;             // file offset of the first key not yet buffered
+    long long left;         // keys not yet buffered
+    int *buf;
+    int pos, count;         // buf[pos..count-1] are still to be merged
+} ExtRun;
+
+// a new temporary file, already unlinked; -1 on failure
+static inline int extTempFile(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/extsortXXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+    return fd;
+}
+
+// refill the buffer of an exhausted run, 0 on success
+static inline int extRefill(int fd, ExtRun *run, long long bufKeys, long long *bytesRead) {
+    run->pos = 0;
+    run->count = (int)(run->left < bufKeys ? run->left : bufKeys);
+    if (run->count == 0)
+        return 0;
+    if (binReadAt(fd, run->buf, (size_t)run->count * sizeof(int), run->next) != 0)
+        return -1;
+    run->next += (off_t)run->count * sizeof(int);
+    run->left -= run->count;
+    *bytesRead += (long long)run->count * sizeof(int);
+    return 0;
+}
+
+// whether run a comes out before run b: smaller key, ties to the lower run, finished runs last
+static inline int extBefore(const ExtRun *runs, int a, int b) {
+    int aDone = runs[a].pos == runs[a].count, bDone = runs[b].pos == runs[b].count;
+    if (aDone || bDone)
+        return !aDone || (bDone && a < b);
+    int ka = runs[a].buf[runs[a].pos], kb = runs[b].buf[runs[b].pos];
+    return ka < kb || (ka == kb && a < b);
+}
+
+/* Merge the k runs starting at the file offsets start[] of srcFd, len[]
+   keys each, and write the result at the current position of dstFd.
+   inBuf has room for k buffers of bufKeys, outBuf for outKeys, runs
+   for k runs and tree for 3k ints. Returns 0, or -1 if reading or writing failed. */
+static inline int extMerge(int srcFd, const off_t *start, const long long *len, int k, int *inBuf,
+                           long long bufKeys, int dstFd, int *outBuf, long long outKeys, ExtRun *runs,
+                           int *tree, long long *bytesRead, long long *bytesWritten) {
+    for (int r = 0; r < k; r++) {
+        runs[r] = (ExtRun){ start[r], len[r], inBuf + r * bufKeys, 0, 0 };
+        if (extRefill(srcFd, &runs[r], bufKeys, bytesRead) != 0)
+            return -1;
+    }
+
+    // loser tree: leaves k..2k-1 are the runs, tree[1..k-1] hold the loser
+    // of each match, tree[0] the overall winner; built bottom up, with the
+    // winner of every node in wins
+    int *wins = tree + k;  // wins[k + r] is leaf r, wins[1..k-1] the inner nodes
+    for (int r = 0; r < k; r++)
+        wins[k + r] = r;
+    for (int node = k - 1; node >= 1; node--) {
+        int a = wins[2 * node], b = wins[2 * node + 1];
+        int first = extBefore(runs, a, b) ? a : b;
+        tree[node] = first == a ? b : a;
+        wins[node] = first;
+    }
+    tree[0] = k == 1 ? 0 : wins[1];
+
+    int outCount = 0;
+    for (;;) {
+        int w = tree[0];
+        ExtRun *run = &runs[w];
+        if (run->pos == run->count)
+            break;  // the winner is finished, so all are
+        outBuf[outCount++] = run->buf[run->pos++];
+        if (outCount == outKeys) {
+            if (binWriteAll(dstFd, outBuf, (size_t)outCount * sizeof(int)) != 0)
+                return -1;
+            *bytesWritten += (long long)outCount * sizeof(int);
+            outCount = 0;
+        }
+        if (run->pos == run->count && run->left > 0 && extRefill(srcFd, run, bufKeys, bytesRead) != 0)
+            return -1;
+        // replay the matches from leaf w up to the root
+        for (int node = (k + w) / 2; node >= 1; node /= 2) {
+            if (extBefore(runs, tree[node], w)) {
+                int loser = w;
+                w = tree[node];
+                tree[node] = loser;
+            }
+        }
+        tree[0] = w;
+    }
+    if (outCount > 0) {
+        if (binWriteAll(dstFd, outBuf, (size_t)outCount * sizeof(int)) != 0)
+            return -1;
+        *bytesWritten += (long long)outCount * sizeof(int);
+    }
+    return 0;
+}
+
+static inline int extFail(const char *path, const char *what, int *fds, int numFds, void **buffers,
+                          int numBuffers) {
+    for (int f = 0; f < numFds; f++)
+        if (fds[f] >= 0)
+            close(fds[f]);
+    for (int b = 0; b < numBuffers; b++)
+        free(buffers[b]);
+    return what ? binError(path, what) : -1;
+}
+
+/* Sort the int32 keys of the file inPath into outPath using about budget
+   bytes of memory; sortRun sorts every run in memory. Returns 0, or -1
+   after printing what went wrong. */
+static inline int externalSort(const char *inPath, const char *outPath, size_t budget, RunSortFn sortRun,
+                               void *ctx, ExtSortInfo *info) {
+    memset(info, 0, sizeof(*info));
+    if (budget < EXT_MIN_BUDGET)
+        budget = EXT_MIN_BUDGET;
+    info->budget = budget;
+    int fds[4] = { -1, -1, -1, -1 };  // input, output, two pass files
+    void *buffers[6] = { NULL };
+    BinHeader h;
+    int swapped;
+
+    fds[0] = open(inPath, O_RDONLY);
+    if (fds[0] < 0)
+        return binError(inPath, strerror(errno));
+    if (binReadHeader(fds[0], inPath, &h, &swapped) != 0)
+        return extFail(inPath, NULL, fds, 4, buffers, 6);
+    if (h.type != MT_INT32)
+        return extFail(inPath, "not an int32 file", fds, 4, buffers, 6);
+    posix_fadvise(fds[0], 0, 0, POSIX_FADV_SEQUENTIAL);
+    long long n = (long long)(h.rows * h.cols);
+    info->n = n;
+
+    // the output gets the input's header, read into our byte order
+    fds[1] = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fds[1] < 0)
+        return extFail(outPath, strerror(errno), fds, 4, buffers, 6);
+    if (binWriteAll(fds[1], &h, sizeof(h)) != 0)
+        return extFail(outPath, strerror(errno), fds, 4, buffers, 6);
+
+    // run phase: chunks of the keys plus scratch the budget holds
+    long long runKeys = (long long)(budget / (2 * sizeof(int)));
+    if (runKeys > n)
+        runKeys = n;
+    if (runKeys > 0x7fffffff)
+        runKeys = 0x7fffffff;
+    long long numRuns = (n + runKeys - 1) / runKeys;
+    int *keys = buffers[0] = malloc(sizeof(int) * runKeys);
+    int *scratch = buffers[1] = malloc(sizeof(int) * runKeys);
+    off_t *start = buffers[2] = malloc(sizeof(off_t) * numRuns);
+    long long *len = buffers[3] = malloc(sizeof(long long) * numRuns);
+    if (!keys || !scratch || !start || !len)
+        return extFail(inPath, "cannot allocate the run buffers", fds, 4, buffers, 6);
+    int runFd = numRuns == 1 ? fds[1] : (fds[2] = extTempFile());
+    if (runFd < 0)
+        return extFail(inPath, "cannot create a temporary file", fds, 4, buffers, 6);
+
+    double started = benchNow();
+    for (long long r = 0; r < numRuns; r++) {
+        long long first = r * runKeys;
+        int count = (int)(n - first < runKeys ? n - first : runKeys);
+        size_t bytes = (size_t)count * sizeof(int);
+        if (binReadAt(fds[0], keys, bytes, BIN_HEADER_BYTES + (off_t)first * sizeof(int)) != 0)
+            return extFail(inPath, "read failed", fds, 4, buffers, 6);
+        if (swapped)
+            binSwapElements(keys, count, sizeof(int));
+        sortRun(ctx, keys, scratch, count);
+        if (binWriteAll(runFd, keys, bytes) != 0)
+            return extFail(outPath, "write failed", fds, 4, buffers, 6);
+        start[r] = (off_t)first * sizeof(int);
+        len[r] = count;
+        info->runRead += bytes;
+        info->runWritten += bytes;
+    }
+    info->runs = numRuns;
+    info->runSeconds = benchNow() - started;
+    free(keys);
+    free(scratch);
+    buffers[0] = buffers[1] = NULL;
+
+    // merge phase: passes of up to fanIn runs until the last one writes the output
+    long long halfKeys = (long long)(budget / (2 * sizeof(int)));
+    int fanIn = (int)(halfKeys / EXT_MIN_BUFFER_KEYS);
+    fanIn = fanIn < 2 ? 2 : fanIn;
+    info->fanIn = numRuns < fanIn ? (int)numRuns : fanIn;
+    started = benchNow();
+    int srcFd = fds[2];
+    while (numRuns > 1) {
+        int last = numRuns <= fanIn;
+        int dstFd = last ? fds[1] : (fds[3] = extTempFile());
+        if (dstFd < 0)
+            return extFail(inPath, "cannot create a temporary file", fds, 4, buffers, 6);
+        int k = (int)(numRuns < fanIn ? numRuns : fanIn);
+        long long bufKeys = halfKeys / k;
+        int *inBuf = buffers[0] = malloc(sizeof(int) * bufKeys * k);
+        int *outBuf = buffers[1] = malloc(sizeof(int) * halfKeys);
+        ExtRun *runs = buffers[4] = malloc(sizeof(ExtRun) * k);
+        int *tree = buffers[5] = malloc(sizeof(int) * 3 * k);
+        if (!inBuf || !outBuf || !runs || !tree)
+            return extFail(inPath, "cannot allocate the merge buffers", fds, 4, buffers, 6);
+
+        long long merged = 0;  // runs of the next pass
+        off_t offset = 0;
+        for (long long r = 0; r < numRuns; r += k) {
+            int group = (int)(numRuns - r < k ? numRuns - r : k);
+            long long groupKeys = 0;
+            for (int g = 0; g < group; g++)
+                groupKeys += len[r + g];
+            if (extMerge(srcFd, start + r, len + r, group, inBuf, bufKeys, dstFd, outBuf, halfKeys, runs,
+                         tree, &info->mergeRead, &info->mergeWritten) != 0)
+                return extFail(outPath, "merge failed", fds, 4, buffers, 6);
+            start[merged] = offset;
+            len[merged] = groupKeys;
+            offset += (off_t)groupKeys * sizeof(int);
+            merged++;
+        }
+        for (int b = 0; b < 6; b++) {
+            if (b != 2 && b != 3) {
+                free(buffers[b]);
+                buffers[b] = NULL;
+            }
+        }
+        info->passes++;
+        numRuns = merged;
+        close(srcFd);
+        fds[2] = srcFd = last ? -1 : dstFd;
+        fds[3] = -1;
+    }
+    info->mergeSeconds = benchNow() - started;
+
+    if (close(fds[1]) != 0) {
+        fds[1] = -1;
+        return extFail(outPath, strerror(errno), fds, 4, buffers, 6);
+    }
+    fds[1] = -1;
+    extFail(NULL, NULL, fds, 4, buffers, 6);  // frees the rest
+    return 0;
+}
+
+#endif /* EXTERNAL_SORT_H */
@@ -0,0 +1,368 @@
+/* group mutual exclusion for two classes of threads on a futex
+
+   features: any number of threads of one class can hold the lock at
+             the same time, never threads of both classes (the unisex
+             bathroom, or readers and writers with two kinds of
+             readers). All of the state is one 64-bit word changed by
+             CAS: how many are inside, how many of each class wait,
+             whose turn it is and how many more of that class may still
+             come in while the other class waits (the grant).
+             Who gets in while the other class waits is the policy:
+               turn      - HW3.c's old rule: the class whose turn it is
+                           keeps coming in as long as any of it is
+                           inside; no bound, the other class can starve
+               alternate - the turn goes over as soon as the other class
+                           waits; the class gets in as many as were
+                           waiting when it got the turn
+               batch     - at most quantum of the class per turn
+               slice     - the class keeps coming in for quantum
+                           microseconds after it got the turn
+               fifo      - in order of arrival (a ticket each), threads
+                           of one class in a row go in together
+             In every policy the last one out hands the turn to the
+             other class if it waits. Under turn that is the only
+             handover and the room may never empty; every other policy
+             also stops its class at the end of the grant, slice or run
+             of tickets, so nobody is bypassed more than about one
+             turn's worth of the other class.
+             A thread that cannot enter spins GROUP_SPIN rounds first,
+             then counts itself as waiting and sleeps with FUTEX_WAIT on
+             the gate word of its class. Handing over the turn bumps
+             the gate of the other class and wakes all of it with one
+             FUTEX_WAKE, so the whole waiting class comes in together
+             instead of one post at a time. Entering and leaving
+             without contention is a single CAS and no system call
+             (fifo also takes a ticket and, at every admission, wakes
+             the next ticket with a FUTEX_WAKE_BITSET on ticket % 32,
+             it trades that for the strict order).
+             A GroupOrder, if given, gets the visit's place in the order
+             of arrival and of admission, taken by the lock itself: fifo
+             uses the ticket for both, it is the step that orders both,
+             so admission - arrival, the later arrivals that got in
+             first, is 0. The other policies number a thread's arrival
+             right after the CAS that counts it as waiting (or that lets
+             it in, if it never waited) and its admission right after
+             the CAS that lets it in, so spinning before that and the
+             time before the lock was called are not counted.
+
+   usage:
+     #include "../common/groupMutex.h"
+     GroupMutex room;
+     groupInit(&room, parseGroupPolicy("batch"), 8);  // quantum: batch size or slice in usec
+     GroupOrder order;                              // or NULL
+     int inside = groupTryLock(&room, cls, &order);  // cls 0 or 1, 0 if it would wait
+     if (inside == 0)
+         inside = groupLock(&room, cls, &order);     // how many of cls are inside now
+     ... in the room
+     groupUnlock(&room, cls);                // how many of cls are still inside
+*/
+#ifndef GROUP_MUTEX_H
+#define GROUP_MUTEX_H
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GROUP_SPIN 200  /* rounds to spin before sleeping */
+
+typedef enum { GROUP_TURN, GROUP_ALTERNATE, GROUP_BATCH, GROUP_SLICE, GROUP_FIFO, GROUP_POLICIES } GroupPolicy;
+
+static const char *const groupPolicyNames[GROUP_POLICIES] = { "turn", "alternate", "batch", "slice", "fifo" };
+
+// the fields of the state word
+#define GROUP_COUNT_BITS 16
+#define GROUP_COUNT_MASK ((1ULL << GROUP_COUNT_BITS) - 1)
+#define GROUP_MAX_THREADS ((int)GROUP_COUNT_MASK)           /* of one class, or a count overflows */
+#define GROUP_INSIDE_SHIFT 0                                   /* threads inside */
+#define GROUP_WAITING_SHIFT(c) (GROUP_COUNT_BITS * (1 + (c)))  /* waiters of class c */
+#define GROUP_GRANT_SHIFT 48                                   /* admissions left this turn */
+#define GROUP_GRANT_MASK ((1ULL << 14) - 1)
+#define GROUP_TURN_SHIFT 62                                    /* 0 nobody yet, c + 1 class c */
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t state;
+    GroupPolicy policy;
+    int quantum;
+    _Atomic long long turnStarted;     // slice: ns on CLOCK_MONOTONIC
+    _Alignas(64) atomic_uint gate[2];  // futex words, bumped when a class may go on
+    _Alignas(64) atomic_uint nextTicket;  // fifo
+    _Alignas(64) atomic_uint serving;     // fifo: the ticket that may go in next, a futex word too
+    _Alignas(64) atomic_llong arrivals;   // not fifo: GroupOrder numbers
+    atomic_llong admissions;
+} GroupMutex;
+
+// the place of a visit among all arrivals and all admissions, from 0
+typedef struct {
+    long long arrival, admission;
+} GroupOrder;
+
+// returns -1 for an unknown name
+static inline int parseGroupPolicy(const char *name) {
+    for (int p = 0; p < GROUP_POLICIES; p++)
+        if (strcmp(name, groupPolicyNames[p]) == 0)
+            return p;
+    return -1;
+}
+
+static inline unsigned groupInside(uint64_t s) {
+    return (unsigned)((s >> GROUP_INSIDE_SHIFT) & GROUP_COUNT_MASK);
+}
+
+static inline unsigned groupWaiting(uint64_t s, int cls) {
+    return (unsigned)((s >> GROUP_WAITING_SHIFT(cls)) & GROUP_COUNT_MASK);
+}
+
+static inline unsigned groupGrant(uint64_t s) {
+    return (unsigned)((s >> GROUP_GRANT_SHIFT) & GROUP_GRANT_MASK);
+}
+
+static inline int groupTurn(uint64_t s) {
+    return (int)(s >> GROUP_TURN_SHIFT) - 1;
+}
+
+static inline uint64_t groupWithGrant(uint64_t s, unsigned grant) {
+    grant = grant < GROUP_GRANT_MASK ? grant : (unsigned)GROUP_GRANT_MASK;
+    return (s & ~(GROUP_GRANT_MASK << GROUP_GRANT_SHIFT)) | ((uint64_t)grant << GROUP_GRANT_SHIFT);
+}
+
+static inline long long groupClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void groupInit(GroupMutex *g, GroupPolicy policy, int quantum) {
+    atomic_init(&g->state, 0);
+    g->policy = policy;
+    g->quantum = quantum > 0 ? quantum : 1;
+    atomic_init(&g->turnStarted, 0);
+    atomic_init(&g->gate[0], 0);
+    atomic_init(&g->gate[1], 0);
+    atomic_init(&g->nextTicket, 0);
+    atomic_init(&g->serving, 0);
+    atomic_init(&g->arrivals, 0);
+    atomic_init(&g->admissions, 0);
+}
+
+/* s with the turn given to cls: the grant is what the policy allows it
+   while the other class waits (turn and slice do not count it down). */
+static inline uint64_t groupGiveTurn(GroupMutex *g, uint64_t s, int cls) {
+    unsigned grant;
+    switch (g->policy) {
+    case GROUP_ALTERNATE: grant = groupWaiting(s, cls) > 0 ? groupWaiting(s, cls) : 1; break;
+    case GROUP_BATCH:     grant = (unsigned)g->quantum; break;
+    default:              grant = (unsigned)GROUP_GRANT_MASK; break;
+    }
+    s = groupWithGrant(s, grant);
+    return (s & ((1ULL << GROUP_TURN_SHIFT) - 1)) | ((uint64_t)(cls + 1) << GROUP_TURN_SHIFT);
+}
+
+/* What a thread of cls entering in state s leaves behind, or 0 if it may
+   not enter now. */
+static inline uint64_t groupEnter(GroupMutex *g, uint64_t s, int cls) {
+    int other = 1 - cls;
+    if (groupTurn(s) == other) {
+        if (groupInside(s) > 0)
+            return 0;
+        // the other class was handed the turn and still has a grant to use
+        if (groupWaiting(s, other) > 0 && groupGrant(s) > 0)
+            return 0;
+    }
+    if (groupTurn(s) != cls || (groupInside(s) == 0 && groupGrant(s) == 0))
+        return groupGiveTurn(g, s, cls) + 1;  // a new turn
+    if (groupWaiting(s, other) == 0)
+        return s + 1;
+    // the other class waits: the policy decides
+    switch (g->policy) {
+    case GROUP_TURN:
+        return s + 1;
+    case GROUP_SLICE:  // the first one of a turn always, it may have been woken late
+        return groupInside(s) == 0 || groupClock() - atomic_load(&g->turnStarted) <
+               (long long)g->quantum * 1000 ? s + 1 : 0;
+    default:
+        return groupGrant(s) > 0 ? groupWithGrant(s, groupGrant(s) - 1) + 1 : 0;
+    }
+}
+
+static inline void groupFutexWait(atomic_uint *word, unsigned expected) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static inline void groupFutexWakeAll(atomic_uint *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// fifo: a ticket sleeps on the serving word with only its own bit (mod 32)
+static inline void groupTicketWait(atomic_uint *serving, unsigned expected, unsigned ticket) {
+    syscall(SYS_futex, serving, FUTEX_WAIT_BITSET_PRIVATE, expected, NULL, NULL, 1u << (ticket % 32));
+}
+
+static inline void groupTicketWake(atomic_uint *serving, unsigned ticket) {
+    syscall(SYS_futex, serving, FUTEX_WAKE_BITSET_PRIVATE, INT_MAX, NULL, NULL, 1u << (ticket % 32));
+}
+
+// let every sleeper of cls look at the state again
+static inline void groupWakeAll(GroupMutex *g, int cls) {
+    atomic_fetch_add(&g->gate[cls], 1);
+    groupFutexWakeAll(&g->gate[cls]);
+}
+
+static inline void groupRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/* The CAS into the state after next. slice: a new turn's start time is
+   stored first, so whoever sees the turn sees its time (a failed CAS
+   only makes the current slice a little longer). */
+static inline int groupCommit(GroupMutex *g, uint64_t *s, uint64_t next) {
+    if (g->policy == GROUP_SLICE && groupTurn(next) != groupTurn(*s))
+        atomic_store(&g->turnStarted, groupClock());
+    return atomic_compare_exchange_weak(&g->state, s, next);
+}
+
+// not fifo: the next arrival number, if order is wanted
+static inline void groupArrive(GroupMutex *g, GroupOrder *order) {
+    if (order)
+        order->arrival = atomic_fetch_add_explicit(&g->arrivals, 1, memory_order_relaxed);
+}
+
+// not fifo: the next admission number, if order is wanted
+static inline void groupAdmit(GroupMutex *g, GroupOrder *order) {
+    if (order)
+        order->admission = atomic_fetch_add_explicit(&g->admissions, 1, memory_order_relaxed);
+}
+
+/* fifo: enter with ticket as cls once it is served and the room allows.
+   Returns how many of cls are inside, or 0 if it is not possible yet. */
+static inline int groupTryTicket(GroupMutex *g, unsigned ticket, int cls) {
+    if (atomic_load(&g->serving) != ticket)
+        return 0;
+    uint64_t s = atomic_load(&g->state);
+    while (groupInside(s) == 0 || groupTurn(s) == cls) {
+        if (groupCommit(g, &s, groupGiveTurn(g, s, cls) + 1)) {
+            atomic_fetch_add(&g->serving, 1);
+            groupTicketWake(&g->serving, ticket + 1);
+            return (int)groupInside(s) + 1;
+        }
+    }
+    return 0;
+}
+
+/* fifo: wait with ticket until it is served and in; the ticket is its
+   place in both orders. */
+static inline int groupWaitTicket(GroupMutex *g, unsigned ticket, int cls, GroupOrder *order) {
+    if (order)
+        order->arrival = order->admission = ticket;
+    int inside, spins = 0;
+    while ((inside = groupTryTicket(g, ticket, cls)) == 0) {
+        if (spins < GROUP_SPIN) {
+            spins++;
+            groupRelax();
+            continue;
+        }
+        // serving moves on at every admission, the new head is woken then
+        unsigned serving = atomic_load(&g->serving);
+        if (serving == ticket) {
+            uint64_t s = atomic_load(&g->state);
+            if (groupInside(s) == 0 || groupTurn(s) == cls)
+                continue;
+            // my turn but the other class is inside: wait for the room to empty
+            unsigned gate = atomic_load(&g->gate[cls]);
+            s = atomic_load(&g->state);
+            if (groupInside(s) > 0 && groupTurn(s) != cls)
+                groupFutexWait(&g->gate[cls], gate);
+        } else {
+            groupTicketWait(&g->serving, serving, ticket);
+        }
+    }
+    return inside;
+}
+
+/* Enter as cls if that needs no waiting: returns how many of cls are
+   inside now, or 0 if the thread would have to wait (order is only set
+   when it got in). */
+static inline int groupTryLock(GroupMutex *g, int cls, GroupOrder *order) {
+    if (g->policy == GROUP_FIFO) {
+        // only when nobody is queued, so the order holds; if the room
+        // changes after the ticket is taken it has to wait all the same
+        unsigned ticket = atomic_load(&g->serving);
+        uint64_t s = atomic_load(&g->state);
+        if (atomic_load(&g->nextTicket) != ticket || !(groupInside(s) == 0 || groupTurn(s) == cls) ||
+            !atomic_compare_exchange_strong(&g->nextTicket, &ticket, ticket + 1))
+            return 0;
+        return groupWaitTicket(g, ticket, cls, order);
+    }
+    uint64_t s = atomic_load(&g->state), next;
+    while ((next = groupEnter(g, s, cls)) != 0) {
+        if (groupCommit(g, &s, next)) {
+            groupArrive(g, order);
+            groupAdmit(g, order);
+            return (int)groupInside(s) + 1;
+        }
+    }
+    return 0;
+}
+
+/* Enter as cls, waiting as long as the policy says. Returns how many of
+   cls are inside now. order may be NULL. */
+static inline int groupLock(GroupMutex *g, int cls, GroupOrder *order) {
+    if (g->policy == GROUP_FIFO)
+        return groupWaitTicket(g, atomic_fetch_add(&g->nextTicket, 1), cls, order);
+    int spins = 0, waiting = 0;
+    uint64_t me = 1ULL << GROUP_WAITING_SHIFT(cls);
+    uint64_t s = atomic_load(&g->state), next;
+    for (;;) {
+        if ((next = groupEnter(g, s, cls)) != 0) {
+            if (groupCommit(g, &s, next - (waiting ? me : 0))) {
+                if (!waiting)
+                    groupArrive(g, order);
+                groupAdmit(g, order);
+                return (int)groupInside(s) + 1;
+            }
+        } else if (spins < GROUP_SPIN) {
+            spins++;
+            groupRelax();
+            s = atomic_load(&g->state);
+        } else if (!waiting) {
+            if (atomic_compare_exchange_weak(&g->state, &s, s + me)) {
+                waiting = 1;
+                groupArrive(g, order);
+            }
+        } else {
+            // the gate first: a handover after this check bumps it and the wait returns at once
+            unsigned gate = atomic_load(&g->gate[cls]);
+            s = atomic_load(&g->state);
+            if (groupEnter(g, s, cls) == 0) {
+                groupFutexWait(&g->gate[cls], gate);
+                s = atomic_load(&g->state);
+            }
+        }
+    }
+}
+
+/* Leave as cls. The last one out hands the turn to the other class if
+   any of it waits and wakes all of them. Returns how many of cls are
+   still inside. */
+static inline int groupUnlock(GroupMutex *g, int cls) {
+    int other = 1 - cls;
+    uint64_t s = atomic_load(&g->state), next;
+    do {
+        next = s - 1;
+        if (groupInside(next) == 0 && groupWaiting(next, other) > 0)
+            next = groupGiveTurn(g, next, other);
+    } while (!groupCommit(g, &s, next));
+    if (groupTurn(next) == other && groupTurn(s) != other)
+        groupWakeAll(g, other);
+    else if (g->policy == GROUP_FIFO && groupInside(next) == 0)
+        groupWakeAll(g, other);  // the head of the queue may be of the other class
+    return (int)groupInside(next);
+}
+
+#endif /* GROUP_MUTEX_H */
@@ -0,0 +1,246 @@
+/* counter-based input generator for the matrix and sort programs
+
+   features: element i of an input is a pure function of (seed, i): the
+             SplitMix64 finalizer of seed + (i + 1) * golden ratio, scaled
+             to the value range with a multiply and shift instead of %.
+             Any block of the input can therefore be filled by any
+             thread, the data is the same for every thread count and
+             the fill loops carry no state from one element to the next,
+             so the compiler is free to unroll and vectorize them.
+             distributions (-d), all in 0..range-1:
+               uniform - every value equally likely (rand() % range)
+               zipf    - value k with probability ~ 1/(k+1), a few hot
+                         keys and a long tail (ranges above GEN_ZIPF_MAX
+                         are mapped onto GEN_ZIPF_MAX ranks)
+               runs    - ascending runs of GEN_RUN_LENGTH values (fewer
+                         if the range is smaller), each one spread over
+                         the whole range, like concatenated sorted files
+               few     - only GEN_FEW_VALUES distinct values
+             genRunParallel fills with plain threads, one per online CPU
+             by default; the programs can also call the fill functions
+             from their own workers (firstTouchStrips of
+             threadPlacement.h, an OpenMP loop).
+
+   usage:
+     #include "../common/inputGen.h"
+     GenSpec gen;
+     genInit(&gen, parseGenDist("zipf"), seed, 99);
+     genFillInts(&gen, arr, begin, end);        // arr[i] for begin <= i < end
+     genFillRows(&gen, &matrix, first, last);   // element (i, j) is number i*cols + j
+     GenMatrix fill = { &gen, &matrix };
+     genFillMatrix(&fill, genDefaultThreads());  // all rows, in parallel
+     genFree(&gen);
+*/
+#ifndef INPUT_GEN_H
+#define INPUT_GEN_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "matrixStorage.h"
+
+#define GEN_DEFAULT_SEED 1        /* the seed when -g is not given */
+#define GEN_ZIPF_MAX (1 << 16)    /* most distinct zipf values, the size of its table */
+#define GEN_RUN_LENGTH 1024       /* values per ascending run */
+#define GEN_FEW_VALUES 8          /* distinct values of few */
+
+typedef enum { DIST_UNIFORM, DIST_ZIPF, DIST_RUNS, DIST_FEW, DIST_COUNT } GenDist;
+
+static const char *const genDistNames[DIST_COUNT] = { "uniform", "zipf", "runs", "few" };
+
+// returns -1 for an unknown name
+static inline int parseGenDist(const char *name) {
+    for (int d = 0; d < DIST_COUNT; d++)
+        if (strcmp(name, genDistNames[d]) == 0)
+            return d;
+    return -1;
+}
+
+typedef struct {
+    GenDist dist;
+    uint64_t seed;
+    uint64_t range;          // values are 0..range-1
+    uint64_t runLength;      // runs
+    uint64_t runStep;        // runs: range / runLength
+    int zipfRanks;           // zipf
+    uint32_t *zipfCdf;       // zipf: P(value <= k) * 2^32, ascending
+} GenSpec;
+
+// SplitMix64 of counter i, the same for any order of the calls
+static inline uint64_t genMix(uint64_t seed, uint64_t i) {
+    uint64_t z = seed + (i + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// a uniform value in 0..range-1 from 32 random bits (Lemire's multiply and shift)
+static inline uint64_t genScale(uint64_t bits32, uint64_t range) {
+    return (bits32 * range) >> 32;
+}
+
+/* Set up a generator of values 0..range-1 (range >= 1). Returns 0, or -1
+   if the zipf table could not be allocated. */
+static inline int genInit(GenSpec *g, GenDist dist, uint64_t seed, uint64_t range) {
+    g->dist = dist;
+    g->seed = seed;
+    g->range = range > 0 ? range : 1;
+    g->runLength = g->range < GEN_RUN_LENGTH ? g->range : GEN_RUN_LENGTH;
+    g->runStep = g->range / g->runLength;
+    g->zipfRanks = 0;
+    g->zipfCdf = NULL;
+    if (dist == DIST_ZIPF) {
+        g->zipfRanks = g->range < GEN_ZIPF_MAX ? (int)g->range : GEN_ZIPF_MAX;
+        g->zipfCdf = malloc(sizeof(uint32_t) * g->zipfRanks);
+        if (!g->zipfCdf)
+            return -1;
+        double total = 0, sum = 0;
+        for (int k = 0; k < g->zipfRanks; k++)
+            total += 1.0 / (k + 1);
+        for (int k = 0; k < g->zipfRanks; k++) {
+            sum += 1.0 / (k + 1);
+            double p = sum / total * 4294967296.0;
+            g->zipfCdf[k] = p >= 4294967295.0 ? 0xffffffffu : (uint32_t)p;
+        }
+        g->zipfCdf[g->zipfRanks - 1] = 0xffffffffu;
+    }
+    return 0;
+}
+
+static inline void genFree(GenSpec *g) {
+    free(g->zipfCdf);
+    g->zipfCdf = NULL;
+}
+
+// the first rank whose cumulative probability reaches u, branch free
+static inline int genZipfRank(const GenSpec *g, uint32_t u) {
+    const uint32_t *base = g->zipfCdf;
+    int len = g->zipfRanks;
+    while (len > 1) {
+        int half = len / 2;
+        base += (base[half - 1] < u) ? half : 0;
+        len -= half;
+    }
+    return (int)(base - g->zipfCdf);
+}
+
+// element i of the input
+static inline uint64_t genValue(const GenSpec *g, uint64_t i) {
+    uint64_t bits = genMix(g->seed, i);
+    switch (g->dist) {
+    case DIST_ZIPF: {
+        // ranks above the table are spread evenly over the range
+        uint64_t rank = genZipfRank(g, (uint32_t)bits);
+        return rank * (g->range / g->zipfRanks);
+    }
+    case DIST_RUNS:
+        return (i % g->runLength) * g->runStep + genScale(bits >> 32, g->runStep);
+    case DIST_FEW:
+        return genScale(bits >> 32, GEN_FEW_VALUES) * (g->range / GEN_FEW_VALUES);
+    default:
+        return genScale(bits >> 32, g->range);
+    }
+}
+
+// arr[i] = element i for begin <= i < end
+static inline void genFillInts(const GenSpec *g, int *arr, long long begin, long long end) {
+    if (g->dist == DIST_UNIFORM) {
+        // the common case as a loop without the switch
+        uint64_t seed = g->seed, range = g->range;
+        for (long long i = begin; i < end; i++)
+            arr[i] = (int)genScale(genMix(seed, i) >> 32, range);
+        return;
+    }
+    for (long long i = begin; i < end; i++)
+        arr[i] = (int)genValue(g, i);
+}
+
+#define GEN_FILL_ROW(T)                                            \
+    do {                                                           \
+        T *out = (T *)row;                                         \
+        for (int j = 0; j < m->cols; j++)                          \
+            out[j] = (T)genValue(g, (uint64_t)i * m->cols + j);    \
+    } while (0)
+
+// fill rows first..last of m, element (i, j) is element i*cols + j of the input
+static inline void genFillRows(const GenSpec *g, const Matrix *m, int first, int last) {
+    for (int i = first; i <= last; i++) {
+        void *row = matrixRow(m, i);
+        switch (m->type) {
+        case MT_INT8:   GEN_FILL_ROW(int8_t); break;
+        case MT_INT16:  GEN_FILL_ROW(int16_t); break;
+        case MT_INT32:  GEN_FILL_ROW(int32_t); break;
+        case MT_INT64:  GEN_FILL_ROW(int64_t); break;
+        case MT_FLOAT:  GEN_FILL_ROW(float); break;
+        default:        GEN_FILL_ROW(double); break;
+        }
+    }
+}
+
+typedef void (*GenFillFn)(void *ctx, long long begin, long long end);
+
+typedef struct {
+    GenFillFn fill;
+    void *ctx;
+    long long begin, end;
+} GenBlock;
+
+static inline void *genBlockThread(void *arg) {
+    GenBlock *block = arg;
+    block->fill(block->ctx, block->begin, block->end);
+    return NULL;
+}
+
+// one fill thread per online CPU
+static inline int genDefaultThreads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+/* Call fill(ctx, begin, end) on threads threads for equal blocks of
+   0..n-1. Calls it once on the calling thread if threads is 1. */
+static inline void genRunParallel(long long n, int threads, GenFillFn fill, void *ctx) {
+    if (threads < 1)
+        threads = 1;
+    if ((long long)threads > n)
+        threads = n > 0 ? (int)n : 1;
+    pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+    GenBlock *blocks = malloc(sizeof(GenBlock) * threads);
+    if (!ids || !blocks || threads == 1) {
+        fill(ctx, 0, n);
+    } else {
+        for (int t = 0; t < threads; t++) {
+            blocks[t] = (GenBlock){ fill, ctx, n * t / threads, n * (t + 1) / threads };
+            pthread_create(&ids[t], NULL, genBlockThread, &blocks[t]);
+        }
+        for (int t = 0; t < threads; t++)
+            pthread_join(ids[t], NULL);
+    }
+    free(ids);
+    free(blocks);
+}
+
+// a matrix and its generator, the ctx of the matrix fill functions
+typedef struct {
+    const GenSpec *gen;
+    const Matrix *matrix;
+} GenMatrix;
+
+// fill rows first..last, a StripFill of threadPlacement.h
+static inline void genMatrixRows(void *ctx, int first, int last) {
+    const GenMatrix *fill = ctx;
+    genFillRows(fill->gen, fill->matrix, first, last);
+}
+
+static inline void genMatrixBlock(void *ctx, long long begin, long long end) {
+    genMatrixRows(ctx, (int)begin, (int)end - 1);
+}
+
+// fill the whole matrix with threads threads
+static inline void genFillMatrix(GenMatrix *fill, int threads) {
+    genRunParallel(fill->matrix->rows, threads, genMatrixBlock, fill);
+}
+
+#endif /* INPUT_GEN_H */
@@ -0,0 +1,193 @@
+/* latency histograms and a Chrome trace of visits, one per thread
+
+   features: LatencyHistogram is HDR style: values below 16 ns have a
+             bucket each, above that every power of two is cut into 16
+             buckets, so a percentile is within 1/16 (about 6%) of the
+             true value from 1 ns up to 2^63 ns in under 8KB. Every
+             thread records into its own histogram, no shared writes,
+             and they are merged at the end (per class, or all).
+             TraceBuffer keeps the arrival, admission and exit time of
+             a thread's visits (the first capacity of them, the rest are
+             counted as dropped); traceWrite turns them into the Chrome
+             trace event format (chrome://tracing, ui.perfetto.dev): a
+             "wait" and an "inside" slice per visit, one track per
+             thread, grouped by class, so convoys at turn switches show
+             up as rows of waits ending together.
+             Times are ns on CLOCK_MONOTONIC (clock_gettime is a vDSO
+             call, no system call).
+
+   usage:
+     #include "../common/latencyTrace.h"
+     LatencyHistogram h;                    // one per thread
+     latInit(&h);
+     long long t0 = latNow(); ... latRecord(&h, latNow() - t0);
+     latMerge(&all, &h);                    // at the end
+     latPercentile(&all, 99.9);             // ns, upper end of its bucket
+     TraceBuffer t;                         // one per thread
+     traceInit(&t, 10000);
+     traceAdd(&t, arrived, admitted, left);
+     TraceFile tf;
+     if (traceBegin(&tf, "trace.json") == 0) {
+         traceGroup(&tf, 1, "men");             // every class
+         traceWrite(&tf, &t, 1, threadId, origin);  // every thread, origin: the first timestamp
+         traceEnd(&tf);
+     }
+*/
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LAT_SUB_BITS 4                                     /* 16 buckets per power of two */
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+typedef struct {
+    long long count;
+    long long sum;   // for the mean
+    long long max;
+    long long counts[LAT_BUCKETS];
+} LatencyHistogram;
+
+typedef struct {
+    long long arrived, admitted, left;
+} TraceVisit;
+
+typedef struct {
+    TraceVisit *visits;
+    int count, capacity;
+    long long dropped;
+} TraceBuffer;
+
+// ns on the monotonic clock
+static inline long long latNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void latInit(LatencyHistogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+static inline int latBucket(long long v) {
+    if (v < LAT_SUB)
+        return v < 0 ? 0 : (int)v;
+    int e = 63 - __builtin_clzll((unsigned long long)v);  // >= LAT_SUB_BITS
+    int sub = (int)((v >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+    return ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + sub;
+}
+
+// the largest value that lands in bucket b
+static inline long long latBucketTop(int b) {
+    if (b < LAT_SUB)
+        return b;
+    int e = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    long long low = (long long)(LAT_SUB + (b & (LAT_SUB - 1))) << (e - LAT_SUB_BITS);
+    return low + (1LL << (e - LAT_SUB_BITS)) - 1;
+}
+
+static inline void latRecord(LatencyHistogram *h, long long ns) {
+    h->count++;
+    h->sum += ns;
+    h->max = ns > h->max ? ns : h->max;
+    h->counts[latBucket(ns)]++;
+}
+
+static inline void latMerge(LatencyHistogram *dst, const LatencyHistogram *src) {
+    dst->count += src->count;
+    dst->sum += src->sum;
+    dst->max = src->max > dst->max ? src->max : dst->max;
+    for (int b = 0; b < LAT_BUCKETS; b++)
+        dst->counts[b] += src->counts[b];
+}
+
+static inline double latMean(const LatencyHistogram *h) {
+    return h->count > 0 ? (double)h->sum / h->count : 0;
+}
+
+// the p-th percentile (0 < p <= 100) in ns, at most the largest value recorded
+static inline long long latPercentile(const LatencyHistogram *h, double p) {
+    long long rank = (long long)(p / 100 * h->count + 0.999999), seen = 0;
+    rank = rank < 1 ? 1 : rank;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank)
+            return latBucketTop(b) < h->max ? latBucketTop(b) : h->max;
+    }
+    return 0;
+}
+
+// room for capacity visits; returns 0, or -1 if out of memory
+static inline int traceInit(TraceBuffer *t, int capacity) {
+    t->visits = malloc(sizeof(TraceVisit) * capacity);
+    t->count = 0;
+    t->capacity = capacity;
+    t->dropped = 0;
+    return t->visits ? 0 : -1;
+}
+
+static inline void traceFree(TraceBuffer *t) {
+    free(t->visits);
+    t->visits = NULL;
+}
+
+static inline void traceAdd(TraceBuffer *t, long long arrived, long long admitted, long long left) {
+    if (t->count == t->capacity) {
+        t->dropped++;
+        return;
+    }
+    t->visits[t->count++] = (TraceVisit){ arrived, admitted, left };
+}
+
+// a trace file being written
+typedef struct {
+    FILE *f;
+    long long events;
+} TraceFile;
+
+static inline void traceEvent(TraceFile *tf) {
+    fprintf(tf->f, tf->events++ ? ",\n" : "\n");
+}
+
+// opens path and starts the event list; returns 0, or -1 after printing why not
+static inline int traceBegin(TraceFile *tf, const char *path) {
+    tf->f = fopen(path, "w");
+    tf->events = 0;
+    if (!tf->f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(tf->f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    return 0;
+}
+
+// names the group of threads pid (a class), once before its threads
+static inline void traceGroup(TraceFile *tf, int pid, const char *name) {
+    traceEvent(tf);
+    fprintf(tf->f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"%s\"}}", pid, name);
+}
+
+// the visits of thread tid of group pid, in us relative to origin
+static inline void traceWrite(TraceFile *tf, const TraceBuffer *t, int pid, int tid, long long origin) {
+    for (int i = 0; i < t->count; i++) {
+        const TraceVisit *v = &t->visits[i];
+        traceEvent(tf);
+        fprintf(tf->f, "{\"name\": \"wait\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                pid, tid, (v->arrived - origin) / 1e3, (v->admitted - v->arrived) / 1e3);
+        traceEvent(tf);
+        fprintf(tf->f, "{\"name\": \"inside\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                pid, tid, (v->admitted - origin) / 1e3, (v->left - v->admitted) / 1e3);
+    }
+}
+
+// ends the event list and closes the file; returns 0, or -1 if writing failed
+static inline int traceEnd(TraceFile *tf) {
+    fprintf(tf->f, "\n]}\n");
+    return fclose(tf->f) == 0 ? 0 : -1;
+}
+
+#endif /* LATENCY_TRACE_H */
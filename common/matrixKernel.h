@@ -0,0 +1,421 @@
+/* shared matrix reduction kernel
+
+   features: computes the sum, min and max of a block of rows and the
+             (row, col) of the first min/max in a single pass, for every
+             element type in matrixStorage.h. Sums are accumulated in 64
+             bits (long long for integer matrices, double for float ones)
+             so 10000x10000 inputs no longer overflow.
+
+             int32 matrices use hand-written AVX2 and SSE4.1 versions that
+             keep values and positions in vector lanes and only resolve
+             the positions once the block is done. The other types use one
+             generic version, specialized per type with a macro: it finds
+             the min/max of each block of REDUCE_BLOCK elements with vector
+             lanes and only looks for the position when a block beats the
+             current extreme, which is rare. Within a block narrow types
+             sum into lanes twice as wide, so int8/int16 matrices move
+             4x/2x fewer bytes than int32 ones for about the same work
+             per vector.
+
+             The version is picked at runtime from the CPU features.
+
+   usage:
+     #include "../common/matrixKernel.h"
+     initStats(&stats, matrix.type);
+     reduceRows(&matrix, firstRow, lastRow, &stats);
+
+   the environment variable MATRIX_KERNEL=scalar|sse41|avx2 forces a
+   version, which is handy when comparing them.
+*/
+#ifndef MATRIX_KERNEL_H
+#define MATRIX_KERNEL_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrixStorage.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATRIX_KERNEL_X86 1
+#define MATRIX_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define MATRIX_TARGET_AVX2
+#endif
+
+#define REDUCE_BLOCK 2048  /* elements per block in the generic version */
+
+// A structure to store the matrix statistics i.e the sum and min/max values
+typedef struct {
+    MatrixType type;
+    MatrixValue sum;
+    MatrixValue max_value;
+    MatrixValue min_value;
+    int min_row;
+    int min_col;
+    int max_row;
+    int max_col;
+} MatrixStats;
+
+// stats for an empty block; rows of -1 mean "nothing seen yet"
+static inline void initStats(MatrixStats *stats, MatrixType type) {
+    memset(stats, 0, sizeof(*stats));
+    stats->type = type;
+    stats->min_row = stats->min_col = -1;
+    stats->max_row = stats->max_col = -1;
+}
+
+static inline int valueLess(MatrixType type, MatrixValue a, MatrixValue b) {
+    return matrixTypeIsFloat(type) ? a.f < b.f : a.i < b.i;
+}
+
+// true if (r1, c1) comes before (r2, c2) in row-major order
+static inline int positionBefore(int r1, int c1, int r2, int c2) {
+    return r1 < r2 || (r1 == r2 && c1 < c2);
+}
+
+// Keep the smallest value, ties go to the first position so that the
+// result does not depend on how the rows were split between workers.
+static inline void updateMin(MatrixStats *stats, MatrixValue value, int row, int col) {
+    if (row < 0)
+        return;
+    if (stats->min_row < 0 || valueLess(stats->type, value, stats->min_value) ||
+        (!valueLess(stats->type, stats->min_value, value) &&
+         positionBefore(row, col, stats->min_row, stats->min_col))) {
+        stats->min_value = value;
+        stats->min_row = row;
+        stats->min_col = col;
+    }
+}
+
+static inline void updateMax(MatrixStats *stats, MatrixValue value, int row, int col) {
+    if (row < 0)
+        return;
+    if (stats->max_row < 0 || valueLess(stats->type, stats->max_value, value) ||
+        (!valueLess(stats->type, value, stats->max_value) &&
+         positionBefore(row, col, stats->max_row, stats->max_col))) {
+        stats->max_value = value;
+        stats->max_row = row;
+        stats->max_col = col;
+    }
+}
+
+static inline void addSum(MatrixStats *stats, MatrixValue sum) {
+    if (matrixTypeIsFloat(stats->type))
+        stats->sum.f += sum.f;
+    else  // unsigned so that a 64-bit overflow wraps instead of being undefined
+        stats->sum.i = (long long)((unsigned long long)stats->sum.i + (unsigned long long)sum.i);
+}
+
+// merge the stats of another block (e.g. another worker) into dst
+static inline void mergeStats(MatrixStats *dst, const MatrixStats *src) {
+    addSum(dst, src->sum);
+    updateMin(dst, src->min_value, src->min_row, src->min_col);
+    updateMax(dst, src->max_value, src->max_row, src->max_col);
+}
+
+// mergeStats as a CombineFn of ../common/reduceCombiner.h
+static inline void combineStats(void *dst, const void *src) {
+    mergeStats((MatrixStats *)dst, (const MatrixStats *)src);
+}
+
+// one kernel: rows firstRow..lastRow of an element type, stats is local
+typedef void (*ReduceRowsFn)(const void *base, long stride, int firstRow, int lastRow,
+                             int cols, MatrixStats *stats);
+
+/* Sum lanes of a vector v into the lanes of sum vector type S that has
+   the same size: either the same lanes, or each lane of S adds the pair
+   of narrow lanes it overlaps (sign-extended with shifts), so there is no
+   cross-lane shuffling at all. */
+#define SUM_SAME(S, v) ((S)(v))
+#define SUM_PAIRS(S, v) \
+    ((((S)(v) << (sizeof((S){ 0 }[0]) * 4)) >> (sizeof((S){ 0 }[0]) * 4)) + ((S)(v) >> (sizeof((S){ 0 }[0]) * 4)))
+
+/* The generic version, NAME is specialized for elements of type T with
+   LANES lanes per 32-byte vector. MASK is the signed integer type as wide
+   as T (what a vector compare returns), S the lane type a block sums into
+   with SUMSTEP, ACC the scalar type of the block sum and FIELD the
+   MatrixValue member the results go to. */
+#define DEFINE_REDUCE_KERNEL(NAME, ATTR, T, LANES, MASK, S, SUMSTEP, ACC, FIELD)        \
+typedef T NAME##Vec __attribute__((vector_size(32), aligned(1), may_alias));              \
+typedef MASK NAME##Mask __attribute__((vector_size(32)));                                 \
+typedef S NAME##Sum __attribute__((vector_size(32)));                                     \
+ATTR static void NAME(const void *base, long stride, int firstRow, int lastRow,           \
+                      int cols, MatrixStats *stats) {                                     \
+    for (int i = firstRow; i <= lastRow; i++) {                                           \
+        const T *row = (const T *)base + (long)i * stride;                                \
+        for (int j0 = 0; j0 < cols; j0 += REDUCE_BLOCK) {                                 \
+            const T *p = row + j0;                                                        \
+            int n = (cols - j0 < REDUCE_BLOCK) ? cols - j0 : REDUCE_BLOCK;               \
+            int vecN = n - n % LANES, j;                                                  \
+            T bmin = p[0], bmax = p[0];                                                   \
+            ACC bsum = 0;                                                                 \
+            if (vecN > 0) {                                                               \
+                NAME##Vec vmin = *(const NAME##Vec *)p, vmax = vmin;                      \
+                NAME##Sum vsum = { 0 };                                                   \
+                for (j = 0; j < vecN; j += LANES) {                                       \
+                    NAME##Vec v = *(const NAME##Vec *)(p + j);                            \
+                    NAME##Mask lt = v < vmin, gt = v > vmax;                              \
+                    vsum += SUMSTEP(NAME##Sum, v);                                        \
+                    vmin = (NAME##Vec)(((NAME##Mask)v & lt) | ((NAME##Mask)vmin & ~lt));  \
+                    vmax = (NAME##Vec)(((NAME##Mask)v & gt) | ((NAME##Mask)vmax & ~gt));  \
+                }                                                                         \
+                for (j = 0; j < (int)(32 / sizeof(S)); j++)                               \
+                    bsum += vsum[j];                                                      \
+                for (j = 0; j < LANES; j++) {                                             \
+                    bmin = vmin[j] < bmin ? vmin[j] : bmin;                               \
+                    bmax = vmax[j] > bmax ? vmax[j] : bmax;                               \
+                }                                                                         \
+            }                                                                             \
+            for (j = vecN; j < n; j++) {                                                  \
+                bsum += p[j];                                                             \
+                bmin = p[j] < bmin ? p[j] : bmin;                                         \
+                bmax = p[j] > bmax ? p[j] : bmax;                                         \
+            }                                                                             \
+            stats->sum.FIELD += bsum;                                                     \
+            /* blocks come in order, so only a strictly better block moves a position */  \
+            if (stats->min_row < 0 || bmin < stats->min_value.FIELD) {                   \
+                for (j = 0; j < n - 1 && p[j] != bmin; j++)                               \
+                    ;                                                                     \
+                stats->min_value.FIELD = bmin;                                            \
+                stats->min_row = i;                                                       \
+                stats->min_col = j0 + j;                                                  \
+            }                                                                             \
+            if (stats->max_row < 0 || bmax > stats->max_value.FIELD) {                   \
+                for (j = 0; j < n - 1 && p[j] != bmax; j++)                               \
+                    ;                                                                     \
+                stats->max_value.FIELD = bmax;                                            \
+                stats->max_row = i;                                                       \
+                stats->max_col = j0 + j;                                                  \
+            }                                                                             \
+        }                                                                                 \
+    }                                                                                     \
+}
+
+// In a block of 2048 values an int16 (int32) sum lane adds at most 128
+// int8 (int16) values, far from overflowing. float blocks sum in float
+// lanes (exact for integers below 2^24) and are added up in double.
+// int32 has its own versions below.
+DEFINE_REDUCE_KERNEL(reduceInt8,   , int8_t,  32, int8_t,  int16_t, SUM_PAIRS, long long, i)
+DEFINE_REDUCE_KERNEL(reduceInt16,  , int16_t, 16, int16_t, int32_t, SUM_PAIRS, long long, i)
+DEFINE_REDUCE_KERNEL(reduceInt64,  , int64_t,  4, int64_t, int64_t, SUM_SAME,  long long, i)
+DEFINE_REDUCE_KERNEL(reduceFloat,  , float,    8, int32_t, float,   SUM_SAME,  double,    f)
+DEFINE_REDUCE_KERNEL(reduceDouble, , double,   4, int64_t, double,  SUM_SAME,  double,    f)
+#ifdef MATRIX_KERNEL_X86
+DEFINE_REDUCE_KERNEL(reduceInt8AVX2,   MATRIX_TARGET_AVX2, int8_t,  32, int8_t,  int16_t, SUM_PAIRS, long long, i)
+DEFINE_REDUCE_KERNEL(reduceInt16AVX2,  MATRIX_TARGET_AVX2, int16_t, 16, int16_t, int32_t, SUM_PAIRS, long long, i)
+DEFINE_REDUCE_KERNEL(reduceInt64AVX2,  MATRIX_TARGET_AVX2, int64_t,  4, int64_t, int64_t, SUM_SAME,  long long, i)
+DEFINE_REDUCE_KERNEL(reduceFloatAVX2,  MATRIX_TARGET_AVX2, float,    8, int32_t, float,   SUM_SAME,  double,    f)
+DEFINE_REDUCE_KERNEL(reduceDoubleAVX2, MATRIX_TARGET_AVX2, double,   4, int64_t, double,  SUM_SAME,  double,    f)
+#endif
+
+// Scalar pass over columns firstCol..cols-1 of one int32 row, used for
+// the columns that do not fill a whole vector.
+static inline void reduceSpanInt32(const int32_t *row, int rowIndex, int firstCol, int cols,
+                                   MatrixStats *stats) {
+    for (int j = firstCol; j < cols; j++) {
+        MatrixValue v = { .i = row[j] };
+        stats->sum.i += v.i;
+        if (stats->min_row < 0 || v.i < stats->min_value.i) {
+            stats->min_value = v;
+            stats->min_row = rowIndex;
+            stats->min_col = j;
+        }
+        if (stats->max_row < 0 || v.i > stats->max_value.i) {
+            stats->max_value = v;
+            stats->max_row = rowIndex;
+            stats->max_col = j;
+        }
+    }
+}
+
+#ifdef MATRIX_KERNEL_X86
+
+// Fold the per-lane results into stats. Every lane holds the first
+// occurrence of its own extreme, so picking the smallest position among
+// the lanes with the extreme value gives the first occurrence overall.
+static inline void resolveLanes(const int *minVal, const int *minRow, const int *minCol,
+                                const int *maxVal, const int *maxRow, const int *maxCol,
+                                int lanes, MatrixStats *stats) {
+    for (int k = 0; k < lanes; k++) {
+        updateMin(stats, (MatrixValue){ .i = minVal[k] }, minRow[k], minCol[k]);
+        updateMax(stats, (MatrixValue){ .i = maxVal[k] }, maxRow[k], maxCol[k]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void reduceInt32AVX2(const void *base, long stride, int firstRow, int lastRow,
+                            int cols, MatrixStats *stats) {
+    __m256i vsumLo = _mm256_setzero_si256(), vsumHi = _mm256_setzero_si256();
+    __m256i vmin = _mm256_set1_epi32(INT_MAX), vmax = _mm256_set1_epi32(INT_MIN);
+    __m256i minRow = _mm256_set1_epi32(-1), minCol = _mm256_set1_epi32(-1);
+    __m256i maxRow = _mm256_set1_epi32(-1), maxCol = _mm256_set1_epi32(-1);
+    const __m256i laneCols = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+    int vecCols = cols & ~7;
+
+    // seed the lanes with the first vector so every lane has a position
+    // even if no later value beats it (e.g. a matrix of INT_MAX)
+    if (vecCols > 0 && firstRow <= lastRow) {
+        vmin = vmax = _mm256_loadu_si256((const __m256i *)((const int32_t *)base + (long)firstRow * stride));
+        minRow = maxRow = _mm256_set1_epi32(firstRow);
+        minCol = maxCol = laneCols;
+    }
+
+    for (int i = firstRow; i <= lastRow; i++) {
+        const int32_t *row = (const int32_t *)base + (long)i * stride;
+        __m256i vrow = _mm256_set1_epi32(i);
+        __m256i vcol = laneCols;
+        for (int j = 0; j < vecCols; j += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(row + j));
+            __m256i lt = _mm256_cmpgt_epi32(vmin, v);  // strict, keeps the first occurrence
+            __m256i gt = _mm256_cmpgt_epi32(v, vmax);
+            // widen to 64-bit lanes so the sum cannot overflow
+            vsumLo = _mm256_add_epi64(vsumLo, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+            vsumHi = _mm256_add_epi64(vsumHi, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+            vmin = _mm256_min_epi32(vmin, v);
+            vmax = _mm256_max_epi32(vmax, v);
+            minRow = _mm256_blendv_epi8(minRow, vrow, lt);
+            minCol = _mm256_blendv_epi8(minCol, vcol, lt);
+            maxRow = _mm256_blendv_epi8(maxRow, vrow, gt);
+            maxCol = _mm256_blendv_epi8(maxCol, vcol, gt);
+            vcol = _mm256_add_epi32(vcol, step);
+        }
+        reduceSpanInt32(row, i, vecCols, cols, stats);
+    }
+
+    int lanes[6][8];
+    _mm256_storeu_si256((__m256i *)lanes[0], vmin);
+    _mm256_storeu_si256((__m256i *)lanes[1], minRow);
+    _mm256_storeu_si256((__m256i *)lanes[2], minCol);
+    _mm256_storeu_si256((__m256i *)lanes[3], vmax);
+    _mm256_storeu_si256((__m256i *)lanes[4], maxRow);
+    _mm256_storeu_si256((__m256i *)lanes[5], maxCol);
+    resolveLanes(lanes[0], lanes[1], lanes[2], lanes[3], lanes[4], lanes[5], 8, stats);
+
+    long long partial[4];
+    _mm256_storeu_si256((__m256i *)partial, _mm256_add_epi64(vsumLo, vsumHi));
+    for (int k = 0; k < 4; k++)
+        stats->sum.i += partial[k];
+}
+
+__attribute__((target("sse4.1")))
+static void reduceInt32SSE41(const void *base, long stride, int firstRow, int lastRow,
+                             int cols, MatrixStats *stats) {
+    __m128i vsumLo = _mm_setzero_si128(), vsumHi = _mm_setzero_si128();
+    __m128i vmin = _mm_set1_epi32(INT_MAX), vmax = _mm_set1_epi32(INT_MIN);
+    __m128i minRow = _mm_set1_epi32(-1), minCol = _mm_set1_epi32(-1);
+    __m128i maxRow = _mm_set1_epi32(-1), maxCol = _mm_set1_epi32(-1);
+    const __m128i laneCols = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i step = _mm_set1_epi32(4);
+    int vecCols = cols & ~3;
+
+    if (vecCols > 0 && firstRow <= lastRow) {
+        vmin = vmax = _mm_loadu_si128((const __m128i *)((const int32_t *)base + (long)firstRow * stride));
+        minRow = maxRow = _mm_set1_epi32(firstRow);
+        minCol = maxCol = laneCols;
+    }
+
+    for (int i = firstRow; i <= lastRow; i++) {
+        const int32_t *row = (const int32_t *)base + (long)i * stride;
+        __m128i vrow = _mm_set1_epi32(i);
+        __m128i vcol = laneCols;
+        for (int j = 0; j < vecCols; j += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + j));
+            __m128i lt = _mm_cmpgt_epi32(vmin, v);
+            __m128i gt = _mm_cmpgt_epi32(v, vmax);
+            vsumLo = _mm_add_epi64(vsumLo, _mm_cvtepi32_epi64(v));
+            vsumHi = _mm_add_epi64(vsumHi, _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+            vmin = _mm_min_epi32(vmin, v);
+            vmax = _mm_max_epi32(vmax, v);
+            minRow = _mm_blendv_epi8(minRow, vrow, lt);
+            minCol = _mm_blendv_epi8(minCol, vcol, lt);
+            maxRow = _mm_blendv_epi8(maxRow, vrow, gt);
+            maxCol = _mm_blendv_epi8(maxCol, vcol, gt);
+            vcol = _mm_add_epi32(vcol, step);
+        }
+        reduceSpanInt32(row, i, vecCols, cols, stats);
+    }
+
+    int lanes[6][4];
+    _mm_storeu_si128((__m128i *)lanes[0], vmin);
+    _mm_storeu_si128((__m128i *)lanes[1], minRow);
+    _mm_storeu_si128((__m128i *)lanes[2], minCol);
+    _mm_storeu_si128((__m128i *)lanes[3], vmax);
+    _mm_storeu_si128((__m128i *)lanes[4], maxRow);
+    _mm_storeu_si128((__m128i *)lanes[5], maxCol);
+    resolveLanes(lanes[0], lanes[1], lanes[2], lanes[3], lanes[4], lanes[5], 4, stats);
+
+    long long partial[2];
+    _mm_storeu_si128((__m128i *)partial, _mm_add_epi64(vsumLo, vsumHi));
+    stats->sum.i += partial[0] + partial[1];
+}
+
+#endif /* MATRIX_KERNEL_X86 */
+
+// Plain int32 version, the fallback when there is no SSE4.1.
+static void reduceInt32Scalar(const void *base, long stride, int firstRow, int lastRow,
+                              int cols, MatrixStats *stats) {
+    for (int i = firstRow; i <= lastRow; i++)
+        reduceSpanInt32((const int32_t *)base + (long)i * stride, i, 0, cols, stats);
+}
+
+// CPU dispatch: the best supported version of every type unless
+// MATRIX_KERNEL says otherwise
+static inline const char *pickReduceRows(ReduceRowsFn fns[MT_COUNT]) {
+    const char *forced = getenv("MATRIX_KERNEL");
+    fns[MT_INT8] = reduceInt8;
+    fns[MT_INT16] = reduceInt16;
+    fns[MT_INT32] = reduceInt32Scalar;
+    fns[MT_INT64] = reduceInt64;
+    fns[MT_FLOAT] = reduceFloat;
+    fns[MT_DOUBLE] = reduceDouble;
+#ifdef MATRIX_KERNEL_X86
+    __builtin_cpu_init();
+    if ((!forced || strcmp(forced, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        fns[MT_INT8] = reduceInt8AVX2;
+        fns[MT_INT16] = reduceInt16AVX2;
+        fns[MT_INT32] = reduceInt32AVX2;
+        fns[MT_INT64] = reduceInt64AVX2;
+        fns[MT_FLOAT] = reduceFloatAVX2;
+        fns[MT_DOUBLE] = reduceDoubleAVX2;
+        return "avx2";
+    }
+    if ((!forced || strcmp(forced, "scalar") != 0) && __builtin_cpu_supports("sse4.1")) {
+        fns[MT_INT32] = reduceInt32SSE41;
+        return "sse41";
+    }
+#endif
+    (void)forced;
+    fns[MT_INT32] = reduceInt32Scalar;
+    return "scalar";
+}
+
+static ReduceRowsFn reduceRowsImpl[MT_COUNT];
+static const char *reduceRowsImplName;
+
+// name of the version in use, e.g. for printing next to the timings
+static inline const char *reduceRowsName(void) {
+    if (!__atomic_load_n(&reduceRowsImplName, __ATOMIC_ACQUIRE)) {
+        ReduceRowsFn fns[MT_COUNT];
+        const char *name = pickReduceRows(fns);
+        for (int t = 0; t < MT_COUNT; t++)
+            __atomic_store_n(&reduceRowsImpl[t], fns[t], __ATOMIC_RELAXED);
+        __atomic_store_n(&reduceRowsImplName, name, __ATOMIC_RELEASE);
+    }
+    return reduceRowsImplName;
+}
+
+/* Reduce rows firstRow..lastRow (inclusive) of the matrix: the sum of
+   the block is added to stats->sum and its min/max are merged into
+   stats, which must have been initialized for the matrix type. */
+static inline void reduceRows(const Matrix *m, int firstRow, int lastRow, MatrixStats *stats) {
+    MatrixStats local;
+    reduceRowsName();
+    initStats(&local, m->type);
+    reduceRowsImpl[m->type](m->data, m->stride, firstRow, lastRow, m->cols, &local);
+    mergeStats(stats, &local);
+}
+
+#endif /* MATRIX_KERNEL_H */
@@ -0,0 +1,180 @@
+/* heap allocated matrix storage
+
+   features: a rows x cols matrix stored densely (row i starts at
+             data + i*cols elements, no padding up to some maximum size)
+             on a 64-byte aligned block. Large matrices are mmap'ed on a
+             2MB boundary and advised to use transparent huge pages, so
+             every page of a 10000x10000 matrix can be a huge one: ~200
+             2MB pages instead of ~100000 4KB ones.
+             The element type is picked at runtime; data that fits in
+             8 or 16 bits can be stored narrow to save memory bandwidth.
+             A matrix can also live in a mapped file, see binaryFile.h.
+
+   usage:
+     #include "../common/matrixStorage.h"
+     Matrix m;
+     if (parseDims(argv[1], &rows, &cols) != 0 || allocMatrix(&m, rows, cols, MT_INT32) != 0) ...
+     matrixSet(&m, i, j, 42);
+     freeMatrix(&m);
+*/
+#ifndef MATRIX_STORAGE_H
+#define MATRIX_STORAGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define MATRIX_ALIGN 64                  /* cache line */
+#define MATRIX_HUGEPAGE (2UL << 20)      /* 2MB transparent huge page */
+
+// element types a matrix can hold
+typedef enum { MT_INT8, MT_INT16, MT_INT32, MT_INT64, MT_FLOAT, MT_DOUBLE, MT_COUNT } MatrixType;
+
+static const char *const matrixTypeNames[MT_COUNT] = { "int8", "int16", "int32", "int64", "float", "double" };
+static const size_t matrixTypeSizes[MT_COUNT] = { 1, 2, 4, 8, 4, 8 };
+
+static inline int matrixTypeIsFloat(MatrixType type) {
+    return type == MT_FLOAT || type == MT_DOUBLE;
+}
+
+// returns -1 for an unknown name
+static inline int parseMatrixType(const char *name) {
+    for (int t = 0; t < MT_COUNT; t++)
+        if (strcmp(name, matrixTypeNames[t]) == 0)
+            return t;
+    return -1;
+}
+
+// an element, a sum or an extreme: integers in i, float and double in f
+typedef union {
+    long long i;
+    double f;
+} MatrixValue;
+
+// print a value of the given type into buf (at least 32 chars) and return buf
+static inline const char *formatValue(char *buf, MatrixType type, MatrixValue v) {
+    if (matrixTypeIsFloat(type))
+        snprintf(buf, 32, "%g", v.f);
+    else
+        snprintf(buf, 32, "%lld", v.i);
+    return buf;
+}
+
+typedef struct {
+    int rows;
+    int cols;
+    long stride;      /* elements between the starts of two rows, == cols (>= for a view of the left columns) */
+    MatrixType type;
+    size_t elemSize;  /* bytes per element */
+    void *data;
+    size_t bytes;     /* size of the allocation */
+    int mapped;       /* 1 if data came from mmap, 0 if from aligned_alloc */
+    size_t mapOffset; /* bytes from the start of the mapping to data (a file header) */
+} Matrix;
+
+static inline void *matrixRow(const Matrix *m, int i) {
+    return (char *)m->data + (long)i * m->stride * m->elemSize;
+}
+
+// store v at (i, j), converted to the element type
+static inline void matrixSet(const Matrix *m, int i, int j, long long v) {
+    void *row = matrixRow(m, i);
+    switch (m->type) {
+    case MT_INT8:   ((int8_t *)row)[j] = (int8_t)v; break;
+    case MT_INT16:  ((int16_t *)row)[j] = (int16_t)v; break;
+    case MT_INT32:  ((int32_t *)row)[j] = (int32_t)v; break;
+    case MT_INT64:  ((int64_t *)row)[j] = (int64_t)v; break;
+    case MT_FLOAT:  ((float *)row)[j] = (float)v; break;
+    case MT_DOUBLE: ((double *)row)[j] = (double)v; break;
+    default: break;
+    }
+}
+
+static inline MatrixValue matrixGet(const Matrix *m, int i, int j) {
+    const void *row = matrixRow(m, i);
+    MatrixValue v;
+    switch (m->type) {
+    case MT_INT8:   v.i = ((const int8_t *)row)[j]; break;
+    case MT_INT16:  v.i = ((const int16_t *)row)[j]; break;
+    case MT_INT32:  v.i = ((const int32_t *)row)[j]; break;
+    case MT_INT64:  v.i = ((const int64_t *)row)[j]; break;
+    case MT_FLOAT:  v.f = ((const float *)row)[j]; break;
+    default:        v.f = ((const double *)row)[j]; break;
+    }
+    return v;
+}
+
+/* Parse "N" (an N x N matrix) or "RxC" (R rows, C columns).
+   Returns 0 on success, -1 if the string is not a valid size. */
+static inline int parseDims(const char *arg, int *rows, int *cols) {
+    char *end;
+    long r = strtol(arg, &end, 10), c = r;
+    if (*end == 'x' || *end == 'X')
+        c = strtol(end + 1, &end, 10);
+    if (*end != '\0' || r <= 0 || c <= 0 || r > 0x7fffffffL || c > 0x7fffffffL)
+        return -1;
+    *rows = (int)r;
+    *cols = (int)c;
+    return 0;
+}
+
+/* Allocate an uninitialized rows x cols matrix of the given type.
+   Returns 0 on success, -1 if the memory could not be allocated. */
+static inline int allocMatrix(Matrix *m, int rows, int cols, MatrixType type) {
+    size_t bytes = (size_t)rows * (size_t)cols * matrixTypeSizes[type];
+
+    m->rows = rows;
+    m->cols = cols;
+    m->stride = cols;
+    m->type = type;
+    m->elemSize = matrixTypeSizes[type];
+    m->mapped = 0;
+    m->mapOffset = 0;
+    if (bytes >= MATRIX_HUGEPAGE) {
+        // whole huge pages on a huge page boundary: mmap only aligns to 4KB, so map one
+        // huge page more and unmap the slack before and after, what is left is the matrix
+        m->bytes = (bytes + MATRIX_HUGEPAGE - 1) & ~(MATRIX_HUGEPAGE - 1);
+        size_t mapBytes = m->bytes + MATRIX_HUGEPAGE;
+        char *base = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            m->data = NULL;
+            return -1;
+        }
+        char *p = (char *)(((uintptr_t)base + MATRIX_HUGEPAGE - 1) & ~(uintptr_t)(MATRIX_HUGEPAGE - 1));
+        size_t head = (size_t)(p - base), tail = mapBytes - head - m->bytes;
+        if (head > 0)
+            munmap(base, head);
+        if (tail > 0)
+            munmap(p + m->bytes, tail);
+#ifdef MADV_HUGEPAGE
+        madvise(p, m->bytes, MADV_HUGEPAGE);  // only a hint, fine if THP is disabled
+#endif
+        m->data = p;
+        m->mapped = 1;
+    } else {
+        m->bytes = (bytes + MATRIX_ALIGN - 1) & ~(size_t)(MATRIX_ALIGN - 1);
+        m->data = aligned_alloc(MATRIX_ALIGN, m->bytes);
+        if (!m->data)
+            return -1;
+    }
+    return 0;
+}
+
+/* Write zeros to rows first..last. The thread that does this first places
+   their pages (first touch), on its own NUMA node. */
+static inline void matrixTouchRows(const Matrix *m, int first, int last) {
+    if (first <= last)
+        memset(matrixRow(m, first), 0, (size_t)(last - first + 1) * m->stride * m->elemSize);
+}
+
+static inline void freeMatrix(Matrix *m) {
+    if (m->mapped)
+        munmap((char *)m->data - m->mapOffset, m->bytes);
+    else
+        free(m->data);
+    m->data = NULL;
+}
+
+#endif /* MATRIX_STORAGE_H */
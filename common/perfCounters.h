@@ -0,0 +1,285 @@
+/* hardware counters around the timed regions (Linux perf_event_open)
+
+   features: with -e every thread that takes part in a timed run counts
+             its own cycles, instructions, last level cache misses,
+             branch misses and dTLB load misses, in user space only (so
+             perf_event_paranoid 2 is enough). The counts of the timed
+             runs are summed per thread; the report adds their average
+             per run, IPC, the GB/s the kernel streamed (bytes given by
+             the program) and the GB/s the LLC misses pulled from memory
+             (64 bytes each) as metrics of benchHarness.h, and lists
+             every thread in text and json output.
+             Counters the machine or kernel does not have are reported
+             as n/a; without any, a warning is printed once and only the
+             times are reported. Multiplexed counters are scaled by the
+             time they were actually running.
+
+   usage:
+     #include "../common/perfCounters.h"
+     PerfCounters perf;
+     perfInit(&perf, &benchCfg, numWorkers);   // after the options, before benchHeader
+     perfBegin(&perf);
+     benchBegin(&run, &benchCfg);
+     while (benchNext(&run)) {
+         ... in each thread:
+         PerfThread pt;
+         perfThreadOpen(&perf, &pt, 0);       // 0: the calling thread, or a thread id
+         perfThreadStart(&pt);
+         ... the work
+         perfThreadStop(&perf, &pt, myid, &run);
+         perfThreadClose(&pt);
+     }
+     perfReport(&perf, &run, "matrixSumA", "int32", n, numWorkers, bytes);  // instead of benchReport
+     ... or perfFinish(&perf, &run, bytes) now and benchReport later, before
+     the counters of the next run replace these
+*/
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "benchHarness.h"
+
+typedef enum {
+    PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_DTLB_MISSES,
+    PERF_EVENTS
+} PerfEvent;
+
+static const char *const perfEventNames[PERF_EVENTS] = {
+    "cycles", "instructions", "llc_misses", "branch_misses", "dtlb_misses"
+};
+
+// the metrics perfReport adds to a BenchRun, in this order
+typedef enum {
+    PERF_M_CYCLES, PERF_M_INSTRUCTIONS, PERF_M_LLC_MISSES, PERF_M_BRANCH_MISSES, PERF_M_DTLB_MISSES,
+    PERF_M_IPC, PERF_M_GBPS, PERF_M_LLC_GBPS, PERF_METRICS
+} PerfMetric;
+
+static const char *const perfMetricNames[PERF_METRICS] = {
+    "cycles", "instructions", "llc_misses", "branch_misses", "dtlb_misses", "ipc", "gbps", "llc_gbps"
+};
+
+#define PERF_LINE_BYTES 64  /* bytes moved by one LLC miss */
+
+typedef struct {
+    int enabled;               // -e given and at least one counter works
+    int maxThreads;
+    int available[PERF_EVENTS];
+    long long (*counts)[PERF_EVENTS];  // per thread, summed over the timed runs
+    int *used;                 // 1 for the threads that stopped a timed run
+} PerfCounters;
+
+// the counters of one thread
+typedef struct {
+    int fd[PERF_EVENTS];
+} PerfThread;
+
+static inline pid_t perfGettid(void) {
+    return (pid_t)syscall(SYS_gettid);
+}
+
+static inline int perfOpenEvent(PerfEvent event, pid_t tid) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    switch (event) {
+    case PERF_CYCLES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PERF_INSTRUCTIONS:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PERF_LLC_MISSES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case PERF_BRANCH_MISSES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    default:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    }
+    return (int)syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+}
+
+/* Set up the counters if cfg asks for them (-e) and register their
+   metrics with cfg. maxThreads is the most threads a run will use. */
+static inline void perfInit(PerfCounters *pc, BenchConfig *cfg, int maxThreads) {
+    pc->enabled = 0;
+    pc->maxThreads = maxThreads > 0 ? maxThreads : 1;
+    pc->counts = NULL;
+    pc->used = NULL;
+    if (!cfg->counters)
+        return;
+
+    // find out which counters this machine has
+    int anyCounter = 0, error = 0;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        int fd = perfOpenEvent(e, 0);
+        pc->available[e] = fd >= 0;
+        if (fd >= 0) {
+            close(fd);
+            anyCounter = 1;
+        } else {
+            error = errno;
+        }
+    }
+    if (!anyCounter) {
+        fprintf(stderr, "hardware counters unavailable (perf_event_open: %s), reporting times only\n",
+                strerror(error));
+        return;
+    }
+    pc->counts = calloc(pc->maxThreads, sizeof(pc->counts[0]));
+    pc->used = calloc(pc->maxThreads, sizeof(int));
+    if (!pc->counts || !pc->used) {
+        free(pc->counts);
+        free(pc->used);
+        return;
+    }
+    pc->enabled = 1;
+    cfg->numMetrics = 0;
+    for (int m = 0; m < PERF_METRICS && m < BENCH_MAX_METRICS; m++)
+        cfg->metricNames[cfg->numMetrics++] = perfMetricNames[m];
+}
+
+// clear the per thread sums, before the runs of a new case
+static inline void perfBegin(PerfCounters *pc) {
+    if (!pc->enabled)
+        return;
+    memset(pc->counts, 0, sizeof(pc->counts[0]) * pc->maxThreads);
+    memset(pc->used, 0, sizeof(int) * pc->maxThreads);
+}
+
+/* Open the counters of thread tid (0 for the calling thread). A thread
+   of the same process may open them for another one. */
+static inline void perfThreadOpen(const PerfCounters *pc, PerfThread *pt, pid_t tid) {
+    for (int e = 0; e < PERF_EVENTS; e++)
+        pt->fd[e] = (pc->enabled && pc->available[e]) ? perfOpenEvent(e, tid) : -1;
+}
+
+static inline void perfThreadStart(PerfThread *pt) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        if (pt->fd[e] >= 0) {
+            ioctl(pt->fd[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pt->fd[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/* Stop the counters and add them to slot (one per thread, only this
+   thread writes it) if run is in a timed iteration. */
+static inline void perfThreadStop(PerfCounters *pc, PerfThread *pt, int slot, const BenchRun *run) {
+    for (int e = 0; e < PERF_EVENTS; e++)
+        if (pt->fd[e] >= 0)
+            ioctl(pt->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+    if (!pc->enabled || !benchIsTrial(run) || slot < 0 || slot >= pc->maxThreads)
+        return;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        unsigned long long value[3];  // count, time enabled, time running
+        if (pt->fd[e] < 0 || read(pt->fd[e], value, sizeof(value)) != sizeof(value))
+            continue;
+        if (value[2] > 0 && value[2] < value[1])
+            value[0] = (unsigned long long)((double)value[0] * value[1] / value[2]);
+        pc->counts[slot][e] += (long long)value[0];
+    }
+    pc->used[slot] = 1;
+}
+
+static inline void perfThreadClose(PerfThread *pt) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        if (pt->fd[e] >= 0)
+            close(pt->fd[e]);
+        pt->fd[e] = -1;
+    }
+}
+
+// metrics of one thread's (or all threads') counts over trials runs of mean seconds
+static inline void perfMetrics(const PerfCounters *pc, const long long *counts, int trials,
+                               double mean, double bytes, double *metrics) {
+    for (int e = 0; e < PERF_EVENTS; e++)
+        metrics[e] = pc->available[e] ? (double)counts[e] / trials : -1;
+    metrics[PERF_M_IPC] = (metrics[PERF_M_CYCLES] > 0 && metrics[PERF_M_INSTRUCTIONS] >= 0)
+                              ? metrics[PERF_M_INSTRUCTIONS] / metrics[PERF_M_CYCLES] : -1;
+    metrics[PERF_M_GBPS] = (bytes > 0 && mean > 0) ? bytes / mean * 1e-9 : -1;
+    metrics[PERF_M_LLC_GBPS] = (metrics[PERF_M_LLC_MISSES] >= 0 && mean > 0)
+                                   ? metrics[PERF_M_LLC_MISSES] * PERF_LINE_BYTES / mean * 1e-9 : -1;
+}
+
+/* Store the counter metrics of the finished run in run->metrics, for a
+   later benchReport. bytes is what one run of the kernel streams, 0 if
+   that makes no sense. */
+static inline void perfFinish(const PerfCounters *pc, BenchRun *run, double bytes) {
+    if (!pc->enabled)
+        return;
+    long long total[PERF_EVENTS] = { 0 };
+    for (int t = 0; t < pc->maxThreads; t++)
+        for (int e = 0; e < PERF_EVENTS; e++)
+            total[e] += pc->counts[t][e];
+    perfMetrics(pc, total, run->cfg.trials, run->mean, bytes, run->metrics);
+}
+
+/* perfFinish and benchReport, then one line (text) or object (json) per
+   thread. */
+static inline void perfReport(PerfCounters *pc, BenchRun *run, const char *program, const char *benchCase,
+                              long long n, int workers, double bytes) {
+    int trials = run->cfg.trials;
+    double mean = run->mean;
+    BenchFormat format = run->cfg.format;
+    perfFinish(pc, run, bytes);
+    benchReport(run, program, benchCase, n, workers);
+    if (!pc->enabled)
+        return;
+
+    if (format == BENCH_CSV)
+        return;
+    for (int t = 0; t < pc->maxThreads; t++) {
+        if (!pc->used[t])
+            continue;
+        double m[PERF_METRICS];
+        perfMetrics(pc, pc->counts[t], trials, mean, 0, m);
+        if (format == BENCH_TEXT)
+            printf("  thread %d:", t);
+        else
+            printf("{\"program\": \"%s\", \"case\": \"%s\", \"thread\": %d", program, benchCase, t);
+        for (int k = 0; k < PERF_METRICS; k++) {
+            if (k == PERF_M_GBPS)
+                continue;  // the bytes are only known for the whole run
+            if (format == BENCH_TEXT && m[k] >= 0)
+                printf(" %s %.4g", perfMetricNames[k], m[k]);
+            else if (format == BENCH_TEXT)
+                printf(" %s n/a", perfMetricNames[k]);
+            else if (m[k] >= 0)
+                printf(", \"%s\": %.9g", perfMetricNames[k], m[k]);
+            else
+                printf(", \"%s\": null", perfMetricNames[k]);
+        }
+        printf(format == BENCH_TEXT ? "\n" : "}\n");
+    }
+}
+
+static inline void perfDestroy(PerfCounters *pc) {
+    free(pc->counts);
+    free(pc->used);
+    pc->counts = NULL;
+    pc->used = NULL;
+    pc->enabled = 0;
+}
+
+#endif /* PERF_COUNTERS_H */
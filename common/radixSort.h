@@ -0,0 +1,173 @@
+/* parallel LSD radix sort for int keys
+
+   features: keys are sorted on RADIX_BITS-bit digits of (key - min), so
+             a pass is only made for the digits the key range needs:
+             keys in 0..999 fit in one pass, full range ints take three.
+             Every pass, each part counts the digits of its block into
+             its own histogram, prefix sums over (digit, part) give each
+             part the place of its first key of every digit, and the
+             parts scatter their blocks into the other buffer. A pass
+             whose digit is the same for all keys is skipped. The parts
+             are run by the caller's PartRunner (see sortKernel.h).
+             -a auto uses radix sort when radixWorthIt() says the
+             passes are cheaper than comparison sorting.
+
+   usage:
+     #include "../common/radixSort.h"
+     RadixSort rs;
+     int passes = radixPrepare(&rs, arr, scratch, n, parts, runAllParts);
+     if (radixWorthIt(n, passes, parts))
+         radixSortRun(&rs);   // arr is sorted, scratch was used as the buffer
+*/
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "sortKernel.h"
+
+#define RADIX_BITS 11                     /* 2048 counters per part, 8KB fits in L1 */
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_MIN_N 256                   /* keys per part and pass for radix to pay off */
+
+typedef struct {
+    int *arr;
+    int *scratch;        // n ints, the second buffer
+    int n;
+    int parts;
+    PartRunner run;
+    int *src, *dst;      // this pass reads src and writes dst
+    int shift;           // of the current digit
+    unsigned lowKey;     // smallest key, as radixKey
+    unsigned partLow[BLOCK_MAX_PARTS], partHigh[BLOCK_MAX_PARTS];
+    int passes;
+    int (*counts)[RADIX_BUCKETS];  // per part digit counts, then scatter positions
+} RadixSort;
+
+// ints as unsigned in the same order
+static inline unsigned radixKey(int x) {
+    return (unsigned)x ^ 0x80000000u;
+}
+
+static inline int radixDigit(const RadixSort *rs, int x) {
+    return (int)(((radixKey(x) - rs->lowKey) >> rs->shift) & (RADIX_BUCKETS - 1));
+}
+
+static inline int radixBlockBegin(const RadixSort *rs, int part) {
+    return (int)((long long)rs->n * part / rs->parts);
+}
+
+// phase: smallest and largest key of block part
+static inline void radixRangePart(void *ctx, int part) {
+    RadixSort *rs = ctx;
+    unsigned low = 0xffffffffu, high = 0;
+    for (int i = radixBlockBegin(rs, part); i < radixBlockBegin(rs, part + 1); i++) {
+        unsigned k = radixKey(rs->arr[i]);
+        low = k < low ? k : low;
+        high = k > high ? k : high;
+    }
+    rs->partLow[part] = low;
+    rs->partHigh[part] = high;
+}
+
+// phase: digit histogram of block part
+static inline void radixCountPart(void *ctx, int part) {
+    RadixSort *rs = ctx;
+    int *count = rs->counts[part];
+    memset(count, 0, sizeof(rs->counts[part]));
+    for (int i = radixBlockBegin(rs, part); i < radixBlockBegin(rs, part + 1); i++)
+        count[radixDigit(rs, rs->src[i])]++;
+}
+
+// phase: move block part to its places in dst, keeping the order of equal digits
+static inline void radixScatterPart(void *ctx, int part) {
+    RadixSort *rs = ctx;
+    int *next = rs->counts[part];
+    for (int i = radixBlockBegin(rs, part); i < radixBlockBegin(rs, part + 1); i++) {
+        int x = rs->src[i];
+        rs->dst[next[radixDigit(rs, x)]++] = x;
+    }
+}
+
+// phase: copy block part from scratch back to arr
+static inline void radixCopyPart(void *ctx, int part) {
+    RadixSort *rs = ctx;
+    int begin = radixBlockBegin(rs, part);
+    memcpy(rs->arr + begin, rs->scratch + begin,
+           sizeof(int) * (radixBlockBegin(rs, part + 1) - begin));
+}
+
+/* Find the key range of arr[0..n-1] with parts threads and return how many
+   passes radixSortRun needs (0 if all keys are equal). */
+static inline int radixPrepare(RadixSort *rs, int *arr, int *scratch, int n, int parts, PartRunner run) {
+    rs->arr = arr;
+    rs->scratch = scratch;
+    rs->n = n;
+    rs->parts = parts < 1 ? 1 : (parts > BLOCK_MAX_PARTS ? BLOCK_MAX_PARTS : parts);
+    rs->run = run;
+    rs->counts = NULL;
+    run(radixRangePart, rs, rs->parts);
+    unsigned low = 0xffffffffu, high = 0;
+    for (int part = 0; part < rs->parts; part++) {
+        low = rs->partLow[part] < low ? rs->partLow[part] : low;
+        high = rs->partHigh[part] > high ? rs->partHigh[part] : high;
+    }
+    rs->lowKey = low;
+    int bits = 0;
+    for (unsigned span = n > 0 ? high - low : 0; span; span >>= 1)
+        bits++;
+    rs->passes = (bits + RADIX_BITS - 1) / RADIX_BITS;
+    return rs->passes;
+}
+
+/* Whether passes radix passes over n keys split in parts beat comparison
+   sorting them. Per key a pass is much cheaper than quicksort, but every
+   part clears and sums 2048 counters per pass, which costs about as much
+   as quicksorting RADIX_MIN_N keys. */
+static inline int radixWorthIt(int n, int passes, int parts) {
+    return (long long)n >= (long long)RADIX_MIN_N * passes * parts;
+}
+
+// Sort arr after radixPrepare, using scratch for the other half of every pass.
+static inline void radixSortRun(RadixSort *rs) {
+    if (rs->passes == 0)
+        return;
+    rs->counts = malloc(sizeof(rs->counts[0]) * rs->parts);
+    rs->src = rs->arr;
+    rs->dst = rs->scratch;
+    for (int pass = 0; pass < rs->passes; pass++) {
+        rs->shift = pass * RADIX_BITS;
+        rs->run(radixCountPart, rs, rs->parts);
+
+        // all keys have the same digit: the pass would not move anything
+        int constant = 0;
+        for (int d = 0; d < RADIX_BUCKETS && !constant; d++) {
+            int total = 0;
+            for (int part = 0; part < rs->parts; part++)
+                total += rs->counts[part][d];
+            constant = (total == rs->n);
+        }
+        if (constant)
+            continue;
+
+        // positions in digit-major, part-minor order keep the sort stable
+        int pos = 0;
+        for (int d = 0; d < RADIX_BUCKETS; d++) {
+            for (int part = 0; part < rs->parts; part++) {
+                int c = rs->counts[part][d];
+                rs->counts[part][d] = pos;
+                pos += c;
+            }
+        }
+        rs->run(radixScatterPart, rs, rs->parts);
+        int *t = rs->src;
+        rs->src = rs->dst;
+        rs->dst = t;
+    }
+    if (rs->src != rs->arr)
+        rs->run(radixCopyPart, rs, rs->parts);
+    free(rs->counts);
+    rs->counts = NULL;
+}
+
+#endif /* RADIX_SORT_H */
@@ -0,0 +1,109 @@
+/* per-thread reduction slots with a lock-free tree merge
+
+   features: every thread reduces into its own slot, each slot padded to
+             whole cache lines so no two threads ever write the same line,
+             and hands it in with combinerArrive. The slots are merged
+             pairwise up an implicit binary tree: at every node the second
+             of the two subtrees to finish merges the right one into the
+             left one, found with one atomic fetch-add, so nobody waits or
+             takes a lock and the last thread out does log2(P) merges. The
+             thread that completes the root gets 1 and the result is in
+             slot 0. The right subtree is always merged into the left one,
+             so an operator that prefers the first position (mergeStats)
+             gives the same result as merging the slots in order.
+             Any operator works: combine(dst, src) folds src into dst.
+             The node counters reset themselves, so the same combiner can
+             be used again once every thread of the last round returned.
+
+   usage:
+     #include "../common/reduceCombiner.h"
+     ReduceCombiner rc;
+     if (combinerInit(&rc, numWorkers, sizeof(MatrixStats), combineStats) != 0) ...
+     MatrixStats *mine = combinerSlot(&rc, w);           // in every worker w
+     initStats(mine, type); ... reduce into mine ...
+     if (combinerArrive(&rc, w))
+       globalStats = *(MatrixStats *)combinerResult(&rc);  // one worker only
+     combinerDestroy(&rc);
+*/
+#ifndef REDUCE_COMBINER_H
+#define REDUCE_COMBINER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COMBINER_LINE 64  /* cache line */
+
+// fold src into dst, both slots of the combiner
+typedef void (*CombineFn)(void *dst, const void *src);
+
+// the counter of the tree node whose right subtree starts at slot r
+typedef struct {
+    _Alignas(COMBINER_LINE) atomic_int arrived;
+} CombinerNode;
+
+typedef struct {
+    int numSlots;
+    size_t stride;       // bytes from one slot to the next, whole lines
+    char *slots;
+    CombinerNode *nodes; // numSlots, nodes[0] is unused
+    CombineFn combine;
+} ReduceCombiner;
+
+/* numSlots slots of slotSize bytes merged with combine. Returns 0, or -1
+   if out of memory. */
+static inline int combinerInit(ReduceCombiner *rc, int numSlots, size_t slotSize, CombineFn combine) {
+    rc->numSlots = numSlots > 0 ? numSlots : 1;
+    rc->stride = (slotSize + COMBINER_LINE - 1) & ~(size_t)(COMBINER_LINE - 1);
+    rc->combine = combine;
+    rc->slots = aligned_alloc(COMBINER_LINE, rc->stride * rc->numSlots);
+    rc->nodes = aligned_alloc(COMBINER_LINE, sizeof(CombinerNode) * rc->numSlots);
+    if (!rc->slots || !rc->nodes) {
+        free(rc->slots);
+        free(rc->nodes);
+        return -1;
+    }
+    memset(rc->slots, 0, rc->stride * rc->numSlots);
+    for (int r = 0; r < rc->numSlots; r++)
+        atomic_init(&rc->nodes[r].arrived, 0);
+    return 0;
+}
+
+static inline void combinerDestroy(ReduceCombiner *rc) {
+    free(rc->slots);
+    free(rc->nodes);
+    rc->slots = NULL;
+    rc->nodes = NULL;
+}
+
+static inline void *combinerSlot(const ReduceCombiner *rc, int w) {
+    return rc->slots + (size_t)w * rc->stride;
+}
+
+static inline void *combinerResult(const ReduceCombiner *rc) {
+    return rc->slots;
+}
+
+/* Slot w is final. Merges up the tree while this thread is the second to
+   finish a node; returns 1 to the thread that finishes the root (then
+   slot 0 holds everything), 0 to the others. */
+static inline int combinerArrive(ReduceCombiner *rc, int w) {
+    // at level k this thread holds the subtree of 2^k slots starting at w
+    for (int k = 0; (1 << k) < rc->numSlots; k++) {
+        int left = w & ~((2 << k) - 1);
+        int right = left + (1 << k);
+        if (right >= rc->numSlots)
+            continue;  // no right subtree, the left one moves up as it is
+        CombinerNode *node = &rc->nodes[right];
+        // acq_rel: the first one's slot is visible to the second
+        if (atomic_fetch_add_explicit(&node->arrived, 1, memory_order_acq_rel) == 0)
+            return 0;  // the other subtree is still busy, it will merge this one
+        atomic_store_explicit(&node->arrived, 0, memory_order_relaxed);
+        rc->combine(combinerSlot(rc, left), combinerSlot(rc, right));
+        w = left;
+    }
+    return 1;
+}
+
+#endif /* REDUCE_COMBINER_H */
@@ -0,0 +1,186 @@
+/* row schedulers for the bag-of-tasks matrix workers
+
+   features: hands out blocks of rows to numWorkers threads with one of
+             strip  - each worker gets one fixed strip (as matrixSumA.c)
+             mutex  - one row at a time from a mutex protected counter
+             guided - blocks from an atomic counter, shrinking as the
+                      rows run out (like OpenMP schedule(guided))
+             steal  - every worker owns a strip that it takes from the
+                      front in small blocks, idle workers steal half of
+                      what is left at the back of someone else's strip
+
+   usage:
+     #include "../common/rowScheduler.h"
+     if (initScheduler(&sched, parseSchedMode("guided"), rows, numWorkers, minChunk) != 0) ...
+     while (nextRows(&sched, myid, &first, &last)) { ... rows first..last ... }
+*/
+#ifndef ROW_SCHEDULER_H
+#define ROW_SCHEDULER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum { SCHED_STRIP, SCHED_MUTEX, SCHED_GUIDED, SCHED_STEAL } SchedMode;
+
+static const char *const schedModeNames[] = { "strip", "mutex", "guided", "steal" };
+
+// The rows [begin, end) a worker still owns, packed into one word so that
+// the owner and the thieves can both update it with a single CAS.
+typedef struct {
+    _Alignas(64) _Atomic uint64_t range;
+} RowRange;
+
+typedef struct {
+    SchedMode mode;
+    int numRows;
+    int numWorkers;
+    int minChunk;               // smallest block handed out
+    pthread_mutex_t rowMutex;   // mutex mode
+    int rowCounter;
+    _Alignas(64) atomic_int nextRow;  // guided mode
+    RowRange *ranges;           // strip and steal modes, one per worker
+} RowScheduler;
+
+static inline uint64_t packRange(uint32_t begin, uint32_t end) {
+    return ((uint64_t)begin << 32) | end;
+}
+
+static inline uint32_t rangeBegin(uint64_t r) { return (uint32_t)(r >> 32); }
+static inline uint32_t rangeEnd(uint64_t r) { return (uint32_t)r; }
+
+// returns -1 for an unknown name
+static inline int parseSchedMode(const char *name) {
+    for (int m = 0; m < (int)(sizeof(schedModeNames) / sizeof(schedModeNames[0])); m++)
+        if (strcmp(name, schedModeNames[m]) == 0)
+            return m;
+    return -1;
+}
+
+/* Returns 0, or -1 if out of memory. */
+static inline int initScheduler(RowScheduler *s, SchedMode mode, int numRows,
+                                int numWorkers, int minChunk) {
+    s->mode = mode;
+    s->numRows = numRows;
+    s->numWorkers = numWorkers;
+    s->minChunk = minChunk > 0 ? minChunk : 1;
+    pthread_mutex_init(&s->rowMutex, NULL);
+    s->rowCounter = 0;
+    atomic_init(&s->nextRow, 0);
+    s->ranges = aligned_alloc(64, sizeof(RowRange) * numWorkers);
+    if (!s->ranges) {
+        pthread_mutex_destroy(&s->rowMutex);
+        return -1;
+    }
+
+    // same strips as matrixSumA.c, the last worker takes the remainder
+    int stripSize = numRows / numWorkers;
+    for (int w = 0; w < numWorkers; w++) {
+        int first = w * stripSize;
+        int end = (w == numWorkers - 1) ? numRows : first + stripSize;
+        atomic_init(&s->ranges[w].range, packRange(first, end));
+    }
+    return 0;
+}
+
+static inline void destroyScheduler(RowScheduler *s) {
+    pthread_mutex_destroy(&s->rowMutex);
+    free(s->ranges);
+}
+
+// Take up to chunk rows from the front of a range; 0 if it was empty.
+static inline int popFront(RowRange *r, int chunk, int *first, int *last) {
+    uint64_t old = atomic_load_explicit(&r->range, memory_order_acquire);
+    for (;;) {
+        uint32_t begin = rangeBegin(old), end = rangeEnd(old);
+        if (begin >= end)
+            return 0;
+        uint32_t take = (end - begin < (uint32_t)chunk) ? end - begin : (uint32_t)chunk;
+        if (atomic_compare_exchange_weak_explicit(&r->range, &old, packRange(begin + take, end),
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            *first = begin;
+            *last = begin + take - 1;
+            return 1;
+        }
+    }
+}
+
+// Steal the back half of a victim's range; 0 if there was nothing to take.
+static inline int stealBack(RowRange *victim, uint32_t *begin, uint32_t *end) {
+    uint64_t old = atomic_load_explicit(&victim->range, memory_order_acquire);
+    for (;;) {
+        uint32_t b = rangeBegin(old), e = rangeEnd(old);
+        if (b >= e)
+            return 0;
+        uint32_t mid = e - (e - b + 1) / 2;
+        if (atomic_compare_exchange_weak_explicit(&victim->range, &old, packRange(b, mid),
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            *begin = mid;
+            *end = e;
+            return 1;
+        }
+    }
+}
+
+/* Give worker myid its next block of rows first..last (inclusive).
+   Returns 0 once all rows have been handed out. */
+static inline int nextRows(RowScheduler *s, int myid, int *first, int *last) {
+    switch (s->mode) {
+    case SCHED_STRIP:
+        return popFront(&s->ranges[myid], s->numRows, first, last);
+
+    case SCHED_MUTEX: {
+        pthread_mutex_lock(&s->rowMutex);
+        int row = s->rowCounter;
+        s->rowCounter++;
+        pthread_mutex_unlock(&s->rowMutex);
+        if (row >= s->numRows)
+            return 0;
+        *first = *last = row;
+        return 1;
+    }
+
+    case SCHED_GUIDED: {
+        // the chunk is sized from a stale view of the counter, which is
+        // fine: the fetch-add decides who gets which rows
+        int seen = atomic_load_explicit(&s->nextRow, memory_order_relaxed);
+        int remaining = s->numRows - seen;
+        if (remaining <= 0)
+            return 0;
+        int chunk = remaining / (2 * s->numWorkers);
+        if (chunk < s->minChunk)
+            chunk = s->minChunk;
+        int start = atomic_fetch_add_explicit(&s->nextRow, chunk, memory_order_relaxed);
+        if (start >= s->numRows)
+            return 0;
+        *first = start;
+        *last = (start + chunk < s->numRows ? start + chunk : s->numRows) - 1;
+        return 1;
+    }
+
+    case SCHED_STEAL: {
+        RowRange *mine = &s->ranges[myid];
+        for (;;) {
+            if (popFront(mine, s->minChunk, first, last))
+                return 1;
+            // own strip is done: look for work starting at the next worker
+            int stolen = 0;
+            for (int k = 1; k < s->numWorkers && !stolen; k++) {
+                uint32_t begin, end;
+                if (stealBack(&s->ranges[(myid + k) % s->numWorkers], &begin, &end)) {
+                    // nobody steals from an empty range, so a plain store is enough
+                    atomic_store_explicit(&mine->range, packRange(begin, end), memory_order_release);
+                    stolen = 1;
+                }
+            }
+            if (!stolen)
+                return 0;
+        }
+    }
+    }
+    return 0;
+}
+
+#endif /* ROW_SCHEDULER_H */
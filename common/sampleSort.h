@@ -0,0 +1,158 @@
+/* parallel sample sort for int keys
+
+   features: SAMPLE_OVERSAMPLE random keys per bucket are sorted and
+             every SAMPLE_OVERSAMPLE-th of them becomes a splitter, so
+             the buckets come out about equally large whatever the
+             data. Each part counts how many keys of its block go to
+             every bucket, prefix sums over (bucket, part) give the
+             place of every key, and the parts scatter their blocks
+             into the scratch buffer. The buckets are then sorted
+             independently (introsort) and copied back. There are
+             SAMPLE_BUCKETS_PER_PART buckets per thread, so the runner
+             can even out the remaining differences.
+             Equal splitters (a key that fills more than a bucket's
+             share, as in the few or zipf inputs) are merged into one,
+             and the keys equal to a splitter get a bucket of their own
+             between the two around it; it is sorted already, so a
+             heavy key is only copied instead of piling up in one
+             bucket that a single thread then sorts.
+
+   usage:
+     #include "../common/sampleSort.h"
+     sampleSort(arr, scratch, n, parts, PART_THREEWAY, runAllParts);
+*/
+#ifndef SAMPLE_SORT_H
+#define SAMPLE_SORT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sortKernel.h"
+
+#define SAMPLE_BUCKETS_PER_PART 4  /* buckets per thread */
+#define SAMPLE_OVERSAMPLE 64       /* sampled keys per bucket */
+#define SAMPLE_MAX_BUCKETS RUNNER_MAX_PARTS
+#define SAMPLE_MAX_SLOTS (2 * SAMPLE_MAX_BUCKETS - 1)  /* the buckets and the equal ones between them */
+
+typedef struct {
+    int *arr;
+    int *scratch;     // n ints, the buckets are built here
+    int n;
+    int parts;
+    int buckets;      // to sort, numSplitters + 1
+    int numSplitters; // distinct
+    PartitionMode mode;
+    // slot 2b holds splitters[b-1] < key < splitters[b] and slot 2b+1 the keys equal to splitters[b]
+    int splitters[SAMPLE_MAX_BUCKETS - 1];
+    int bucketBegin[SAMPLE_MAX_SLOTS + 1];
+    int (*counts)[SAMPLE_MAX_SLOTS];        // per part slot counts, then scatter positions
+} SampleSort;
+
+// the slot of x: twice the number of splitters below x, plus one if it
+// equals the next. The search has no branches on the data, which are
+// hard to predict here.
+static inline int sampleBucket(const SampleSort *ss, int x) {
+    const int *base = ss->splitters;
+    int len = ss->numSplitters;
+    while (len > 1) {
+        int half = len / 2;
+        base += (base[half] < x) ? half : 0;
+        len -= half;
+    }
+    int below = (int)(base - ss->splitters) + (*base < x);
+    int equal = below < ss->numSplitters && ss->splitters[below] == x;
+    return 2 * below + equal;
+}
+
+static inline int sampleBlockBegin(const SampleSort *ss, int part) {
+    return (int)((long long)ss->n * part / ss->parts);
+}
+
+// phase: bucket sizes of block part
+static inline void sampleCountPart(void *ctx, int part) {
+    SampleSort *ss = ctx;
+    int *count = ss->counts[part];
+    memset(count, 0, sizeof(int) * (2 * ss->numSplitters + 1));
+    for (int i = sampleBlockBegin(ss, part); i < sampleBlockBegin(ss, part + 1); i++)
+        count[sampleBucket(ss, ss->arr[i])]++;
+}
+
+// phase: move block part into the buckets in scratch
+static inline void sampleScatterPart(void *ctx, int part) {
+    SampleSort *ss = ctx;
+    int *next = ss->counts[part];
+    for (int i = sampleBlockBegin(ss, part); i < sampleBlockBegin(ss, part + 1); i++) {
+        int x = ss->arr[i];
+        ss->scratch[next[sampleBucket(ss, x)]++] = x;
+    }
+}
+
+// phase (one per bucket): sort it and copy it back to arr, with the keys
+// equal to the splitter after it, which need no sorting
+static inline void sampleSortBucket(void *ctx, int bucket) {
+    SampleSort *ss = ctx;
+    int begin = ss->bucketBegin[2 * bucket], sorted = ss->bucketBegin[2 * bucket + 1];
+    int end = ss->bucketBegin[bucket < ss->numSplitters ? 2 * bucket + 2 : 2 * bucket + 1];
+    serialQuickSort(ss->mode, ss->scratch, begin, sorted - 1);
+    memcpy(ss->arr + begin, ss->scratch + begin, sizeof(int) * (end - begin));
+}
+
+/* Sort arr[0..n-1] with parts threads through run, scratch holds n ints.
+   Small arrays, or a single part, are just sorted serially. */
+static inline void sampleSort(int *arr, int *scratch, int n, int parts, PartitionMode mode, PartRunner run) {
+    SampleSort ss;
+    ss.parts = parts > BLOCK_MAX_PARTS ? BLOCK_MAX_PARTS : parts;
+    ss.buckets = ss.parts * SAMPLE_BUCKETS_PER_PART;
+    if (ss.buckets > SAMPLE_MAX_BUCKETS)
+        ss.buckets = SAMPLE_MAX_BUCKETS;
+    int numSamples = ss.buckets * SAMPLE_OVERSAMPLE;
+    if (ss.parts <= 1 || n < 4 * numSamples) {
+        serialQuickSort(mode, arr, 0, n - 1);
+        return;
+    }
+    ss.arr = arr;
+    ss.scratch = scratch;
+    ss.n = n;
+    ss.mode = mode;
+
+    // splitters from a sorted random sample (xorshift, same every run)
+    int *sample = malloc(sizeof(int) * numSamples);
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < numSamples; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        sample[i] = arr[state % (uint64_t)n];
+    }
+    serialQuickSort(mode, sample, 0, numSamples - 1);
+    ss.numSplitters = 0;
+    for (int b = 1; b < ss.buckets; b++) {
+        int splitter = sample[b * SAMPLE_OVERSAMPLE];
+        if (ss.numSplitters == 0 || ss.splitters[ss.numSplitters - 1] != splitter)
+            ss.splitters[ss.numSplitters++] = splitter;
+    }
+    ss.buckets = ss.numSplitters + 1;
+    free(sample);
+    int slots = 2 * ss.numSplitters + 1;
+
+    ss.counts = malloc(sizeof(ss.counts[0]) * ss.parts);
+    run(sampleCountPart, &ss, ss.parts);
+
+    // positions in slot-major, part-minor order
+    int pos = 0;
+    for (int b = 0; b < slots; b++) {
+        ss.bucketBegin[b] = pos;
+        for (int part = 0; part < ss.parts; part++) {
+            int c = ss.counts[part][b];
+            ss.counts[part][b] = pos;
+            pos += c;
+        }
+    }
+    ss.bucketBegin[slots] = pos;
+
+    run(sampleScatterPart, &ss, ss.parts);
+    run(sampleSortBucket, &ss, ss.buckets);
+    free(ss.counts);
+}
+
+#endif /* SAMPLE_SORT_H */
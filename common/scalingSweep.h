@@ -0,0 +1,154 @@
+/* thread count scaling sweep shared by the OpenMP programs
+
+   features: -s times the kernel for every thread count p = 1..maxWorkers
+             (the numWorkers argument, the number of online CPUs by
+             default) in one process, on input allocated once for the
+             largest run:
+               strong - the same n for every p: speedup S = T1/Tp and
+                        efficiency S/p
+               weak   - n*p, so the work per thread stays the same:
+                        efficiency T1(n)/Tp(n*p) and the scaled speedup
+                        p times that
+             and the Karp-Flatt serial fraction (1/S - 1/p) / (1 - 1/p)
+             of both, which stays flat if the loss is serial code and
+             grows with p if it is overhead (locks, imbalance, memory
+             bandwidth). It is undefined for p = 1.
+             The size argument can be a list ("a,b,c", sweepSizeList):
+             a sweep of each base size, so weak scaling that only holds
+             for small n (the n*p input outgrowing the cache) shows up
+             apart from the work per thread.
+             The report follows -o of benchHarness.h: a table, or csv
+             rows / json objects with their own columns.
+
+   usage:
+     #include "../common/scalingSweep.h"
+     char *sizes[SWEEP_MAX_SIZES];
+     int numSizes = sweepSizeList(argv[optind], sizes);  // -1 if not a list, then parse every one
+     ScalingSweep sweep;                                   // for every size n:
+     if (sweepBegin(&sweep, maxWorkers, n) != 0) ...
+     for (int p = 1; p <= sweep.maxWorkers; p++) {
+         sweep.strong[p] = ... median seconds with p threads on n
+         sweep.weak[p]   = ... median seconds with p threads on sweepWeakSize(&sweep, p)
+     }
+     sweepHeader(&benchCfg);
+     sweepReport(&sweep, &benchCfg, "quickSortOMP", "random/3way");
+     sweepEnd(&sweep);
+*/
+#ifndef SCALING_SWEEP_H
+#define SCALING_SWEEP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "benchHarness.h"
+
+#define SWEEP_MAX_SIZES 16  /* base sizes of one sweep */
+
+typedef struct {
+    int maxWorkers;
+    long long n;       // the strong scaling size, and the weak one per thread
+    double *strong;    // seconds with p threads, [1..maxWorkers]
+    double *weak;
+} ScalingSweep;
+
+// the default for maxWorkers: the CPUs that are online
+static inline int sweepDefaultWorkers(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+/* Split the size argument "a,b,c" in place into items. Returns their
+   number, or -1 if one is empty or there are more than SWEEP_MAX_SIZES. */
+static inline int sweepSizeList(char *arg, char **items) {
+    int n = 0;
+    for (char *item = arg;; item++) {
+        char *comma = strchr(item, ',');
+        if (n == SWEEP_MAX_SIZES || comma == item || *item == '\0')
+            return -1;
+        items[n++] = item;
+        if (!comma)
+            return n;
+        *comma = '\0';
+        item = comma;
+    }
+}
+
+// Returns 0 on success, -1 if the tables could not be allocated.
+static inline int sweepBegin(ScalingSweep *sweep, int maxWorkers, long long n) {
+    sweep->maxWorkers = maxWorkers > 0 ? maxWorkers : 1;
+    sweep->n = n;
+    sweep->strong = calloc(sweep->maxWorkers + 1, sizeof(double));
+    sweep->weak = calloc(sweep->maxWorkers + 1, sizeof(double));
+    return (sweep->strong && sweep->weak) ? 0 : -1;
+}
+
+static inline long long sweepWeakSize(const ScalingSweep *sweep, int p) {
+    return sweep->n * p;
+}
+
+// serial fraction from a speedup on p threads, p > 1
+static inline double karpFlatt(double speedup, int p) {
+    return (1.0 / speedup - 1.0 / p) / (1.0 - 1.0 / p);
+}
+
+static inline void sweepPrintRow(const BenchConfig *cfg, const char *program, const char *benchCase,
+                                 const char *scaling, int p, long long n, double seconds,
+                                 double speedup) {
+    double efficiency = speedup / p;
+    double serial = p > 1 ? karpFlatt(speedup, p) : 0;
+    switch (cfg->format) {
+    case BENCH_TEXT:
+        printf("%-6s %7d %12lld %12g %8.2f %10.3f ", scaling, p, n, seconds, speedup, efficiency);
+        if (p > 1)
+            printf("%10.4f\n", serial);
+        else
+            printf("%10s\n", "-");
+        break;
+    case BENCH_CSV:
+        printf("%s,%s,%s,%d,%lld,%.9g,%.9g,%.9g,", program, benchCase, scaling, p, n,
+               seconds, speedup, efficiency);
+        if (p > 1)
+            printf("%.9g\n", serial);
+        else
+            printf("\n");
+        break;
+    default:
+        printf("{\"program\": \"%s\", \"case\": \"%s\", \"scaling\": \"%s\", \"workers\": %d, \"n\": %lld, "
+               "\"seconds\": %.9g, \"speedup\": %.9g, \"efficiency\": %.9g, \"karp_flatt\": ",
+               program, benchCase, scaling, p, n, seconds, speedup, efficiency);
+        if (p > 1)
+            printf("%.9g}\n", serial);
+        else
+            printf("null}\n");
+        break;
+    }
+}
+
+// print the CSV header, once before the first sweepReport
+static inline void sweepHeader(const BenchConfig *cfg) {
+    if (cfg->format == BENCH_CSV)
+        printf("program,case,scaling,workers,n,seconds,speedup,efficiency,karp_flatt\n");
+}
+
+// print the strong and then the weak scaling rows of benchCase
+static inline void sweepReport(const ScalingSweep *sweep, const BenchConfig *cfg,
+                               const char *program, const char *benchCase) {
+    if (cfg->format == BENCH_TEXT)
+        printf("%s:\n%-6s %7s %12s %12s %8s %10s %10s\n", benchCase, "scale", "workers", "n",
+               "seconds", "speedup", "efficiency", "karp-flatt");
+    for (int p = 1; p <= sweep->maxWorkers; p++)
+        sweepPrintRow(cfg, program, benchCase, "strong", p, sweep->n, sweep->strong[p],
+                      sweep->strong[1] / sweep->strong[p]);
+    for (int p = 1; p <= sweep->maxWorkers; p++)
+        sweepPrintRow(cfg, program, benchCase, "weak", p, sweepWeakSize(sweep, p), sweep->weak[p],
+                      p * sweep->weak[1] / sweep->weak[p]);
+}
+
+static inline void sweepEnd(ScalingSweep *sweep) {
+    free(sweep->strong);
+    free(sweep->weak);
+    sweep->strong = sweep->weak = NULL;
+}
+
+#endif /* SCALING_SWEEP_H */
@@ -0,0 +1,523 @@
+/* serial building blocks shared by the quicksort programs
+
+   features: two partition schemes,
+               lomuto - the original two-way scheme, median of three pivot
+               3way   - Bentley-McIlroy three-way partition: keys equal to
+                        the pivot are swapped to both ends while scanning
+                        and then into the middle, so the whole equal band
+                        is left out of the recursion (a ninther pivot is
+                        used above NINTHER_CUTOFF elements)
+             serialQuickSort is an introsort on top of either scheme: it
+             recurses into the smaller side and loops on the larger one
+             (so the stack stays O(log n)), switches to heapsort once the
+             depth passes 2*log2(n) and finishes ranges of up to
+             INSERTION_CUTOFF elements with insertion sort
+             blockPartitionRange splits a large range with several
+             threads: every thread partitions one block in place, then
+             prefix sums over the block counts tell each thread which
+             misplaced elements on either side of the split to swap
+             plus the input generators the benchmarks run on, element i
+             a function of (seed, i) only (see inputGen.h), so blocks
+             can be filled in parallel and every thread count sorts the
+             same keys
+               random  - uniform in 0..999, like the old rand() % 1000
+               unique  - uniform over all non-negative ints, hardly any
+                         duplicates
+               sorted, reverse, organ (0 1 2 .. n/2 .. 2 1 0)
+               zipf    - skewed keys in 0..n-1, a few very frequent
+               runs    - ascending runs of GEN_RUN_LENGTH keys
+               few     - GEN_FEW_VALUES distinct keys
+
+   usage:
+     #include "../common/sortKernel.h"
+     fillSortInput(arr, n, parseSortInput("organ"), seed, threads);
+     ... or per block, from the program's own threads:
+     SortInputGen in;
+     sortInputInit(&in, IN_ZIPF, n, seed);
+     sortInputFill(&in, arr, begin, end);
+     sortInputFree(&in);
+     partitionRange(PART_THREEWAY, arr, low, high, &lt, &gt);
+       ... arr[low..lt-1] < pivot == arr[lt..gt] < arr[gt+1..high]
+     serialQuickSort(PART_THREEWAY, arr, 0, n - 1);  // introsort
+     introSortLoop(PART_THREEWAY, arr, low, high, depthLeft);  // part of a bigger sort
+     blockPartitionRange(PART_THREEWAY, arr, low, high, parts, runAllParts, &lt, &gt);
+       ... runAllParts(fn, ctx, parts) calls fn(ctx, part) for every part, in parallel
+*/
+#ifndef SORT_KERNEL_H
+#define SORT_KERNEL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "inputGen.h"
+
+#define NINTHER_CUTOFF 40    /* use the median of three medians above this size */
+#define INSERTION_CUTOFF 24  /* insertion sort ranges up to this size */
+#define BLOCK_MAX_PARTS 64   /* most threads a block partition is split over */
+#define RUNNER_MAX_PARTS 256 /* most parts a PartRunner is asked to run */
+
+typedef enum { PART_LOMUTO, PART_THREEWAY, PART_COUNT } PartitionMode;
+
+static const char *const partitionModeNames[PART_COUNT] = { "lomuto", "3way" };
+
+// the sort algorithms of the programs (-a), see radixSort.h and sampleSort.h
+typedef enum { SORT_QUICK, SORT_RADIX, SORT_SAMPLE, SORT_AUTO, SORT_COUNT } SortAlgo;
+
+static const char *const sortAlgoNames[SORT_COUNT] = { "quick", "radix", "sample", "auto" };
+
+typedef enum {
+    IN_RANDOM, IN_UNIQUE, IN_SORTED, IN_REVERSE, IN_ORGAN, IN_ZIPF, IN_RUNS, IN_FEW, IN_COUNT
+} SortInput;
+
+static const char *const sortInputNames[IN_COUNT] = {
+    "random", "unique", "sorted", "reverse", "organ", "zipf", "runs", "few"
+};
+
+// the usage text of -d
+#define SORT_INPUT_USAGE "[-d random|unique|sorted|reverse|organ|zipf|runs|few]"
+
+// the rows of the -b benchmarks
+typedef struct {
+    SortAlgo algo;
+    PartitionMode mode;
+    const char *name;
+} SortMethod;
+
+#define SORT_METHODS 4
+
+static const SortMethod sortMethods[SORT_METHODS] = {
+    { SORT_QUICK, PART_LOMUTO, "lomuto" },
+    { SORT_QUICK, PART_THREEWAY, "3way" },
+    { SORT_RADIX, PART_THREEWAY, "radix" },
+    { SORT_SAMPLE, PART_THREEWAY, "sample" },
+};
+
+// returns -1 for an unknown name
+static inline int parsePartitionMode(const char *name) {
+    for (int m = 0; m < PART_COUNT; m++)
+        if (strcmp(name, partitionModeNames[m]) == 0)
+            return m;
+    return -1;
+}
+
+// returns -1 for an unknown name
+static inline int parseSortAlgo(const char *name) {
+    for (int a = 0; a < SORT_COUNT; a++)
+        if (strcmp(name, sortAlgoNames[a]) == 0)
+            return a;
+    return -1;
+}
+
+// returns -1 for an unknown name
+static inline int parseSortInput(const char *name) {
+    for (int k = 0; k < IN_COUNT; k++)
+        if (strcmp(name, sortInputNames[k]) == 0)
+            return k;
+    return -1;
+}
+
+// an input of n keys of one kind, ready to be filled block by block
+typedef struct {
+    SortInput kind;
+    int n;
+    GenSpec gen;      // the random kinds
+} SortInputGen;
+
+// Returns 0, or -1 if the generator could not be allocated.
+static inline int sortInputInit(SortInputGen *in, SortInput kind, int n, unsigned long long seed) {
+    in->kind = kind;
+    in->n = n;
+    switch (kind) {
+    case IN_RANDOM: return genInit(&in->gen, DIST_UNIFORM, seed, 1000);
+    case IN_UNIQUE: return genInit(&in->gen, DIST_UNIFORM, seed, 1ULL << 31);
+    case IN_ZIPF:   return genInit(&in->gen, DIST_ZIPF, seed, n);
+    case IN_RUNS:   return genInit(&in->gen, DIST_RUNS, seed, n);
+    case IN_FEW:    return genInit(&in->gen, DIST_FEW, seed, n);
+    default:        return genInit(&in->gen, DIST_UNIFORM, seed, 1);
+    }
+}
+
+static inline void sortInputFree(SortInputGen *in) {
+    genFree(&in->gen);
+}
+
+// arr[i] for begin <= i < end
+static inline void sortInputFill(const SortInputGen *in, int *arr, long long begin, long long end) {
+    int n = in->n;
+    switch (in->kind) {
+    case IN_SORTED:
+        for (long long i = begin; i < end; i++)
+            arr[i] = (int)i;
+        break;
+    case IN_REVERSE:
+        for (long long i = begin; i < end; i++)
+            arr[i] = n - (int)i;
+        break;
+    case IN_ORGAN:
+        for (long long i = begin; i < end; i++)
+            arr[i] = (i < n / 2) ? (int)i : n - (int)i;
+        break;
+    default:
+        genFillInts(&in->gen, arr, begin, end);
+        break;
+    }
+}
+
+typedef struct {
+    const SortInputGen *in;
+    int *arr;
+} SortInputBlock;
+
+static inline void sortInputBlock(void *ctx, long long begin, long long end) {
+    const SortInputBlock *block = ctx;
+    sortInputFill(block->in, block->arr, begin, end);
+}
+
+/* Fill arr[0..n-1] with input kind from seed, on threads threads.
+   Returns 0, or -1 if the generator could not be allocated. */
+static inline int fillSortInput(int *arr, int n, SortInput kind, unsigned long long seed, int threads) {
+    SortInputGen in;
+    if (sortInputInit(&in, kind, n, seed) != 0)
+        return -1;
+    SortInputBlock block = { &in, arr };
+    genRunParallel(n, threads, sortInputBlock, &block);
+    sortInputFree(&in);
+    return 0;
+}
+
+static inline void sortSwap(int *a, int *b) {
+    int tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+// Median-of-three pivot selection, sorts arr[low], arr[mid], arr[high] and returns mid
+static inline int medianOfThree(int *arr, int low, int high) {
+    int mid = low + (high - low) / 2;
+    if (arr[low] > arr[mid])
+        sortSwap(&arr[low], &arr[mid]);
+    if (arr[low] > arr[high])
+        sortSwap(&arr[low], &arr[high]);
+    if (arr[mid] > arr[high])
+        sortSwap(&arr[mid], &arr[high]);
+    return mid;
+}
+
+// index of the median of arr[i], arr[j], arr[k], without moving anything
+static inline int med3Index(const int *arr, int i, int j, int k) {
+    return arr[i] < arr[j] ? (arr[j] < arr[k] ? j : (arr[i] < arr[k] ? k : i))
+                           : (arr[k] < arr[j] ? j : (arr[k] < arr[i] ? k : i));
+}
+
+// Two-way (Lomuto) partition, returns the final index of the pivot
+static inline int partitionLomuto(int *arr, int low, int high) {
+    int pivotIndex = medianOfThree(arr, low, high);
+    sortSwap(&arr[pivotIndex], &arr[high]);  // move pivot to end
+    int pivot = arr[high];
+    int i = low - 1;
+    for (int j = low; j < high; j++) {
+        if (arr[j] < pivot) {
+            i++;
+            sortSwap(&arr[i], &arr[j]);
+        }
+    }
+    sortSwap(&arr[i + 1], &arr[high]);
+    return i + 1;
+}
+
+/* Bentley-McIlroy three-way partition of arr[low..high], low < high.
+   On return arr[low..*lt-1] < pivot, arr[*lt..*gt] == pivot and
+   arr[*gt+1..high] > pivot. */
+static inline void partitionThreeWay(int *arr, int low, int high, int *lt, int *gt) {
+    int n = high - low + 1;
+    int mid = low + n / 2;
+    if (n > NINTHER_CUTOFF) {
+        int s = n / 8;
+        int a = med3Index(arr, low, low + s, low + 2 * s);
+        int b = med3Index(arr, mid - s, mid, mid + s);
+        int c = med3Index(arr, high - 2 * s, high - s, high);
+        mid = med3Index(arr, a, b, c);
+    } else {
+        mid = med3Index(arr, low, mid, high);
+    }
+    sortSwap(&arr[low], &arr[mid]);
+    int pivot = arr[low];
+
+    // arr[low..p] and arr[q..high] hold keys equal to the pivot
+    int i = low, j = high + 1;
+    int p = low, q = high + 1;
+    for (;;) {
+        while (arr[++i] < pivot)
+            if (i == high)
+                break;
+        while (pivot < arr[--j])
+            if (j == low)
+                break;
+        if (i == j && arr[i] == pivot)
+            sortSwap(&arr[++p], &arr[i]);
+        if (i >= j)
+            break;
+        sortSwap(&arr[i], &arr[j]);
+        if (arr[i] == pivot)
+            sortSwap(&arr[++p], &arr[i]);
+        if (arr[j] == pivot)
+            sortSwap(&arr[--q], &arr[j]);
+    }
+
+    // move the equal keys from both ends into the middle
+    i = j + 1;
+    for (int k = low; k <= p; k++)
+        sortSwap(&arr[k], &arr[j--]);
+    for (int k = high; k >= q; k--)
+        sortSwap(&arr[k], &arr[i++]);
+    *lt = j + 1;
+    *gt = i - 1;
+}
+
+/* Partition arr[low..high] (low < high) with the given scheme. Afterwards
+   only arr[low..*lt-1] and arr[*gt+1..high] still need sorting; for the
+   Lomuto scheme *lt == *gt is the pivot. */
+static inline void partitionRange(PartitionMode mode, int *arr, int low, int high, int *lt, int *gt) {
+    if (mode == PART_THREEWAY) {
+        partitionThreeWay(arr, low, high, lt, gt);
+    } else {
+        *lt = *gt = partitionLomuto(arr, low, high);
+    }
+}
+
+/* Insertion sort of arr[low..high]. The minimum is moved to arr[low]
+   first, so the inner loop needs no bounds check. */
+static inline void insertionSort(int *arr, int low, int high) {
+    if (low >= high)
+        return;
+    int min = low;
+    for (int i = low + 1; i <= high; i++)
+        min = (arr[i] < arr[min]) ? i : min;
+    sortSwap(&arr[low], &arr[min]);
+    for (int i = low + 2; i <= high; i++) {
+        int v = arr[i];
+        int j = i;
+        while (v < arr[j - 1]) {
+            arr[j] = arr[j - 1];
+            j--;
+        }
+        arr[j] = v;
+    }
+}
+
+// restore the max-heap property below node of the heap arr[0..n-1]
+static inline void siftDown(int *arr, int node, int n) {
+    int v = arr[node];
+    for (;;) {
+        int child = 2 * node + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && arr[child] < arr[child + 1])
+            child++;
+        if (arr[child] <= v)
+            break;
+        arr[node] = arr[child];
+        node = child;
+    }
+    arr[node] = v;
+}
+
+static inline void heapSort(int *arr, int low, int high) {
+    int *a = arr + low;
+    int n = high - low + 1;
+    for (int node = n / 2 - 1; node >= 0; node--)
+        siftDown(a, node, n);
+    for (int end = n - 1; end > 0; end--) {
+        sortSwap(&a[0], &a[end]);
+        siftDown(a, 0, end);
+    }
+}
+
+static inline void introSortLoop(PartitionMode mode, int *arr, int low, int high, int depthLimit) {
+    while (high - low + 1 > INSERTION_CUTOFF) {
+        if (depthLimit-- == 0) {
+            // the pivots keep being bad, heapsort is O(n log n) whatever the data
+            heapSort(arr, low, high);
+            return;
+        }
+        int lt, gt;
+        partitionRange(mode, arr, low, high, &lt, &gt);
+        // recurse into the smaller side, loop on the larger one
+        if (lt - low < high - gt) {
+            introSortLoop(mode, arr, low, lt - 1, depthLimit);
+            low = gt + 1;
+        } else {
+            introSortLoop(mode, arr, gt + 1, high, depthLimit);
+            high = lt - 1;
+        }
+    }
+    insertionSort(arr, low, high);
+}
+
+// partitioning levels allowed before falling back to heapsort, 2*log2(n)
+static inline int introDepthLimit(int n) {
+    int log2n = 0;
+    for (; n > 1; n >>= 1)
+        log2n++;
+    return 2 * log2n;
+}
+
+// Serial introsort of arr[low..high], the leaf of the parallel sorts
+static inline void serialQuickSort(PartitionMode mode, int *arr, int low, int high) {
+    if (low < high)
+        introSortLoop(mode, arr, low, high, introDepthLimit(high - low + 1));
+}
+
+typedef struct {
+    int begin, end;  // [begin, end)
+} SortInterval;
+
+/* A runner calls fn(ctx, part) for part = 0..parts-1 on as many threads
+   as it has and returns when all of them are done. The drivers provide
+   one on top of their own threads (the pool tasks, omp taskloop). */
+typedef void (*PartFn)(void *ctx, int part);
+typedef void (*PartRunner)(PartFn fn, void *ctx, int parts);
+
+// the runner for a single thread
+static inline void runPartsSerially(PartFn fn, void *ctx, int parts) {
+    for (int part = 0; part < parts; part++)
+        fn(ctx, part);
+}
+
+/* One parallel split of arr[low..high] into the keys below the pivot
+   (< pivot, or <= pivot if inclusive) followed by the rest. */
+typedef struct {
+    int *arr;
+    int low, high;
+    int pivot;
+    int inclusive;
+    int parts;
+    int blockBegin[BLOCK_MAX_PARTS + 1];
+    int belowCount[BLOCK_MAX_PARTS];    // phase 1 result of every block
+    SortInterval stray[BLOCK_MAX_PARTS];   // not below, left of split
+    SortInterval strayBelow[BLOCK_MAX_PARTS];  // below, right of split
+    int numStray, numStrayBelow;
+    long long misplaced;  // elements on the wrong side of split
+    int split;            // first index of the "not below" side
+} BlockPartition;
+
+static inline int blockBelow(const BlockPartition *bp, int x) {
+    return x < bp->pivot || (bp->inclusive && x == bp->pivot);
+}
+
+// phase 1: partition block part in place and count its "below" keys
+static inline void blockPartitionLocal(void *ctx, int part) {
+    BlockPartition *bp = ctx;
+    int *arr = bp->arr;
+    int i = bp->blockBegin[part], j = bp->blockBegin[part + 1] - 1;
+    for (;;) {
+        while (i <= j && blockBelow(bp, arr[i]))
+            i++;
+        while (i <= j && !blockBelow(bp, arr[j]))
+            j--;
+        if (i >= j)
+            break;
+        sortSwap(&arr[i], &arr[j]);
+        i++;
+        j--;
+    }
+    bp->belowCount[part] = i - bp->blockBegin[part];
+}
+
+// between the phases, on one thread: find split and the misplaced runs
+static inline void blockPartitionPlan(BlockPartition *bp) {
+    int split = bp->low;
+    for (int part = 0; part < bp->parts; part++)
+        split += bp->belowCount[part];
+    bp->split = split;
+    bp->numStray = bp->numStrayBelow = 0;
+    bp->misplaced = 0;
+    for (int part = 0; part < bp->parts; part++) {
+        int begin = bp->blockBegin[part], end = bp->blockBegin[part + 1];
+        int mid = begin + bp->belowCount[part];
+        int strayEnd = end < split ? end : split;
+        if (mid < strayEnd) {
+            bp->stray[bp->numStray++] = (SortInterval){ mid, strayEnd };
+            bp->misplaced += strayEnd - mid;
+        }
+        int belowBegin = begin > split ? begin : split;
+        if (belowBegin < mid)
+            bp->strayBelow[bp->numStrayBelow++] = (SortInterval){ belowBegin, mid };
+    }
+}
+
+// phase 2: swap the part-th share of the misplaced pairs
+static inline void blockPartitionSwap(void *ctx, int part) {
+    BlockPartition *bp = ctx;
+    long long k = bp->misplaced * part / bp->parts;
+    long long stop = bp->misplaced * (part + 1) / bp->parts;
+    if (k >= stop)
+        return;
+    // the k-th misplaced element on either side
+    int a = 0, b = 0;
+    long long offA = k, offB = k;
+    while (offA >= bp->stray[a].end - bp->stray[a].begin) {
+        offA -= bp->stray[a].end - bp->stray[a].begin;
+        a++;
+    }
+    while (offB >= bp->strayBelow[b].end - bp->strayBelow[b].begin) {
+        offB -= bp->strayBelow[b].end - bp->strayBelow[b].begin;
+        b++;
+    }
+    int i = bp->stray[a].begin + (int)offA;
+    int j = bp->strayBelow[b].begin + (int)offB;
+    for (; k < stop; k++) {
+        sortSwap(&bp->arr[i++], &bp->arr[j++]);
+        if (i == bp->stray[a].end && k + 1 < stop)
+            i = bp->stray[++a].begin;
+        if (j == bp->strayBelow[b].end && k + 1 < stop)
+            j = bp->strayBelow[++b].begin;
+    }
+}
+
+// split arr[low..high] on pivot with both phases run by run, returns the split index
+static inline int blockSplit(int *arr, int low, int high, int pivot, int inclusive,
+                             int parts, PartRunner run) {
+    BlockPartition bp;
+    bp.arr = arr;
+    bp.low = low;
+    bp.high = high;
+    bp.pivot = pivot;
+    bp.inclusive = inclusive;
+    bp.parts = parts;
+    long long n = high - low + 1;
+    for (int part = 0; part <= parts; part++)
+        bp.blockBegin[part] = low + (int)(n * part / parts);
+    run(blockPartitionLocal, &bp, parts);
+    blockPartitionPlan(&bp);
+    run(blockPartitionSwap, &bp, parts);
+    return bp.split;
+}
+
+/* Parallel partitionRange for large ranges, parts threads take part
+   through run. For 3way the keys equal to the pivot are split off by a
+   second pass over the upper side; for lomuto the pivot is parked at
+   high and swapped into place, so *lt == *gt as in partitionLomuto. */
+static inline void blockPartitionRange(PartitionMode mode, int *arr, int low, int high,
+                                       int parts, PartRunner run, int *lt, int *gt) {
+    if (parts > BLOCK_MAX_PARTS)
+        parts = BLOCK_MAX_PARTS;
+    int n = high - low + 1;
+    int mid = low + n / 2, s = n / 8;
+    int a = med3Index(arr, low, low + s, low + 2 * s);
+    int b = med3Index(arr, mid - s, mid, mid + s);
+    int c = med3Index(arr, high - 2 * s, high - s, high);
+    int pivotIndex = med3Index(arr, a, b, c);
+    int pivot = arr[pivotIndex];
+
+    if (mode == PART_THREEWAY) {
+        *lt = blockSplit(arr, low, high, pivot, 0, parts, run);
+        *gt = blockSplit(arr, *lt, high, pivot, 1, parts, run) - 1;
+    } else {
+        sortSwap(&arr[pivotIndex], &arr[high]);
+        int split = blockSplit(arr, low, high - 1, pivot, 0, parts, run);
+        sortSwap(&arr[split], &arr[high]);
+        *lt = *gt = split;
+    }
+}
+
+#endif /* SORT_KERNEL_H */
@@ -0,0 +1,252 @@
+/* out-of-core matrix reduction: a matrix file streamed through a few buffers
+
+   features: for files of the binaryFile.h format that do not fit in
+             memory. A reader thread preads blocks of rows (about
+             STREAM_BLOCK_BYTES each) into a ring of STREAM_BUFFERS
+             buffers while the workers reduce the blocks before them,
+             so with three buffers one block is read while the next
+             waits and one is reduced, and the disk never waits for the
+             CPUs unless they are slower. Every worker takes its strip of
+             each block (the strips of matrixSumA.c), swaps the byte
+             order if the file needs it, and merges the block into its
+             own MatrixStats with the rows moved to their place in the
+             file; the workers' stats are merged pairwise as they
+             finish (reduceCombiner.h), so the result is the same as
+             for the whole matrix in memory.
+             The reader tells the kernel the file is read sequentially
+             and drops every block from the page cache once it is
+             read, so a file larger than RAM does not push everything
+             else out (and repeated runs measure the disk, not the
+             cache). StreamInfo says where the time went: the reader
+             busy in pread, the workers waiting for data.
+
+   usage:
+     #include "../common/streamReduce.h"
+     MatrixStats stats;
+     StreamInfo info;
+     if (streamReduce("big.bin", numWorkers, STREAM_BLOCK_BYTES, &stats, &info, &perf, &run) != 0) ...
+     ... perf and run may be NULL; with them every worker counts into its slot of perf
+*/
+#ifndef STREAM_REDUCE_H
+#define STREAM_REDUCE_H
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "benchHarness.h"
+#include "binaryFile.h"
+#include "matrixKernel.h"
+#include "matrixStorage.h"
+#include "perfCounters.h"
+#include "reduceCombiner.h"
+
+#define STREAM_BUFFERS 3                 /* one read, one waiting, one reduced */
+#define STREAM_BLOCK_BYTES (16UL << 20)  /* default size of a block */
+
+typedef struct {
+    MatrixType type;
+    int rows, cols;
+    int blockRows;       // rows per block
+    long long bytes;     // data read
+    double readSeconds;  // the reader busy in pread
+    double waitSeconds;  // the longest any worker waited for a block
+} StreamInfo;
+
+typedef struct {
+    Matrix rows;         // blockRows rows
+    int firstRow;        // of the block in the file
+    int count;           // rows in the block, the last one may be short
+    int pending;         // workers still reducing it
+} StreamBuffer;
+
+typedef struct {
+    int fd;
+    int swapped;
+    StreamInfo *info;
+    int numWorkers;
+    long long numBlocks;
+    StreamBuffer buffers[STREAM_BUFFERS];
+    long long filled;    // blocks read so far
+    long long freed;     // blocks all workers are done with
+    int failed;          // a read failed, everybody stops
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    ReduceCombiner stats;  // a MatrixStats per worker
+    double *waited;      // per worker
+    PerfCounters *perf;
+    const BenchRun *run;
+} StreamState;
+
+typedef struct {
+    StreamState *state;
+    int worker;
+} StreamWorkerArg;
+
+static inline void *streamReader(void *arg) {
+    StreamState *st = arg;
+    StreamInfo *info = st->info;
+    size_t rowBytes = (size_t)info->cols * matrixTypeSizes[info->type];
+    for (long long b = 0; b < st->numBlocks; b++) {
+        StreamBuffer *buf = &st->buffers[b % STREAM_BUFFERS];
+        pthread_mutex_lock(&st->lock);
+        while (b - st->freed >= STREAM_BUFFERS && !st->failed)
+            pthread_cond_wait(&st->changed, &st->lock);
+        int stop = st->failed;
+        pthread_mutex_unlock(&st->lock);
+        if (stop)
+            return NULL;
+
+        buf->firstRow = (int)(b * info->blockRows);
+        buf->count = info->rows - buf->firstRow < info->blockRows ? info->rows - buf->firstRow : info->blockRows;
+        off_t offset = BIN_HEADER_BYTES + (off_t)buf->firstRow * rowBytes;
+        size_t bytes = (size_t)buf->count * rowBytes;
+        double started = benchNow();
+        int error = binReadAt(st->fd, buf->rows.data, bytes, offset);
+        info->readSeconds += benchNow() - started;
+        posix_fadvise(st->fd, offset, bytes, POSIX_FADV_DONTNEED);
+
+        pthread_mutex_lock(&st->lock);
+        if (error) {
+            st->failed = 1;
+        } else {
+            buf->pending = st->numWorkers;
+            st->filled = b + 1;
+            info->bytes += bytes;
+        }
+        pthread_cond_broadcast(&st->changed);
+        pthread_mutex_unlock(&st->lock);
+        if (error)
+            return NULL;
+    }
+    return NULL;
+}
+
+static inline void *streamWorker(void *arg) {
+    StreamWorkerArg *wa = arg;
+    StreamState *st = wa->state;
+    int w = wa->worker;
+    PerfThread counters;
+    if (st->perf) {
+        perfThreadOpen(st->perf, &counters, 0);
+        perfThreadStart(&counters);
+    }
+    for (long long b = 0; b < st->numBlocks; b++) {
+        StreamBuffer *buf = &st->buffers[b % STREAM_BUFFERS];
+        double started = benchNow();
+        pthread_mutex_lock(&st->lock);
+        while (st->filled <= b && !st->failed)
+            pthread_cond_wait(&st->changed, &st->lock);
+        int stop = st->failed;
+        pthread_mutex_unlock(&st->lock);
+        st->waited[w] += benchNow() - started;
+        if (stop)
+            break;
+
+        // my strip of the block
+        int stripSize = buf->count / st->numWorkers;
+        int first = w * stripSize;
+        int last = (w == st->numWorkers - 1) ? buf->count - 1 : first + stripSize - 1;
+        if (first <= last) {
+            MatrixStats local;
+            if (st->swapped)
+                binSwapElements(matrixRow(&buf->rows, first), (size_t)(last - first + 1) * buf->rows.cols,
+                                buf->rows.elemSize);
+            initStats(&local, buf->rows.type);
+            reduceRows(&buf->rows, first, last, &local);
+            local.min_row += local.min_row >= 0 ? buf->firstRow : 0;
+            local.max_row += local.max_row >= 0 ? buf->firstRow : 0;
+            mergeStats(combinerSlot(&st->stats, w), &local);
+        }
+
+        pthread_mutex_lock(&st->lock);
+        if (--buf->pending == 0) {
+            st->freed = b + 1;
+            pthread_cond_broadcast(&st->changed);
+        }
+        pthread_mutex_unlock(&st->lock);
+    }
+    combinerArrive(&st->stats, w);
+    if (st->perf) {
+        perfThreadStop(st->perf, &counters, w, st->run);
+        perfThreadClose(&counters);
+    }
+    return NULL;
+}
+
+/* Reduce the matrix file at path with numWorkers workers, reading blocks
+   of about blockBytes. stats is initialized here. Returns 0, or -1 after
+   printing what went wrong. */
+static inline int streamReduce(const char *path, int numWorkers, size_t blockBytes, MatrixStats *stats,
+                               StreamInfo *info, PerfCounters *perf, const BenchRun *run) {
+    StreamState st;
+    BinHeader h;
+    memset(&st, 0, sizeof(st));
+    memset(info, 0, sizeof(*info));
+    st.fd = open(path, O_RDONLY);
+    if (st.fd < 0)
+        return binError(path, strerror(errno));
+    if (binReadHeader(st.fd, path, &h, &st.swapped) != 0) {
+        close(st.fd);
+        return -1;
+    }
+    posix_fadvise(st.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    info->type = (MatrixType)h.type;
+    info->rows = (int)h.rows;
+    info->cols = (int)h.cols;
+    size_t rowBytes = (size_t)info->cols * matrixTypeSizes[info->type];
+    long long blockRows = (long long)(blockBytes / rowBytes);
+    info->blockRows = blockRows < 1 ? 1 : blockRows > info->rows ? info->rows : (int)blockRows;
+    st.info = info;
+    st.numWorkers = numWorkers > 0 ? numWorkers : 1;
+    st.numBlocks = (info->rows + info->blockRows - 1) / info->blockRows;
+    st.perf = perf;
+    st.run = run;
+    initStats(stats, info->type);
+
+    int ok = 1, numBuffers = 0, result = -1;
+    for (; numBuffers < STREAM_BUFFERS && ok; numBuffers++)
+        ok = allocMatrix(&st.buffers[numBuffers].rows, info->blockRows, info->cols, info->type) == 0;
+    int statsOk = combinerInit(&st.stats, st.numWorkers, sizeof(MatrixStats), combineStats) == 0;
+    st.waited = calloc(st.numWorkers, sizeof(double));
+    pthread_t *threads = malloc(sizeof(pthread_t) * (st.numWorkers + 1));
+    StreamWorkerArg *args = malloc(sizeof(StreamWorkerArg) * st.numWorkers);
+    if (!ok || !statsOk || !st.waited || !threads || !args) {
+        fprintf(stderr, "%s: cannot allocate %d buffers of %d rows\n", path, STREAM_BUFFERS, info->blockRows);
+    } else {
+        pthread_mutex_init(&st.lock, NULL);
+        pthread_cond_init(&st.changed, NULL);
+        for (int w = 0; w < st.numWorkers; w++) {
+            initStats(combinerSlot(&st.stats, w), info->type);
+            args[w] = (StreamWorkerArg){ &st, w };
+            pthread_create(&threads[w], NULL, streamWorker, &args[w]);
+        }
+        pthread_create(&threads[st.numWorkers], NULL, streamReader, &st);
+        for (int t = 0; t <= st.numWorkers; t++)
+            pthread_join(threads[t], NULL);
+        *stats = *(MatrixStats *)combinerResult(&st.stats);
+        for (int w = 0; w < st.numWorkers; w++) {
+            info->waitSeconds = st.waited[w] > info->waitSeconds ? st.waited[w] : info->waitSeconds;
+        }
+        pthread_mutex_destroy(&st.lock);
+        pthread_cond_destroy(&st.changed);
+        if (st.failed)
+            binError(path, "read failed");
+        else
+            result = 0;
+    }
+
+    for (int k = 0; k < numBuffers; k++)
+        if (st.buffers[k].rows.data)
+            freeMatrix(&st.buffers[k].rows);
+    if (statsOk)
+        combinerDestroy(&st.stats);
+    free(st.waited);
+    free(threads);
+    free(args);
+    close(st.fd);
+    return result;
+}
+
+#endif /* STREAM_REDUCE_H */
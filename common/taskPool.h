@@ -0,0 +1,285 @@
+/* fixed-size work-stealing thread pool for recursive (fork/join) work
+
+   features: numWorkers threads are created once (the thread that calls
+             poolRun is worker 0), every worker has its own lock-free
+             Chase-Lev deque: it pushes and pops its own tasks at the
+             bottom and idle workers steal from the top. A worker that
+             waits for a task it spawned runs other tasks meanwhile, so
+             nobody blocks and no more than numWorkers threads ever run.
+             Task descriptors come from a per-worker free list and go
+             back to it after the join, so the hot path never mallocs.
+             poolThreadId gives the kernel thread id of every worker,
+             e.g. to attach per thread counters to them from outside.
+
+   usage:
+     #include "../common/taskPool.h"
+     void sortTask(void *arg, int low, int high) {
+         ...
+         Task *left = poolSpawn(sortTask, arg, low, mid - 1);
+         sortTask(arg, mid + 1, high);
+         poolWait(left);
+     }
+     poolInit(&pool, numWorkers);
+     poolRun(&pool, sortTask, array, 0, n - 1);
+     poolDestroy(&pool);
+*/
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define POOL_DEQUE_SIZE 1024  /* tasks a worker can have queued, a power of 2 */
+#define POOL_SLAB_SIZE 64     /* task descriptors allocated at once */
+
+typedef void (*TaskFn)(void *arg, int low, int high);
+
+typedef struct Task {
+    TaskFn fn;
+    void *arg;
+    int low;
+    int high;
+    atomic_int done;
+    struct Task *next;  // free list link
+} Task;
+
+typedef struct TaskSlab {
+    struct TaskSlab *next;
+    Task tasks[POOL_SLAB_SIZE];
+} TaskSlab;
+
+typedef struct {
+    _Alignas(64) atomic_long top;     // thieves take from here
+    _Alignas(64) atomic_long bottom;  // the owner pushes and pops here
+    _Atomic(Task *) buf[POOL_DEQUE_SIZE];
+    Task *freeList;                   // only touched by the owner
+    TaskSlab *slabs;
+    unsigned seed;                    // for picking victims
+    atomic_int tid;                   // kernel thread id, 0 until the thread runs
+} PoolWorker;
+
+typedef struct {
+    int numWorkers;
+    PoolWorker *workers;
+    pthread_t *threads;
+    pthread_mutex_t mutex;  // protects active/shutdown for sleeping workers
+    pthread_cond_t wake;
+    atomic_int active;      // 1 while poolRun is running
+    int shutdown;
+} TaskPool;
+
+typedef struct {
+    TaskPool *pool;
+    int id;
+} PoolSelf;
+
+static __thread PoolSelf poolSelf;
+
+static inline int dequePush(PoolWorker *w, Task *t) {
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&w->top, memory_order_acquire);
+    if (b - top >= POOL_DEQUE_SIZE)
+        return 0;
+    atomic_store_explicit(&w->buf[b & (POOL_DEQUE_SIZE - 1)], t, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+    return 1;
+}
+
+static inline Task *dequePop(PoolWorker *w) {
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&w->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&w->top, memory_order_relaxed);
+    Task *t = NULL;
+    if (top <= b) {
+        t = atomic_load_explicit(&w->buf[b & (POOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (top == b) {
+            // last task: race the thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&w->top, &top, top + 1,
+                                                         memory_order_seq_cst, memory_order_relaxed))
+                t = NULL;
+            atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+    }
+    return t;
+}
+
+static inline Task *dequeSteal(PoolWorker *w) {
+    long top = atomic_load_explicit(&w->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+    if (top >= b)
+        return NULL;
+    Task *t = atomic_load_explicit(&w->buf[top & (POOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&w->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return t;
+}
+
+static inline void runTask(Task *t) {
+    t->fn(t->arg, t->low, t->high);
+    atomic_store_explicit(&t->done, 1, memory_order_release);
+}
+
+// Try to steal one task from a random other worker and run it.
+static inline int poolStealAndRun(TaskPool *pool, int self) {
+    PoolWorker *me = &pool->workers[self];
+    for (int k = 0; k < pool->numWorkers; k++) {
+        int victim = (int)(rand_r(&me->seed) % pool->numWorkers);
+        if (victim == self)
+            continue;
+        Task *t = dequeSteal(&pool->workers[victim]);
+        if (t) {
+            runTask(t);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *poolWorkerMain(void *arg) {
+    poolSelf = *(PoolSelf *)arg;
+    free(arg);
+    TaskPool *pool = poolSelf.pool;
+    atomic_store(&pool->workers[poolSelf.id].tid, (int)syscall(SYS_gettid));
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!atomic_load(&pool->active) && !pool->shutdown)
+            pthread_cond_wait(&pool->wake, &pool->mutex);
+        int stop = pool->shutdown;
+        pthread_mutex_unlock(&pool->mutex);
+        if (stop)
+            return NULL;
+        while (atomic_load_explicit(&pool->active, memory_order_acquire))
+            if (!poolStealAndRun(pool, poolSelf.id))
+                sched_yield();
+    }
+}
+
+static inline void poolInit(TaskPool *pool, int numWorkers) {
+    pool->numWorkers = numWorkers > 0 ? numWorkers : 1;
+    pool->workers = aligned_alloc(64, sizeof(PoolWorker) * pool->numWorkers);
+    pool->threads = malloc(sizeof(pthread_t) * pool->numWorkers);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    atomic_init(&pool->active, 0);
+    pool->shutdown = 0;
+    for (int w = 0; w < pool->numWorkers; w++) {
+        PoolWorker *worker = &pool->workers[w];
+        atomic_init(&worker->top, 0);
+        atomic_init(&worker->bottom, 0);
+        worker->freeList = NULL;
+        worker->slabs = NULL;
+        worker->seed = 12345u + w;
+        atomic_init(&worker->tid, 0);
+    }
+    atomic_store(&pool->workers[0].tid, (int)syscall(SYS_gettid));
+    // worker 0 is whoever calls poolRun
+    for (int w = 1; w < pool->numWorkers; w++) {
+        PoolSelf *self = malloc(sizeof(PoolSelf));
+        self->pool = pool;
+        self->id = w;
+        pthread_create(&pool->threads[w], NULL, poolWorkerMain, self);
+    }
+}
+
+static inline void poolDestroy(TaskPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int w = 1; w < pool->numWorkers; w++)
+        pthread_join(pool->threads[w], NULL);
+    for (int w = 0; w < pool->numWorkers; w++) {
+        TaskSlab *slab = pool->workers[w].slabs;
+        while (slab) {
+            TaskSlab *next = slab->next;
+            free(slab);
+            slab = next;
+        }
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->workers);
+    free(pool->threads);
+}
+
+/* The kernel thread id of worker w, waiting for its thread to start.
+   Worker 0 is the thread that called poolInit, which should also be the
+   one that calls poolRun. */
+static inline pid_t poolThreadId(TaskPool *pool, int w) {
+    int tid;
+    while ((tid = atomic_load(&pool->workers[w].tid)) == 0)
+        sched_yield();
+    return (pid_t)tid;
+}
+
+/* Queue fn(arg, low, high) on the calling worker. Must be called from
+   inside poolRun, and every spawned task must be passed to poolWait. */
+static inline Task *poolSpawn(TaskFn fn, void *arg, int low, int high) {
+    PoolWorker *me = &poolSelf.pool->workers[poolSelf.id];
+    if (!me->freeList) {
+        TaskSlab *slab = malloc(sizeof(TaskSlab));
+        slab->next = me->slabs;
+        me->slabs = slab;
+        for (int k = 0; k < POOL_SLAB_SIZE; k++) {
+            slab->tasks[k].next = me->freeList;
+            me->freeList = &slab->tasks[k];
+        }
+    }
+    Task *t = me->freeList;
+    me->freeList = t->next;
+    t->fn = fn;
+    t->arg = arg;
+    t->low = low;
+    t->high = high;
+    atomic_store_explicit(&t->done, 0, memory_order_relaxed);
+    if (!dequePush(me, t))
+        runTask(t);  // deque full: just do it now
+    return t;
+}
+
+/* Wait for a task from poolSpawn, running other tasks meanwhile, and
+   give its descriptor back to the free list. */
+static inline void poolWait(Task *t) {
+    TaskPool *pool = poolSelf.pool;
+    PoolWorker *me = &pool->workers[poolSelf.id];
+    while (!atomic_load_explicit(&t->done, memory_order_acquire)) {
+        // our own newest tasks first (usually t itself), then steal
+        Task *mine = dequePop(me);
+        if (mine)
+            runTask(mine);
+        else if (!poolStealAndRun(pool, poolSelf.id))
+            sched_yield();
+    }
+    t->next = me->freeList;
+    me->freeList = t;
+}
+
+/* Run fn(arg, low, high) on the pool, the caller takes part as worker 0.
+   Returns when fn and everything it spawned have finished. */
+static inline void poolRun(TaskPool *pool, TaskFn fn, void *arg, int low, int high) {
+    PoolSelf saved = poolSelf;
+    poolSelf.pool = pool;
+    poolSelf.id = 0;
+    pthread_mutex_lock(&pool->mutex);
+    atomic_store(&pool->active, 1);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    fn(arg, low, high);
+
+    atomic_store_explicit(&pool->active, 0, memory_order_release);
+    poolSelf = saved;
+}
+
+#endif /* TASK_POOL_H */
@@ -0,0 +1,196 @@
+/* where the worker threads run and where their memory lives
+
+   features: pinning policies for the workers (-a):
+               none    - leave it to the scheduler
+               compact - worker k on the k-th allowed CPU, so the
+                         workers fill one socket (NUMA node) first
+               scatter - workers go round robin over the NUMA nodes,
+                         so two workers already use both memory buses
+             the CPUs come from the affinity mask the program was
+             started with (taskset, cgroups) and their node from
+             /sys/devices/system/cpu; without that everything is node 0.
+             With first touch (-f) every worker writes the rows it will
+             reduce first, so the kernel puts those pages on the
+             worker's node. firstTouchStrips does that for the pthread
+             programs, with the strips of matrixSumA.c (and of
+             rowScheduler.h), and fills the strips with their values
+             right away when given a fill function (see inputGen.h).
+             placementReport prints the CPU (and node) every worker
+             last ran on.
+
+   usage (the program needs _GNU_SOURCE defined before its first #include):
+     #include "../common/threadPlacement.h"
+     int policy = parsePinPolicy("scatter");
+     firstTouchStrips(&matrix, numWorkers, policy, NULL, NULL);   // zeros, fill later
+     firstTouchStrips(&matrix, numWorkers, policy, genMatrixRows, &fill);
+     pinWorker(policy, myid);                 // in worker myid
+     workerCpus[myid] = sched_getcpu();
+     placementReport(workerCpus, numWorkers);
+*/
+#ifndef THREAD_PLACEMENT_H
+#define THREAD_PLACEMENT_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrixStorage.h"
+
+typedef enum { PIN_NONE, PIN_COMPACT, PIN_SCATTER, PIN_COUNT } PinPolicy;
+
+static const char *const pinPolicyNames[PIN_COUNT] = { "none", "compact", "scatter" };
+
+// returns -1 for an unknown name
+static inline int parsePinPolicy(const char *name) {
+    for (int p = 0; p < PIN_COUNT; p++)
+        if (strcmp(name, pinPolicyNames[p]) == 0)
+            return p;
+    return -1;
+}
+
+// the NUMA node of cpu, from the nodeN link in its sysfs directory (0 if unknown)
+static inline int cpuNode(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+typedef struct {
+    int numCpus;
+    int cpus[CPU_SETSIZE];   // the allowed CPUs in pinning order
+} PinOrder;
+
+static PinOrder pinOrders[PIN_COUNT];
+static pthread_once_t pinOrdersOnce = PTHREAD_ONCE_INIT;
+
+// Work out the compact and scatter orders once, from the startup affinity mask.
+static inline void pinOrdersInit(void) {
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], nodes[CPU_SETSIZE], n = 0, maxNode = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[n] = cpu;
+            nodes[n] = cpuNode(cpu);
+            maxNode = nodes[n] > maxNode ? nodes[n] : maxNode;
+            n++;
+        }
+    }
+    // compact: node by node, in CPU order within a node
+    PinOrder *compact = &pinOrders[PIN_COMPACT];
+    compact->numCpus = 0;
+    for (int node = 0; node <= maxNode; node++)
+        for (int k = 0; k < n; k++)
+            if (nodes[k] == node)
+                compact->cpus[compact->numCpus++] = cpus[k];
+    // scatter: the i-th CPU of every node before the (i+1)-th of any
+    PinOrder *scatter = &pinOrders[PIN_SCATTER];
+    scatter->numCpus = 0;
+    for (int round = 0; scatter->numCpus < n; round++) {
+        for (int node = 0; node <= maxNode; node++) {
+            int seen = 0;
+            for (int k = 0; k < n; k++) {
+                if (nodes[k] == node && seen++ == round) {
+                    scatter->cpus[scatter->numCpus++] = cpus[k];
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// the CPU worker is pinned to under policy, -1 for none
+static inline int pinCpu(PinPolicy policy, int worker) {
+    if (policy == PIN_NONE)
+        return -1;
+    pthread_once(&pinOrdersOnce, pinOrdersInit);
+    const PinOrder *order = &pinOrders[policy];
+    if (order->numCpus == 0)
+        return -1;
+    return order->cpus[worker % order->numCpus];
+}
+
+/* Pin the calling thread, worker number worker, as policy says.
+   Returns the CPU, or -1 if it was left alone or pinning failed. */
+static inline int pinWorker(PinPolicy policy, int worker) {
+    int cpu = pinCpu(policy, worker);
+    if (cpu < 0)
+        return -1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? cpu : -1;
+}
+
+// writes rows first..last of the matrix ctx refers to
+typedef void (*StripFill)(void *ctx, int first, int last);
+
+typedef struct {
+    Matrix *matrix;
+    int worker, numWorkers;
+    PinPolicy policy;
+    StripFill fill;
+    void *ctx;
+} FirstTouch;
+
+static inline void *firstTouchWorker(void *arg) {
+    FirstTouch *ft = arg;
+    int stripSize = ft->matrix->rows / ft->numWorkers;
+    int first = ft->worker * stripSize;
+    int last = (ft->worker == ft->numWorkers - 1) ? ft->matrix->rows - 1 : first + stripSize - 1;
+    pinWorker(ft->policy, ft->worker);
+    if (ft->fill)
+        ft->fill(ft->ctx, first, last);
+    else
+        matrixTouchRows(ft->matrix, first, last);
+    return NULL;
+}
+
+/* Let worker w (pinned like the real worker w) write strip w of the
+   matrix first, so its pages end up on that worker's NUMA node. It
+   writes the values fill(ctx, first, last) gives, zeros without fill. */
+static inline void firstTouchStrips(Matrix *matrix, int numWorkers, PinPolicy policy,
+                                    StripFill fill, void *ctx) {
+    pthread_t *threads = malloc(sizeof(pthread_t) * numWorkers);
+    FirstTouch *args = malloc(sizeof(FirstTouch) * numWorkers);
+    for (int w = 0; w < numWorkers; w++) {
+        args[w] = (FirstTouch){ matrix, w, numWorkers, policy, fill, ctx };
+        pthread_create(&threads[w], NULL, firstTouchWorker, &args[w]);
+    }
+    for (int w = 0; w < numWorkers; w++)
+        pthread_join(threads[w], NULL);
+    free(threads);
+    free(args);
+}
+
+// print "workers on cpu: 0:cpu(node) 1:cpu(node) ..." for the CPUs the workers last ran on
+static inline void placementReport(const int *workerCpus, int numWorkers) {
+    printf("workers on cpu:");
+    for (int w = 0; w < numWorkers; w++) {
+        if (workerCpus[w] >= 0)
+            printf(" %d:%d(node %d)", w, workerCpus[w], cpuNode(workerCpus[w]));
+        else
+            printf(" %d:?", w);
+    }
+    printf("\n");
+}
+
+#endif /* THREAD_PLACEMENT_H */
@@ -0,0 +1,314 @@
+/* cache-blocked matrix traversal: global, row, column and tile stats in one pass
+
+   features: the matrix is cut into tiles of tileRows x tileCols and
+             every worker walks the tiles of its band (whole rows of
+             tiles, so the bands are the strips of matrixSumA.c rounded
+             to tiles), tile by tile and row by row within a tile. One
+             pass yields the sum, min and max (with the first position)
+             of every row, every column, every tile and the matrix:
+               rows    - a row belongs to one band, it is finished
+                         segment by segment in registers
+               tiles   - likewise, one worker each
+               matrix  - the rows of every band, the bands merged by
+                         ../common/reduceCombiner.h as they finish
+               columns - every worker keeps its own accumulators for all
+                         columns (sum, min, max and their rows, one array
+                         each), tileCols of them are in use while a tile
+                         is walked, so they stay in L1 instead of striding
+                         through the matrix column by column. They are
+                         merged at the end, every worker a range of the
+                         columns, in band order so ties still go to the
+                         first position.
+             The tile size is tunable (-T RxC); by default tileCols is
+             picked so the column accumulators of a tile fill half of L1
+             and tileRows so a tile fills half of L2 (but every worker
+             still gets a band), from the cache sizes sysconf reports
+             (32KB/1MB if it does not know).
+
+   usage:
+     #include "../common/tileStats.h"
+     TileStats ts;
+     if (tileStatsInit(&ts, &matrix, tileRows, tileCols, numWorkers) != 0) ...  // 0 sizes: auto
+     tileStatsBand(&ts, &matrix, w, numWorkers);         // in every worker w
+     ... barrier
+     tileStatsColumns(&ts, w, numWorkers);               // in every worker w
+     ... barrier                                         // ts.global, ts.rowStats[i], ts.colStats[j],
+                                                         // ts.tileStats[ti * ts.gridCols + tj]
+     tileStatsFree(&ts);
+*/
+#ifndef TILE_STATS_H
+#define TILE_STATS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "matrixKernel.h"
+#include "matrixStorage.h"
+#include "reduceCombiner.h"
+
+#define TILE_L1_DEFAULT (32 * 1024)    /* L1d bytes if sysconf does not know */
+#define TILE_L2_DEFAULT (1024 * 1024)  /* L2 bytes likewise */
+#define TILE_COL_STEP 64               /* tileCols is a multiple of this (a cache line of int8) */
+#define TILE_ROW_STEP 8
+
+// the column accumulators of one worker, one array per field
+typedef struct {
+    MatrixValue *sum;
+    void *min, *max;     // element type
+    int *minRow, *maxRow;  // -1 before the first value
+} TileColumns;
+
+typedef struct {
+    int tileRows, tileCols;  // elements per tile
+    int gridRows, gridCols;  // tiles down and across
+    MatrixType type;
+    int rows, cols;
+    MatrixStats global;      // once every tileStatsBand is done
+    MatrixStats *rowStats;   // rows
+    MatrixStats *colStats;   // cols
+    MatrixStats *tileStats;  // gridRows x gridCols, row-major
+    int numWorkers;
+    TileColumns *partials;   // per worker
+    ReduceCombiner bands;    // the stats of every band
+} TileStats;
+
+static inline long tileCacheSize(int name, long fallback) {
+    long bytes = sysconf(name);
+    return bytes > 0 ? bytes : fallback;
+}
+
+/* Tile size for matrices of type with cols columns: the column
+   accumulators of a tile (a sum, min, max and two rows per column) in
+   half of L1, the tile itself in half of L2. */
+static inline void tileAutoSize(MatrixType type, int cols, int *tileRows, int *tileCols) {
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    long l1 = tileCacheSize(_SC_LEVEL1_DCACHE_SIZE, TILE_L1_DEFAULT);
+    long l2 = tileCacheSize(_SC_LEVEL2_CACHE_SIZE, TILE_L2_DEFAULT);
+#else
+    long l1 = TILE_L1_DEFAULT, l2 = TILE_L2_DEFAULT;
+#endif
+    long elem = (long)matrixTypeSizes[type];
+    long w = l1 / 2 / (long)(sizeof(MatrixValue) + 2 * elem + 2 * sizeof(int));
+    w = w / TILE_COL_STEP * TILE_COL_STEP;
+    w = w < TILE_COL_STEP ? TILE_COL_STEP : w;
+    w = w > cols ? cols : w;
+    long h = l2 / 2 / (w * elem);
+    h = h / TILE_ROW_STEP * TILE_ROW_STEP;
+    *tileCols = (int)w;
+    *tileRows = (int)(h < TILE_ROW_STEP ? TILE_ROW_STEP : h);
+}
+
+/* Set up ts for matrix m and numWorkers workers; tileRows or tileCols of
+   0 are picked by tileAutoSize. Returns 0, or -1 if out of memory. */
+static inline int tileStatsInit(TileStats *ts, const Matrix *m, int tileRows, int tileCols, int numWorkers) {
+    int autoRows, autoCols;
+    memset(ts, 0, sizeof(*ts));
+    tileAutoSize(m->type, m->cols, &autoRows, &autoCols);
+    if (tileRows <= 0) {
+        // no taller than a worker's share of the rows, so every worker has a band
+        int share = (m->rows + numWorkers - 1) / numWorkers;
+        tileRows = autoRows < share ? autoRows : share;
+    }
+    ts->tileRows = tileRows < m->rows ? tileRows : m->rows;
+    ts->tileCols = tileCols > 0 ? (tileCols < m->cols ? tileCols : m->cols) : autoCols;
+    ts->gridRows = (m->rows + ts->tileRows - 1) / ts->tileRows;
+    ts->gridCols = (m->cols + ts->tileCols - 1) / ts->tileCols;
+    ts->type = m->type;
+    ts->rows = m->rows;
+    ts->cols = m->cols;
+    ts->numWorkers = numWorkers;
+    ts->rowStats = malloc(sizeof(MatrixStats) * m->rows);
+    ts->colStats = malloc(sizeof(MatrixStats) * m->cols);
+    ts->tileStats = malloc(sizeof(MatrixStats) * ts->gridRows * ts->gridCols);
+    ts->partials = calloc(numWorkers, sizeof(TileColumns));
+    if (!ts->rowStats || !ts->colStats || !ts->tileStats || !ts->partials ||
+        combinerInit(&ts->bands, numWorkers, sizeof(MatrixStats), combineStats) != 0)
+        return -1;
+    size_t n = (size_t)m->cols;
+    for (int w = 0; w < numWorkers; w++) {
+        // every array of every worker on its own cache lines
+        TileColumns *p = &ts->partials[w];
+        size_t valueBytes = (n * m->elemSize + MATRIX_ALIGN - 1) & ~(size_t)(MATRIX_ALIGN - 1);
+        size_t rowBytes = (n * sizeof(int) + MATRIX_ALIGN - 1) & ~(size_t)(MATRIX_ALIGN - 1);
+        size_t sumBytes = (n * sizeof(MatrixValue) + MATRIX_ALIGN - 1) & ~(size_t)(MATRIX_ALIGN - 1);
+        p->sum = aligned_alloc(MATRIX_ALIGN, sumBytes);
+        p->min = aligned_alloc(MATRIX_ALIGN, valueBytes);
+        p->max = aligned_alloc(MATRIX_ALIGN, valueBytes);
+        p->minRow = aligned_alloc(MATRIX_ALIGN, rowBytes);
+        p->maxRow = aligned_alloc(MATRIX_ALIGN, rowBytes);
+        if (!p->sum || !p->min || !p->max || !p->minRow || !p->maxRow)
+            return -1;
+    }
+    return 0;
+}
+
+static inline void tileStatsFree(TileStats *ts) {
+    for (int w = 0; ts->partials && w < ts->numWorkers; w++) {
+        free(ts->partials[w].sum);
+        free(ts->partials[w].min);
+        free(ts->partials[w].max);
+        free(ts->partials[w].minRow);
+        free(ts->partials[w].maxRow);
+    }
+    free(ts->partials);
+    combinerDestroy(&ts->bands);
+    free(ts->rowStats);
+    free(ts->colStats);
+    free(ts->tileStats);
+    memset(ts, 0, sizeof(*ts));
+}
+
+/* The kernel of one tile for elements of type T (ACC sums, FIELD of
+   MatrixValue): rows firstRow..lastRow, columns firstCol..lastCol. Every
+   row segment is reduced in registers and merged into its row and the
+   tile; a new extreme of either needs its column, found by a second look
+   at the segment, which is rare. The column updates are branch free. */
+#define DEFINE_TILE_KERNEL(NAME, T, ACC, FIELD)                                           \
+static void NAME(const Matrix *m, int firstRow, int lastRow, int firstCol, int lastCol,  \
+                 TileColumns *cols, MatrixStats *rowStats, MatrixStats *tile) {           \
+    T *cmin = cols->min, *cmax = cols->max;                                               \
+    MatrixValue *csum = cols->sum;                                                        \
+    int *cminRow = cols->minRow, *cmaxRow = cols->maxRow;                                 \
+    for (int i = firstRow; i <= lastRow; i++) {                                           \
+        const T *row = matrixRow(m, i);                                                   \
+        MatrixStats *rs = &rowStats[i];                                                   \
+        T rmin = row[firstCol], rmax = row[firstCol];                                     \
+        ACC rsum = 0;                                                                     \
+        for (int j = firstCol; j <= lastCol; j++) {                                       \
+            T v = row[j];                                                                 \
+            rsum += v;                                                                    \
+            rmin = v < rmin ? v : rmin;                                                   \
+            rmax = v > rmax ? v : rmax;                                                   \
+            csum[j].FIELD += v;                                                           \
+            int lt = (cminRow[j] < 0) | (v < cmin[j]);                                    \
+            int gt = (cmaxRow[j] < 0) | (v > cmax[j]);                                    \
+            cmin[j] = lt ? v : cmin[j];                                                   \
+            cminRow[j] = lt ? i : cminRow[j];                                             \
+            cmax[j] = gt ? v : cmax[j];                                                   \
+            cmaxRow[j] = gt ? i : cmaxRow[j];                                             \
+        }                                                                                 \
+        MatrixValue s;                                                                    \
+        s.FIELD = rsum;                                                                   \
+        addSum(rs, s);                                                                    \
+        addSum(tile, s);                                                                  \
+        /* segments come in order, so only a strictly better one moves a position */     \
+        if (rs->min_row < 0 || rmin < rs->min_value.FIELD || tile->min_row < 0 ||         \
+            rmin < tile->min_value.FIELD) {                                               \
+            int j = firstCol;                                                             \
+            while (j < lastCol && row[j] != rmin)                                         \
+                j++;                                                                      \
+            MatrixValue v;                                                                \
+            v.FIELD = rmin;                                                               \
+            updateMin(rs, v, i, j);                                                       \
+            updateMin(tile, v, i, j);                                                     \
+        }                                                                                 \
+        if (rs->max_row < 0 || rmax > rs->max_value.FIELD || tile->max_row < 0 ||         \
+            rmax > tile->max_value.FIELD) {                                               \
+            int j = firstCol;                                                             \
+            while (j < lastCol && row[j] != rmax)                                         \
+                j++;                                                                      \
+            MatrixValue v;                                                                \
+            v.FIELD = rmax;                                                               \
+            updateMax(rs, v, i, j);                                                       \
+            updateMax(tile, v, i, j);                                                     \
+        }                                                                                 \
+    }                                                                                     \
+}
+
+DEFINE_TILE_KERNEL(tileInt8,   int8_t,  long long, i)
+DEFINE_TILE_KERNEL(tileInt16,  int16_t, long long, i)
+DEFINE_TILE_KERNEL(tileInt32,  int32_t, long long, i)
+DEFINE_TILE_KERNEL(tileInt64,  int64_t, long long, i)
+DEFINE_TILE_KERNEL(tileFloat,  float,   double,    f)
+DEFINE_TILE_KERNEL(tileDouble, double,  double,    f)
+
+typedef void (*TileKernelFn)(const Matrix *m, int firstRow, int lastRow, int firstCol, int lastCol,
+                             TileColumns *cols, MatrixStats *rowStats, MatrixStats *tile);
+
+static const TileKernelFn tileKernels[MT_COUNT] = {
+    tileInt8, tileInt16, tileInt32, tileInt64, tileFloat, tileDouble
+};
+
+// the tile rows of worker w, first..last (empty if first > last)
+static inline void tileBand(const TileStats *ts, int w, int numWorkers, int *first, int *last) {
+    *first = (int)((long long)ts->gridRows * w / numWorkers);
+    *last = (int)((long long)ts->gridRows * (w + 1) / numWorkers) - 1;
+}
+
+/* Worker w of numWorkers: the rows, tiles and column accumulators of its
+   band of m, which must be the matrix ts was set up for. The last worker
+   to finish its band sets ts->global. */
+static inline void tileStatsBand(TileStats *ts, const Matrix *m, int w, int numWorkers) {
+    TileColumns *cols = &ts->partials[w];
+    MatrixStats *band = combinerSlot(&ts->bands, w);
+    TileKernelFn kernel = tileKernels[m->type];
+    int firstTile, lastTile;
+    tileBand(ts, w, numWorkers, &firstTile, &lastTile);
+
+    memset(cols->sum, 0, sizeof(MatrixValue) * m->cols);
+    memset(cols->minRow, 0xff, sizeof(int) * m->cols);  // -1
+    memset(cols->maxRow, 0xff, sizeof(int) * m->cols);
+    initStats(band, m->type);
+    for (int ti = firstTile; ti <= lastTile; ti++) {
+        int firstRow = ti * ts->tileRows;
+        int lastRow = firstRow + ts->tileRows - 1 < m->rows ? firstRow + ts->tileRows - 1 : m->rows - 1;
+        for (int i = firstRow; i <= lastRow; i++)
+            initStats(&ts->rowStats[i], m->type);
+        for (int tj = 0; tj < ts->gridCols; tj++) {
+            MatrixStats *tile = &ts->tileStats[ti * ts->gridCols + tj];
+            int firstCol = tj * ts->tileCols;
+            int lastCol = firstCol + ts->tileCols - 1 < m->cols ? firstCol + ts->tileCols - 1 : m->cols - 1;
+            initStats(tile, m->type);
+            kernel(m, firstRow, lastRow, firstCol, lastCol, cols, ts->rowStats, tile);
+        }
+        for (int i = firstRow; i <= lastRow; i++)
+            mergeStats(band, &ts->rowStats[i]);
+    }
+    if (combinerArrive(&ts->bands, w))
+        ts->global = *(MatrixStats *)combinerResult(&ts->bands);
+}
+
+// element j of an array of the element type as a MatrixValue
+static inline MatrixValue tileValue(MatrixType type, const void *base, int j) {
+    MatrixValue v;
+    switch (type) {
+    case MT_INT8:   v.i = ((const int8_t *)base)[j]; break;
+    case MT_INT16:  v.i = ((const int16_t *)base)[j]; break;
+    case MT_INT32:  v.i = ((const int32_t *)base)[j]; break;
+    case MT_INT64:  v.i = ((const int64_t *)base)[j]; break;
+    case MT_FLOAT:  v.f = ((const float *)base)[j]; break;
+    default:        v.f = ((const double *)base)[j]; break;
+    }
+    return v;
+}
+
+/* Worker w of numWorkers merges the column accumulators of all workers
+   for its share of the columns, after every tileStatsBand is done. */
+static inline void tileStatsColumns(TileStats *ts, int w, int numWorkers) {
+    int first = (int)((long long)ts->cols * w / numWorkers);
+    int last = (int)((long long)ts->cols * (w + 1) / numWorkers) - 1;
+    for (int j = first; j <= last; j++) {
+        MatrixStats *cs = &ts->colStats[j];
+        initStats(cs, ts->type);
+        for (int p = 0; p < ts->numWorkers; p++) {
+            const TileColumns *cols = &ts->partials[p];
+            if (cols->minRow[j] < 0)
+                continue;  // an empty band
+            addSum(cs, cols->sum[j]);
+            updateMin(cs, tileValue(ts->type, cols->min, j), cols->minRow[j], j);
+            updateMax(cs, tileValue(ts->type, cols->max, j), cols->maxRow[j], j);
+        }
+    }
+}
+
+// index of the largest sum among n stats (rows, columns or tiles)
+static inline int tileLargestSum(const MatrixStats *stats, int n) {
+    int best = 0;
+    for (int k = 1; k < n; k++)
+        if (valueLess(stats[k].type, stats[best].sum, stats[k].sum))
+            best = k;
+    return best;
+}
+
+#endif /* TILE_STATS_H */